@@ -1,5 +1,5 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 LOCAL_MODULE := slave
-LOCAL_SRC_FILES := slave.cpp common.cpp
+LOCAL_SRC_FILES := slave.cpp common.cpp stor.cpp
 include $(BUILD_EXECUTABLE)
@@ -16,8 +16,17 @@
 
 #include "common.h"
 #include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
 
 using namespace hashhash;
+using std::string;
+using std::unordered_map;
+using std::vector;
 
 // "Sex appeal", as Sol would say
 static const char *const SHL_PS1 = "#hashtable> ";
@@ -26,26 +35,81 @@ static const char *const SHL_PS1 = "#hashtable> ";
 static const char *const CMD_PUT = "put";
 static const char *const CMD_SND = "send";
 static const char *const CMD_GET = "get";
+static const char *const CMD_MGT = "mget";
+static const char *const CMD_MPT = "load";
 static const char *const CMD_GFO = "quit";
 static const char *const CMD_HLP = "?";
 
+// A value we may keep serving ourselves until its lease runs out, unless the master tells us otherwise first
+struct leasedval {
+	string data;
+	uint64_t expiry; // by our clock, which is never later than the master's
+	bool packed; // whether data is still as packval() left it
+};
+
+static uint32_t lease_ms = 0; // 0 unless we asked for leases and the master agreed
+static unordered_map<string, struct leasedval> *leased = NULL;
+static bool direct = false; // whether to read values straight from the slaves that hold them
+static bool located = false; // whether the master has ever answered a WHR
+static bool packing = false; // whether to pack the values we send, where they shrink and the master takes them so
+static unordered_map<string, int> *slave_fds = NULL; // connections to slaves we've read from, by location
+static const char *master_host = NULL; // where to find the master again if we have to reconnect
+
 static size_t readfile(const char *, char **);
 static bool writefile(const char *, const char *, unsigned int);
 
+static void handshake(int);
+static void askforleases(int);
+static void dropstale(int);
+static bool recvanswer(int, uint16_t, char **, uint16_t *, size_t *);
+static void forget(const char *);
+static bool sendval(int, const char *, const char *, size_t);
+static bool readdirect(int *, const char *, char **, size_t *, bool *);
+static bool reconnect(int *);
+static int slaveconn(const string &);
 static void usage(const char *, const char *, const char *);
 static void hand();
 
 int main(int argc, char **argv) {
-	if(argc < 2) {
-		printf("USAGE: %s <hostname>\n", argv[0]);
+	int opt;
+	bool caching = false;
+	while((opt = getopt(argc, argv, "cdf:z")) != -1) {
+		switch(opt) {
+			case 'c':
+				caching = true;
+				break;
+			case 'd':
+				direct = true;
+				break;
+			case 'f':
+				setframelen(atol(optarg));
+				break;
+			case 'z':
+				packing = true;
+				break;
+			default:
+				optind = argc; // print usage
+		}
+	}
+
+	if(argc - optind < 1) {
+		printf("USAGE: %s [-c] [-d] [-f frame bytes] [-z] <hostname>\n", argv[0]);
 		return RETVAL_INVALID_ARG;
 	}
 	
 	int srv_fd = -1;
-	if(!rslvconn(&srv_fd, argv[1], PORT_MASTER_CLIENTS)) {
-		printf("FATAL: Couldn't resolve or connect to host: %s\n", argv[1]);
+	master_host = argv[optind];
+	if(!rslvconn(&srv_fd, master_host, PORT_MASTER_CLIENTS)) {
+		printf("FATAL: Couldn't resolve or connect to host: %s\n", argv[optind]);
 		return RETVAL_CONN_FAILED;
 	}
+	handshake(srv_fd);
+	if(caching)
+		askforleases(srv_fd);
+	if(direct) {
+		signal(SIGPIPE, SIG_IGN); // a slave going away shows up as a failed write instead
+		slave_fds = new unordered_map<string, int>();
+	}
 	
 	// Allocate (small) space to store user input:
 	char *buf = (char*)malloc(1);
@@ -81,7 +145,8 @@ int main(int argc, char **argv) {
 				continue;
 			}
 				
-			sendfile(srv_fd, key, val, strlen(val));
+			forget(key);
+			sendval(srv_fd, key, val, strlen(val));
 		} else if(strncmp(cmd, CMD_SND, len) == 0) {
 			char *key = strtok(NULL, " ");
 			char *fileval = strtok(NULL, " ");
@@ -103,9 +168,35 @@ int main(int argc, char **argv) {
 				continue;
 			}
 				
-			sendfile(srv_fd, key, val, valsize);
+			forget(key);
+			sendval(srv_fd, key, val, valsize);
 			
 			free(val);
+		} else if(strncmp(cmd, CMD_MPT, len) == 0) {
+			vector<char *> words;
+			for(char *word = strtok(NULL, " "); word; word = strtok(NULL, " "))
+				words.push_back(word);
+			
+			if(!words.size()) {
+				usage(CMD_MPT, "key", "val...");
+				continue;
+			} else if(words.size() % 2) {
+				usage(CMD_MPT, "val", NULL);
+				continue;
+			}
+			for(size_t word = 0; word < words.size(); word += 2)
+				forget(words[word]);
+			
+			if(getproto(srv_fd) >= PROTO_V2) {
+				// Send all the pairs at once
+				std::string packed;
+				for(size_t word = 0; word < words.size(); word += 2)
+					packpair(&packed, words[word], words[word+1], strlen(words[word+1]));
+				sendpkt(srv_fd, OPC_MPT, packed.data(), packed.size());
+			} else {
+				for(size_t word = 0; word < words.size(); word += 2)
+					sendfile(srv_fd, words[word], words[word+1], strlen(words[word+1]));
+			}
 		} else if(strncmp(cmd, CMD_GET, len) == 0) {
 			char *key = strtok(NULL, " ");
 			char *filedest = strtok(NULL, " ");
@@ -115,37 +206,142 @@ int main(int argc, char **argv) {
 				continue;
 			}
 			
-			sendpkt(srv_fd, OPC_PLZ, key, 0);
-			
 			char *rcvfiledata;
 			char *rcvfilename;
 			size_t dlen;
 			
-			bool incoming = false;
-			recvpkt(srv_fd, OPC_HRZ|OPC_FKU, &rcvfilename, &incoming, NULL, false);
+			dropstale(srv_fd);
+			if(lease_ms) { // otherwise we've nothing leased to look in
+				auto copy = leased->find(key);
+				if(copy != leased->end() && nowms() < copy->second.expiry) {
+					// Our lease is still good, so the master would only tell us what we already know
+					printf("Using our leased copy of '%s'\n", key);
+					const char *value = copy->second.data.c_str();
+					size_t vlen = copy->second.data.size();
+					char *raw = NULL;
+					if(copy->second.packed && unpackval(value, vlen, &raw, &vlen))
+						value = raw; // it was whole when it arrived, so this can't fail
+					if(filedest) {
+						if(!writefile(filedest, value, vlen)) {
+							printf("Failed to write data to local file\n");
+						}
+					} else {
+						printf("Our lease says that [%s] = [%s]\n", key, value);
+					}
+					free(raw);
+					continue;
+				}
+			}
 			
-			if(!incoming) {
-				printf("The master couldn't give us the value! Oh well.\n");
+			uint64_t asked = nowms(); // the master starts the lease after this, so ours expires no later than its
+			bool packed = false;
+			bool fromslave = direct && readdirect(&srv_fd, key, &rcvfiledata, &dlen, &packed);
+			if(fromslave) {
+				rcvfilename = key;
+				printf("Got %lu bytes straight from a slave\n", dlen);
+			} else {
+				sendpkt(srv_fd, OPC_PLZ, key, 0);
+				
+				uint16_t opcode = 0;
+				recvanswer(srv_fd, OPC_HRZ|OPC_FKU, &rcvfilename, &opcode, NULL);
+				
+				if(opcode != OPC_HRZ) {
+					printf("The master couldn't give us the value! Oh well.\n");
+					continue;
+				}
+				
+				printf("Receiving value of '%s'\n", rcvfilename);
+				packed = ispacked(srv_fd);
+				recvfile(srv_fd, &rcvfiledata, &dlen);
+				printf("Got %lu bytes\n", dlen);
+			}
+
+			// Values are only ever unpacked here, right before they're used
+			char *raw = NULL;
+			size_t rawlen = 0;
+			if(packed && !unpackval(rcvfiledata, dlen, &raw, &rawlen)) {
+				printf("The value of '%s' arrived garbled! Oh well.\n", rcvfilename);
+				free(rcvfiledata);
 				continue;
 			}
-			
-			printf("Receiving value of '%s'\n", rcvfilename);
-			recvfile(srv_fd, &rcvfiledata, &dlen);
-			printf("Got %lu bytes\n", dlen);
+			if(lease_ms && !fromslave)
+				(*leased)[rcvfilename] = {string(rcvfiledata, dlen), asked + lease_ms, packed}; // only the master's answers come with leases
+			if(packed) {
+				printf("Unpacked them into %lu bytes\n", rawlen);
+				free(rcvfiledata);
+				rcvfiledata = raw;
+				dlen = rawlen;
+			}
 			
 			if(filedest) {
 				if(!writefile(filedest, rcvfiledata, dlen)) {
 					printf("Failed to write data to local file\n");
 				}
 			} else {
-				printf("The master says that [%s] = [%s]\n", rcvfilename, rcvfiledata);
+				printf("The %s says that [%s] = [%s]\n", fromslave ? "slave" : "master", rcvfilename, rcvfiledata);
 			}
 		}
+		else if(strncmp(cmd, CMD_MGT, len) == 0) {
+			vector<char *> keys;
+			for(char *key = strtok(NULL, " "); key; key = strtok(NULL, " "))
+				keys.push_back(key);
+			
+			if(!keys.size()) {
+				usage(CMD_MGT, "key...", NULL);
+				continue;
+			}
+			
+			bool batched = getproto(srv_fd) >= PROTO_V2;
+			if(batched) {
+				// Send all the keys at once, each with its null terminator
+				vector<char> packed;
+				for(char *key : keys)
+					packed.insert(packed.end(), key, key + strlen(key) + 1);
+				sendpkt(srv_fd, OPC_MGT, packed.data(), packed.size());
+			} else {
+				// Older masters answer one PLZ at a time, but will still take them all up front
+				for(char *key : keys)
+					sendpkt(srv_fd, OPC_PLZ, key, 0);
+			}
+			
+			for(size_t answer = 0; answer < keys.size(); ++answer) {
+				char *rcvfilename = NULL;
+				uint16_t opcode = 0;
+				if(!recvanswer(srv_fd, OPC_HRZ|OPC_FKU, &rcvfilename, &opcode, NULL)) {
+					printf("Lost track of the master's answers! Oh well.\n");
+					break;
+				}
+				
+				if(opcode != OPC_HRZ) {
+					printf("The master couldn't give us the value of '%s'! Oh well.\n", batched ? rcvfilename : keys[answer]);
+					free(rcvfilename);
+					continue;
+				}
+				
+				char *rcvfiledata;
+				size_t dlen;
+				bool packed = ispacked(srv_fd);
+				recvfile(srv_fd, &rcvfiledata, &dlen);
+				char *raw = NULL;
+				if(packed && !unpackval(rcvfiledata, dlen, &raw, &dlen))
+					printf("The value of '%s' arrived garbled! Oh well.\n", rcvfilename);
+				else
+					printf("The master says that [%s] = [%s]\n", rcvfilename, raw ? raw : rcvfiledata);
+				free(rcvfilename);
+				free(rcvfiledata);
+				free(raw);
+			}
+			
+			if(batched)
+				recvanswer(srv_fd, OPC_THX, NULL, NULL, NULL);
+		}
 		else if(strncmp(cmd, CMD_HLP, len) == 0) { 
 			printf("Commands may be abbreviated.  Commands are:\n\n");
 			printf("%s\t\tsend text value as key\n", CMD_PUT);
 			printf("%s\t\tsend text file as key\n", CMD_SND);
+			printf("%s\t\tsend several text values at once, as key val pairs\n", CMD_MPT);
 			printf("%s\t\treceive value of key (optional path to receive to file)\n", CMD_GET);
+			printf("%s\t\treceive values of several keys at once\n", CMD_MGT);
 			printf("%s\t\texit #hashtable\n", CMD_GFO);
 			printf("%s\t\tprint help information\n", CMD_HLP);
 		}
@@ -206,6 +402,202 @@ bool writefile(const char *path, const char *data, unsigned int dlen) {
 	return true;
 }
 
+// Offers the master the newest protocol version we speak.  Masters too old to understand don't answer, in which case we stick with version 1.
+// Accepts: file descriptor connected to the master
+void handshake(int srv_fd) {
+	setproto(srv_fd, PROTO_V1);
+	if(!sendhey(srv_fd, PROTO_LATEST))
+		return;
+
+	struct pollfd answer = {srv_fd, POLLIN, 0};
+	uint8_t version;
+	if(poll(&answer, 1, HANDSHAKE_TIMEOUT) > 0 && recvhey(srv_fd, &version))
+		setproto(srv_fd, version);
+}
+
+// Asks the master to lease us the values we get, so that we can serve repeated gets ourselves.  Masters that don't lease don't answer, in which case we refetch every time.
+// Accepts: file descriptor connected to the master
+void askforleases(int srv_fd) {
+	if(getproto(srv_fd) < PROTO_V2 || !sendpkt(srv_fd, OPC_DIB, NULL, 0))
+		return;
+
+	struct pollfd answer = {srv_fd, POLLIN, 0};
+	char *grant = NULL;
+	size_t len = 0;
+	if((buffered(srv_fd) || poll(&answer, 1, HANDSHAKE_TIMEOUT) > 0) && recvpkt(srv_fd, OPC_DIB, &grant, NULL, &len, false) && len == sizeof lease_ms)
+		memcpy(&lease_ms, grant, sizeof lease_ms);
+	free(grant);
+	if(lease_ms && !leased) {
+		leased = new unordered_map<string, struct leasedval>();
+		printf("The master will lease us values for %u ms at a time\n", lease_ms);
+	}
+}
+
+// Throws out the values the master has told us were replaced since we last listened, without waiting for any more such news
+// Accepts: file descriptor connected to the master
+void dropstale(int srv_fd) {
+	if(!lease_ms)
+		return;
+
+	struct pollfd news = {srv_fd, POLLIN, 0};
+	char *key;
+	while((buffered(srv_fd) || poll(&news, 1, 0) > 0) && recvpkt(srv_fd, OPC_NVM, &key, NULL, NULL, false)) {
+		leased->erase(key);
+		free(key);
+	}
+}
+
+// Receives the first packet of the master's answer, acting on any NVMs that it sent ahead of it
+// Accepts: file descriptor connected to the master, OR of acceptable opcodes, and the same spots for the payload, opcode, and payload length as recvpkt()
+// Returns: whether an acceptable opcode arrived
+bool recvanswer(int srv_fd, uint16_t opcsel, char **buf, uint16_t *opcode, size_t *len) {
+	if(!lease_ms)
+		return recvpkt(srv_fd, opcsel, buf, opcode, len, false);
+
+	char *payld = NULL;
+	uint16_t got = 0;
+	while(recvpkt(srv_fd, opcsel|OPC_NVM, &payld, &got, len, false)) {
+		if(opcode)
+			*opcode = got;
+		if(got != OPC_NVM) {
+			if(buf)
+				*buf = payld;
+			else
+				free(payld);
+			return true;
+		}
+		leased->erase(payld);
+		free(payld);
+	}
+	if(opcode)
+		*opcode = got;
+	return false;
+}
+
+// Stops trusting our leased copy of a value that we're replacing ourselves
+// Accepts: the key
+void forget(const char *key) {
+	if(lease_ms)
+		leased->erase(key);
+}
+
+// Sends a value to the master, packing it first if we've been asked to and it shrinks enough to be worth it
+// Accepts: file descriptor connected to the master, the key, the value, and its length
+// Returns: whether it was sent
+bool sendval(int srv_fd, const char *key, const char *val, size_t len) {
+	char *packed;
+	size_t packedlen;
+	if(!packing || getproto(srv_fd) < PROTO_V4 || !packval(val, len, &packed, &packedlen))
+		return sendfile(srv_fd, key, val, len);
+
+	printf("Packed %lu bytes into %lu\n", len, packedlen);
+	bool sent = sendfile(srv_fd, key, packed, packedlen, 0, true);
+	free(packed);
+	return sent;
+}
+
+// Asks the master which slaves hold a value, then reads it from the first of them that's willing.  Masters that don't locate values never answer, in which case we stop asking, and start over on a new connection in case the answer was only slow in coming.
+// Accepts: spot holding the file descriptor connected to the master (which may be replaced), the key, and spots for the value, its length, and whether it's packed
+// Returns: whether a slave gave us the value, or false if we should ask the master for it instead
+bool readdirect(int *srv_fd, const char *key, char **data, size_t *dlen, bool *packed) {
+	if(getproto(*srv_fd) < PROTO_V2 || !sendpkt(*srv_fd, OPC_WHR, key, strlen(key)))
+		return false;
+	if(!located) {
+		struct pollfd answer = {*srv_fd, POLLIN, 0};
+		if(!buffered(*srv_fd) && poll(&answer, 1, HANDSHAKE_TIMEOUT) <= 0) {
+			printf("The master won't say where values are, so we'll read through it instead\n");
+			direct = false;
+			if(!reconnect(srv_fd)) {
+				printf("FATAL: Couldn't reconnect to host: %s\n", master_host);
+				exit(RETVAL_CONN_FAILED);
+			}
+			return false;
+		}
+		located = true;
+	}
+
+	char *where = NULL;
+	size_t len = 0;
+	uint16_t opcode = 0;
+	if(!recvanswer(*srv_fd, OPC_WHR|OPC_FKU, &where, &opcode, &len) || opcode != OPC_WHR) {
+		free(where);
+		return false;
+	}
+
+	bool got = false;
+	const size_t loclen = sizeof(in_addr_t) + sizeof(in_port_t);
+	for(size_t off = 0; !got && off + loclen <= len; off += loclen) {
+		string loc(where + off, loclen);
+		int slave_fd = slaveconn(loc);
+		if(slave_fd < 0)
+			continue;
+
+		char *name = NULL;
+		uint16_t answer = 0;
+		if(sendpkt(slave_fd, OPC_PLZ, key, 0) && recvpkt(slave_fd, OPC_HRZ|OPC_FKU, &name, &answer, NULL, false) && answer == OPC_HRZ) {
+			*packed = ispacked(slave_fd);
+			got = recvfile(slave_fd, data, dlen);
+		}
+		free(name);
+		if(!got && answer != OPC_FKU) {
+			// We've lost our place in the conversation, so start over next time
+			rdforget(slave_fd);
+			close(slave_fd);
+			slave_fds->erase(loc);
+		}
+	}
+	free(where);
+	return got;
+}
+
+// Swaps our connection to the master for a new one, for when it might still send answers to requests we've given up on.  The master forgets our leases along with the old connection, so we do too.
+// Accepts: spot holding the file descriptor connected to the master, which is replaced
+// Returns: whether we got through again
+bool reconnect(int *srv_fd) {
+	rdforget(*srv_fd);
+	close(*srv_fd);
+	if(!rslvconn(srv_fd, master_host, PORT_MASTER_CLIENTS))
+		return false;
+	handshake(*srv_fd);
+	if(lease_ms) {
+		leased->clear();
+		lease_ms = 0;
+		askforleases(*srv_fd);
+	}
+	return true;
+}
+
+// Finds our connection to a slave, making and upgrading a new one if need be
+// Accepts: the slave's location, as the master gave it to us
+// Returns: file descriptor connected to the slave, or -1 if we couldn't reach it
+int slaveconn(const string &loc) {
+	auto found = slave_fds->find(loc);
+	if(found != slave_fds->end())
+		return found->second;
+
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof dest);
+	dest.sin_family = AF_INET;
+	memcpy(&dest.sin_addr.s_addr, loc.data(), sizeof dest.sin_addr.s_addr);
+	memcpy(&dest.sin_port, loc.data() + sizeof dest.sin_addr.s_addr, sizeof dest.sin_port);
+
+	int slave_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(slave_fd < 0)
+		return -1;
+	setproto(slave_fd, PROTO_V1);
+	struct pollfd answer = {slave_fd, POLLIN, 0};
+	uint8_t version = PROTO_V1;
+	if(connect(slave_fd, (const struct sockaddr *)&dest, sizeof dest) || !sendhey(slave_fd, PROTO_LATEST) || poll(&answer, 1, HANDSHAKE_TIMEOUT) <= 0 || !recvhey(slave_fd, &version) || version < PROTO_V2) {
+		rdforget(slave_fd);
+		close(slave_fd);
+		return -1;
+	}
+	setproto(slave_fd, version);
+
+	(*slave_fds)[loc] = slave_fd;
+	return slave_fd;
+}
+
 // Prints to standard error the usage string describing a command expecting one required argument and up to one optional argument.
 // Accepts: the command, its required argument, and its second required argument (which can be NULL)
 void usage(const char *cmd, const char *reqd, const char *reqd2) {
@@ -16,14 +16,69 @@
 
 #include "common.h"
 
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+using namespace hashhash;
+using std::vector;
+
+static const size_t HDR2_MAXLEN = 3 + sizeof(uint64_t) + sizeof(uint32_t);
+static const size_t RDBUF_LEN = 1 << 16; // read from a connection at once whenever we're after less than half this
+static const uint64_t PAIR_PACKED = 1ULL << 63; // set in an MPT pair's value length if the value is packed
+static const size_t PACK_MIN_MATCH = 4; // shortest repeat worth referring back to
+static const size_t PACK_WINDOW = UINT16_MAX; // furthest back a repeat may be found
+static const unsigned int PACK_HASH_BITS = 12; // the packer remembers where it last saw this many distinct hashes of PACK_MIN_MATCH bytes
+
+// Bytes read from a connection ahead of whoever's parsing it, so that a run of small packets costs a single recv()
+struct rdbuf {
+	char *data; // NULL until the connection is first read from
+	size_t cap;
+	size_t head; // first byte not yet consumed
+	size_t tail; // one past the last byte read
+	size_t stashat; // where the last view's terminator overwrote the first byte after it, or SIZE_MAX
+	char stashed; // the byte that was there
+	uint8_t flags; // of the last header read, or 0 if it was in version 1 format
+};
+
+static size_t frame_len = DEFAULT_FRAME_LEN;
+static pthread_mutex_t protos_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<uint8_t> protos; // indexed by file descriptor; acquire protos_lock before reading or writing
+static pthread_mutex_t rdbufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<struct rdbuf *> rdbufs; // indexed by file descriptor; acquire rdbufs_lock to look one up, after which it belongs to whoever is reading from the connection
+
+static size_t hdrlen2(uint8_t);
+static size_t pktlen(uint16_t, const char *, int);
+static struct rdbuf *rdbufof(int);
+static ssize_t rdfill(int, struct rdbuf *, bool);
+static bool rdneed(int, struct rdbuf *, size_t);
+static ssize_t rdtake(int, struct rdbuf *, char *, size_t, bool);
+static bool sendfile2(int, const char *, const char *, size_t, uint32_t, bool);
+static void frameiov(int, uint16_t, const char *, size_t, uint32_t, bool, vector<uint8_t> &, vector<struct iovec> &);
+static bool splicen(int, int, const int *, size_t);
+static void discard(int, uint64_t);
+static size_t mkhdr(int, uint8_t *, uint16_t, uint64_t, uint32_t, bool = false);
+static size_t mkhdr2(uint8_t *, uint16_t, uint64_t, uint32_t, bool);
+static uint8_t *packlen(uint8_t *, size_t);
+static bool unpacklen(const uint8_t **, const uint8_t *, size_t *);
+static uint64_t keymix(uint64_t);
+static bool writevall(int, struct iovec *, size_t);
 
 // Creates a socket and binds it to the specified port, optionally listening for incoming connections
 // Accepts: socket file descriptor (0 for ephemeral), queue length (0 to skip listening)
@@ -67,48 +122,55 @@ bool hashhash::rslvconn(int *sfd, const char *hname, in_port_t port)
 }
 
 // Listens on socket, ensuring the next packet to arrive is of one of the requested opcodes. If it is an carries data, that data is returned.
-// Accepts: file descriptor, OR of acceptable opcodes, caller-owned buffer if that opcode provides data, bool to set true if this is a HRZ, payload length (stf only), whether or not to enable non-blocking on the file descriptor
-// Returns: whether the expected opcode was received, or false if not waiting and no SUP packet was available to be read
-bool hashhash::recvpkt(int sfd, uint16_t opcsel, char **buf, bool *ishrz, uint16_t *stflen, bool nowait)
+// Accepts: file descriptor, OR of acceptable opcodes, caller-owned buffer if that opcode provides data, spot for the opcode that arrived, payload length (stf and hey only), whether to give up straight away if nothing has arrived yet
+// Returns: whether the expected opcode was received, or false if not waiting and nothing was available to be read; over version 2 and later, a broken connection also yields false
+bool hashhash::recvpkt(int sfd, uint16_t opcsel, char **buf, uint16_t *opcode, size_t *len, bool nowait)
 {
-	uint16_t size;
-	
-	if(nowait) {
-		fcntl(sfd, F_SETFL, O_NONBLOCK);
-	}
-	
-	usleep(15); // TODO: We believe MSG_PEEK has a race condition... find the bug in Linux?!
-	if(recv(sfd, &size, sizeof size, MSG_PEEK) < 0) {
-		if(opcsel == OPC_SUP) {
+	bool v2 = getproto(sfd) >= PROTO_V2;
+	if(nowait && !buffered(sfd) && rdfill(sfd, rdbufof(sfd), true) <= 0)
+		return false;
+
+	uint16_t opc;
+	uint64_t size;
+	const char *payld;
+	if(!recvview(sfd, &opc, &payld, &size, NULL)) {
+		if(v2 || opcsel == OPC_SUP)
 			return false;
-		} else {
-			handle_error("recv()");
-		}
+		handle_error("recv()");
 	}
 
-	uint8_t packet[size+3];
-	if(read(sfd, packet, size+3) < 0)
-		handle_error("read()");
-
-	uint8_t opcode = packet[2]; // actual opcode
-	if(!(opcode&opcsel))
+	if(opcode)
+		*opcode = opc;
+	if(!(opc&opcsel))
 		return false; // not the opcode you're looking for
-	switch(opcode) {
+	if(v2) {
+		if(!buf)
+			return true;
+		*buf = (char *)malloc(size+1);
+		memcpy(*buf, payld, size+1);
+		if(len)
+			*len = size;
+		return true;
+	}
+
+	switch(opc) {
+		case OPC_HEY:
+			if(!buf)
+				return true; // caller doesn't care which version the peer speaks
 		case OPC_HRZ:
-			*ishrz = 1;
 		case OPC_PLZ:
 			*buf = (char *)malloc(size+1);
-			memcpy(*buf, packet+3, size);
-			(*buf)[size] = '\0';
+			memcpy(*buf, payld, size+1);
+			if(len)
+				*len = size;
 			return true;
 
 		case OPC_STF:
-			*stflen = size;
+			*len = size;
 			*buf = (char *)malloc(size);
-			memcpy(*buf, packet+3, size);
+			memcpy(*buf, payld, size);
 			return true;
 
-		case OPC_HEY:
 		case OPC_BYE:
 		case OPC_FKU:
 		case OPC_SUP:
@@ -118,6 +180,145 @@ bool hashhash::recvpkt(int sfd, uint16_t opcsel, char **buf, bool *ishrz, uint16
 	}
 }
 
+// Reads a whole packet or frame, handing back a view of its payload in the connection's buffer instead of a copy.  The view is null terminated, and stays valid until the connection is next read from.
+// Accepts: file descriptor, spot for the opcode, spot for the payload, spot for its length, spot for its request tag (set to 0 if untagged, or may be NULL)
+// Returns: whether the whole thing arrived
+bool hashhash::recvview(int sfd, uint16_t *opcode, const char **payld, uint64_t *len, uint32_t *tag) {
+	return recvhdr(sfd, opcode, len, tag) && viewall(sfd, *len, payld);
+}
+
+// Reads the given number of bytes, such as the payload of a frame whose header has been consumed, handing back a view of them in the connection's buffer instead of a copy.  The view is null terminated, and stays valid until the connection is next read from.
+// Accepts: file descriptor, number of bytes, spot for the view
+// Returns: whether they all arrived before the connection broke
+bool hashhash::viewall(int sfd, size_t len, const char **view) {
+	struct rdbuf *rb = rdbufof(sfd);
+	if(!rdneed(sfd, rb, len))
+		return false;
+	*view = rb->data + rb->head;
+	rb->head += len;
+	if(rb->head < rb->tail) {
+		rb->stashat = rb->head;
+		rb->stashed = rb->data[rb->head];
+	}
+	rb->data[rb->head] = '\0';
+	return true;
+}
+
+// Tells whether bytes have been read from a connection that nobody has consumed yet, in which case polling it won't necessarily say so.  Any view of the connection's buffer is invalidated.
+// Accepts: file descriptor
+// Returns: whether there are any
+bool hashhash::buffered(int sfd) {
+	struct rdbuf *rb = rdbufof(sfd);
+	return rb->head != rb->tail;
+}
+
+// Continues reading a packet using only the bytes that have already arrived, so it never blocks.  Whatever follows the packet (e.g. a HRZ's STFs) is left for other means of reading.
+// Accepts: file descriptor, the partial packet to continue (zeroed before the first call for each packet)
+// Returns: 1 if the packet is now complete, 0 if more of it has yet to arrive, or -1 if the connection broke or closed (or claimed a version 2 frame longer than our frame length)
+int hashhash::recvpart(int sfd, struct partpkt *pkt) {
+	bool v2 = getproto(sfd) >= PROTO_V2;
+	struct rdbuf *rb = rdbufof(sfd);
+	while(!pkt->payld) {
+		// Headers are tiny, so only parse one once it's all here
+		size_t have = rb->tail - rb->head;
+		const uint8_t *hdr = (const uint8_t *)rb->data + rb->head;
+		size_t hdrlen = v2 && have >= 3 ? hdrlen2(hdr[2]) : 3;
+		if(have >= hdrlen) {
+			rb->flags = v2 ? hdr[2] : 0;
+			if(v2) {
+				pkt->opcode = *(uint16_t *)hdr;
+				if(hdr[2] & FLG_WIDE)
+					memcpy(&pkt->len, hdr + 3, sizeof pkt->len);
+				else
+					pkt->len = *(uint32_t *)(hdr + 3);
+			} else {
+				pkt->len = *(uint16_t *)hdr;
+				pkt->opcode = hdr[2];
+			}
+			if(v2 && pkt->len > frame_len) {
+				// Requests hold only keys (and a load's few pairs), so this is nothing we'd want to make room for
+				errno = EMSGSIZE;
+				return -1;
+			}
+			rb->head += hdrlen; // clients don't tag their requests, so we've no use for one
+			if(!(pkt->payld = (char *)malloc(pkt->len + 1)))
+				return -1;
+			break;
+		}
+
+		ssize_t got = rdfill(sfd, rb, true);
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if(got <= 0)
+			return -1;
+	}
+
+	while(pkt->paygot < pkt->len) {
+		ssize_t got = rdtake(sfd, rb, pkt->payld + pkt->paygot, pkt->len - pkt->paygot, true);
+		if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if(got <= 0)
+			return -1;
+		pkt->paygot += got;
+	}
+
+	pkt->payld[pkt->len] = '\0';
+	return 1;
+}
+
+// Reads the header of the next packet or frame, consuming exactly its bytes and no more.
+// Accepts: file descriptor, spot for the opcode, spot for the length of the payload that follows, spot for its request tag (set to 0 if untagged, or may be NULL)
+// Returns: whether a whole header arrived
+bool hashhash::recvhdr(int sfd, uint16_t *opcode, uint64_t *len, uint32_t *tag)
+{
+	if(tag)
+		*tag = 0;
+
+	struct rdbuf *rb = rdbufof(sfd);
+	if(!rdneed(sfd, rb, 3))
+		return false;
+	if(getproto(sfd) < PROTO_V2) {
+		const uint8_t *hdr = (const uint8_t *)rb->data + rb->head;
+		*len = *(uint16_t *)hdr;
+		*opcode = hdr[2];
+		rb->head += 3;
+		rb->flags = 0;
+		return true;
+	}
+
+	size_t hdrlen = hdrlen2(rb->data[rb->head + 2]);
+	if(!rdneed(sfd, rb, hdrlen))
+		return false;
+	const uint8_t *hdr = (const uint8_t *)rb->data + rb->head;
+	*opcode = *(uint16_t *)hdr;
+	if(hdr[2] & FLG_WIDE) {
+		memcpy(len, hdr + 3, sizeof *len);
+	} else {
+		uint32_t narrow;
+		memcpy(&narrow, hdr + 3, sizeof narrow);
+		*len = narrow;
+	}
+	if(tag && hdr[2] & FLG_TAGGED)
+		memcpy(tag, hdr + hdrlen - sizeof *tag, sizeof *tag);
+	rb->flags = hdr[2];
+	rb->head += hdrlen;
+	return true;
+}
+
+// Tells whether the last header read from a connection announced a packed value, as only a HRZ's can.  Check before reading the value's STFs, whose own headers will replace it.  Any view of the connection's buffer is invalidated.
+// Accepts: file descriptor
+// Returns: whether the value must be passed to unpackval() before use
+bool hashhash::ispacked(int sfd) {
+	return rdbufof(sfd)->flags & FLG_PACKED;
+}
+
+// Works out how long a version 2 header is from its flags.
+// Accepts: the flags byte
+// Returns: the header's length in bytes
+static size_t hdrlen2(uint8_t flags) {
+	return 3 + (flags & FLG_WIDE ? sizeof(uint64_t) : sizeof(uint32_t)) + (flags & FLG_TAGGED ? sizeof(uint32_t) : 0);
+}
+
 // Reads a value from the given network socket.
 // Accepts: file descriptor, caller-owned buffer, spot for the (newly) allocated buffer's length
 // Returns: whether a file was received reasonably
@@ -125,24 +326,32 @@ bool hashhash::recvfile(int sfd, char **data, size_t *dlen) {
 	size_t cap = MAX_PACKET_LEN-3+1;
 	*data = (char *)malloc(cap);
 	*dlen = 0;
+	if(!*data)
+		return false;
 
-	uint16_t llen;
+	uint64_t llen;
 
 	do {
-		if(cap-*dlen <= MAX_PACKET_LEN-3) {
+		uint16_t opcode;
+		if(!recvhdr(sfd, &opcode, &llen, NULL) || opcode != OPC_STF)
+			return false; // bad shit happened
+		if(llen >= SIZE_MAX/2 - *dlen)
+			return false; // no buffer could hold it, so the length is garbage
+
+		if(cap-*dlen <= llen) {
 			// The buffer won't fit the next packet!
-			char *buf = (char*)malloc(cap*2);
-			memcpy(buf, *data, cap);
+			while(cap-*dlen <= llen)
+				cap *= 2;
+			char *buf = (char*)malloc(cap);
+			if(!buf)
+				return false;
+			memcpy(buf, *data, *dlen);
 			free(*data);
 			*data = buf;
-			cap *= 2;
 		}
 
-		char *line;
-		if(!recvpkt(sfd, OPC_STF, &line, NULL, &llen, false))
-			return false; // bad shit happened
-		memcpy(*data+*dlen, line, llen);
-		free(line);
+		if(!readall(sfd, *data+*dlen, llen))
+			return false;
 		*dlen += llen;
 	}
 	while(llen);
@@ -152,54 +361,117 @@ bool hashhash::recvfile(int sfd, char **data, size_t *dlen) {
 	return true;
 }
 
+// Reads the next piece of a value that's streaming in, without waiting for any more of it than is already on its way in the current frame.
+// Accepts: file descriptor whose HRZ has already been consumed, destination buffer, its capacity, spot for how many bytes were read (0 once the terminating STF arrives), bytes left in the current frame (0 before the first call)
+// Returns: whether the connection was still sane
+bool hashhash::recvchunk(int sfd, char *buf, size_t cap, size_t *got, uint64_t *frameleft) {
+	*got = 0;
+	if(!*frameleft) {
+		uint16_t opcode;
+		if(!recvhdr(sfd, &opcode, frameleft, NULL) || opcode != OPC_STF)
+			return false;
+		if(!*frameleft)
+			return true; // that's all, folks
+	}
+
+	size_t want = std::min((uint64_t)cap, *frameleft);
+	if(!readall(sfd, buf, want))
+		return false;
+	*got = want;
+	*frameleft -= want;
+	return true;
+}
+
 // Builds a packet in the #hashtag protocol fashion and sends it through a socket.
-// Accepts: file descriptor, opcode for packet, string data (in case packet needs it), number of STF packets to come (for hrz packets only), amount of data to read from buffer (for stf packets only)
+// Accepts: file descriptor, opcode for packet, string data (in case packet needs it), amount of data to read from buffer (for stf packets only), request tag (only sent over version 3 connections), whether the value a HRZ announces will follow packed (which the caller mustn't send over connections older than version 4)
 // Returns: whether or not the packet was successfully sent
-bool hashhash::sendpkt(int sfd, uint8_t opcode, const char *data, int stfbytes) {
-	uint16_t pktsize;
-	uint8_t *pkt = NULL;
-	int datalen;
+bool hashhash::sendpkt(int sfd, uint16_t opcode, const char *data, int stfbytes, uint32_t tag, bool packed) {
+	size_t datalen = pktlen(opcode, data, stfbytes);
+	uint8_t hdr[HDR2_MAXLEN];
+	struct iovec iov[2] = {{hdr, mkhdr(sfd, hdr, opcode, datalen, tag, packed)}, {(void *)data, datalen}};
 	
-	switch(opcode) {
-		case OPC_HEY:
-		case OPC_BYE:
-		case OPC_THX:
-		case OPC_FKU:
-		case OPC_SUP:
-			pktsize = 3 * sizeof(uint8_t); // simple packets are 3 bytes
-			pkt = (uint8_t*)malloc(pktsize);
+	return writevall(sfd, iov, 2);
+}
+
+// Builds a packet just as sendpkt() would, but adds it to the end of a queue of bytes to be sent later with flushpkts(), rather than sending it
+// Accepts: file descriptor it's bound for, the queue, opcode for packet, string data (in case packet needs it), amount of data to read from buffer (for stf packets only)
+void hashhash::queuepkt(int sfd, std::string *queue, uint16_t opcode, const char *data, int stfbytes) {
+	size_t datalen = pktlen(opcode, data, stfbytes);
+	uint8_t hdr[HDR2_MAXLEN];
+	queue->append((const char *)hdr, mkhdr(sfd, hdr, opcode, datalen, 0));
+	if(datalen)
+		queue->append(data, datalen);
+}
+
+// Sends the packets queued up by queuepkt(), removing whatever was sent from the front of the queue.  Without waiting, as much as the connection will take right away is sent, leaving the rest (perhaps part of a packet) for next time, so nothing else may be sent on the connection until the queue has been flushed.
+// Accepts: file descriptor, the queue, whether to give up on the rest as soon as the connection would make us wait
+// Returns: whether the connection is still sane
+bool hashhash::flushpkts(int sfd, std::string *queue, bool nowait) {
+	size_t sent = 0;
+	while(sent < queue->size()) {
+		ssize_t out = send(sfd, queue->data() + sent, queue->size() - sent, nowait ? MSG_DONTWAIT : 0);
+		if(out < 0 && errno == EINTR)
+			continue;
+		if(out < 0 && nowait && (errno == EAGAIN || errno == EWOULDBLOCK))
 			break;
+		if(out <= 0) {
+			queue->clear();
+			return false;
+		}
+		sent += out;
+	}
+	queue->erase(0, sent);
+	return true;
+}
 
+// Works out how long a packet's payload is, from what its opcode says it carries
+// Accepts: opcode for packet, string data, amount of data to read from buffer (for stf packets only)
+// Returns: the payload's length in bytes
+static size_t pktlen(uint16_t opcode, const char *data, int stfbytes) {
+	size_t datalen = 0;
+	
+	switch(opcode) {
 		case OPC_PLZ:
 		case OPC_HRZ:
-		case OPC_STF:
-			if(opcode == OPC_STF)
-				datalen = stfbytes;
-			else
+		case OPC_NVM:
+			datalen = strlen(data);
+			break;
+
+		case OPC_FKU:
+			if(data) // names the key that couldn't be had, in answer to an MGT
 				datalen = strlen(data);
+			break;
 
-			pktsize = (3 + datalen) * sizeof(uint8_t);
-			
-			pkt = (uint8_t *)malloc(pktsize);
-			memcpy((void *)(pkt + 3), data, datalen);
+		case OPC_STF:
+		case OPC_MGT:
+		case OPC_MPT:
+		case OPC_DIB:
+		case OPC_WHR:
+		case OPC_WUT:
+		case OPC_CPY:
+		case OPC_NIX:
+			datalen = stfbytes;
 			break;
 	}
-	
-	// Encode the packet size minus three to account for the bytes that are always there
-	*(uint16_t *)pkt = (pktsize - 3);
-	pkt[2] = opcode;
-	
-	send(sfd, (void*)pkt, pktsize, 0);
-	
-	free(pkt);
-	
-	return true;
+	return datalen;
 }
 
 // Sends a key/value pair out on the specified net socket.
-// Accepts: file descriptor, key, value, length of value (needed because it might be binary)
+// Accepts: file descriptor, key, value, length of value (needed because it might be binary), request tag (only sent over version 3 connections), whether the value is packed (in which case it's unpacked first for connections older than version 4)
 // Returns: whether it was done sanely
-bool hashhash::sendfile(int sfd, const char *filename, const char *data, size_t dlen) {
+bool hashhash::sendfile(int sfd, const char *filename, const char *data, size_t dlen, uint32_t tag, bool packed) {
+	if(packed && getproto(sfd) < PROTO_V4) {
+		char *raw;
+		size_t rawlen;
+		if(!unpackval(data, dlen, &raw, &rawlen))
+			return false;
+		bool sent = sendfile(sfd, filename, raw, rawlen, tag);
+		free(raw);
+		return sent;
+	}
+	if(getproto(sfd) >= PROTO_V2)
+		return sendfile2(sfd, filename, data, dlen, tag, packed);
+
 	// We should be careful; this is the maximum number of bytes we can have.
 	int maxdatabytes = MAX_PACKET_LEN - 3;
 	int numpkt = (int)ceil((double)dlen/maxdatabytes);
@@ -223,6 +495,736 @@ bool hashhash::sendfile(int sfd, const char *filename, const char *data, size_t
 	return true;
 }
 
+// Sends the same packet to several connections at once, never letting a slow or broken one hold up the rest.  STFs carrying data are split into as many packets or frames as each connection's protocol version calls for.
+// Accepts: file descriptors, how many there are, request tag for each (only sent over version 3 connections, and may be NULL), opcode, string data (in case packet needs it), its length, a flag per connection that's cleared if sending to it fails (connections whose flag is already clear are skipped), and whether the value a HRZ announces will follow packed (in which case every connection must speak version 4)
+// Returns: how many connections are still healthy
+size_t hashhash::fanout(const int *sfds, size_t count, const uint32_t *tags, uint16_t opcode, const char *data, size_t dlen, bool *healthy, bool packed) {
+	vector<vector<uint8_t> > hdrs(count);
+	vector<vector<struct iovec> > iovs(count);
+	vector<size_t> next(count, 0); // first entry of each I/O vector not yet fully sent
+	for(size_t i = 0; i < count; ++i)
+		if(healthy[i])
+			frameiov(sfds[i], opcode, data, dlen, tags ? tags[i] : 0, packed, hdrs[i], iovs[i]);
+
+	vector<struct pollfd> ready;
+	vector<size_t> owner;
+	while(true) {
+		ready.clear();
+		owner.clear();
+		for(size_t i = 0; i < count; ++i)
+			if(healthy[i] && next[i] < iovs[i].size()) {
+				struct pollfd each = {sfds[i], POLLOUT, 0};
+				ready.push_back(each);
+				owner.push_back(i);
+			}
+		if(ready.empty())
+			break;
+
+		if(poll(ready.data(), ready.size(), -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			handle_error("poll()");
+		}
+
+		for(size_t r = 0; r < ready.size(); ++r) {
+			size_t i = owner[r];
+			if(ready[r].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+				healthy[i] = false;
+				continue;
+			}
+			if(!(ready[r].revents & POLLOUT))
+				continue;
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof msg);
+			msg.msg_iov = &iovs[i][next[i]];
+			msg.msg_iovlen = std::min(iovs[i].size() - next[i], (size_t)IOV_MAX);
+			ssize_t sent = sendmsg(sfds[i], &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+			if(sent < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					healthy[i] = false;
+				continue;
+			}
+
+			while(next[i] < iovs[i].size() && (size_t)sent >= iovs[i][next[i]].iov_len) {
+				sent -= iovs[i][next[i]].iov_len;
+				++next[i];
+			}
+			if(next[i] < iovs[i].size()) {
+				struct iovec *partial = &iovs[i][next[i]];
+				partial->iov_base = (char *)partial->iov_base + sent;
+				partial->iov_len -= sent;
+			}
+		}
+	}
+
+	size_t survivors = 0;
+	for(size_t i = 0; i < count; ++i)
+		survivors += healthy[i];
+	return survivors;
+}
+
+// Lays out a packet as an I/O vector in whichever format a connection speaks, splitting an STF's data into as many packets or frames as it takes.
+// Accepts: file descriptor, opcode, string data (in case packet needs it), its length, request tag, whether a HRZ's value follows packed, storage for the headers, the I/O vector to fill
+static void frameiov(int sfd, uint16_t opcode, const char *data, size_t dlen, uint32_t tag, bool packed, vector<uint8_t> &hdrs, vector<struct iovec> &iov) {
+	size_t maxdatabytes = dlen ? dlen : 1;
+	if(opcode == OPC_STF)
+		maxdatabytes = getproto(sfd) >= PROTO_V2 ? frame_len : MAX_PACKET_LEN - 3;
+	size_t numfrm = dlen ? (dlen + maxdatabytes - 1) / maxdatabytes : 1;
+	hdrs.resize(numfrm * HDR2_MAXLEN);
+	iov.reserve(2 * numfrm);
+
+	uint8_t *hdr = hdrs.data();
+	size_t off = 0;
+	do {
+		size_t databytes = std::min(maxdatabytes, dlen - off);
+		struct iovec each = {hdr, mkhdr(sfd, hdr, opcode, databytes, tag, packed)};
+		iov.push_back(each);
+		if(databytes) {
+			each.iov_base = (void *)(data + off);
+			each.iov_len = databytes;
+			iov.push_back(each);
+		}
+		hdr += HDR2_MAXLEN;
+		off += databytes;
+	}
+	while(off < dlen);
+}
+
+// Version 2 counterpart of sendfile(), which hands the whole HRZ and every frame to the kernel in as few vectored writes as it will take.
+// Accepts: the same as sendfile()
+// Returns: the same as sendfile()
+static bool sendfile2(int sfd, const char *filename, const char *data, size_t dlen, uint32_t tag, bool packed) {
+	size_t numfrm = (dlen + frame_len - 1) / frame_len;
+	size_t keylen = strlen(filename);
+	vector<uint8_t> hdrs((numfrm + 2) * HDR2_MAXLEN);
+	vector<struct iovec> iov;
+	iov.reserve(2 * numfrm + 3);
+
+	uint8_t *hdr = hdrs.data();
+	struct iovec each = {hdr, mkhdr(sfd, hdr, OPC_HRZ, keylen, tag, packed)};
+	iov.push_back(each);
+	each.iov_base = (void *)filename;
+	each.iov_len = keylen;
+	iov.push_back(each);
+
+	for(size_t off = 0; off < dlen; off += frame_len) {
+		size_t databytes = std::min(frame_len, dlen - off);
+		hdr += HDR2_MAXLEN;
+		each.iov_base = hdr;
+		each.iov_len = mkhdr(sfd, hdr, OPC_STF, databytes, tag);
+		iov.push_back(each);
+		each.iov_base = (void *)(data + off);
+		each.iov_len = databytes;
+		iov.push_back(each);
+	}
+
+	hdr += HDR2_MAXLEN;
+	each.iov_base = hdr;
+	each.iov_len = mkhdr(sfd, hdr, OPC_STF, 0, tag);
+	iov.push_back(each);
+
+	return writevall(sfd, iov.data(), iov.size());
+}
+
+// Passes a value's STF frames from one connection straight through to another, re-framing them for the destination's protocol version.  The payload is spliced through a pipe, so it never has to be copied into userspace, and the destination starts receiving it as soon as the first frame arrives.
+// Accepts: file descriptor whose HRZ has already been consumed, destination file descriptor, an empty pipe to borrow
+// Returns: whether the whole value made it across; if not, the destination may be left mid-frame, and the source may have more of the value's frames still to come (or be shut down)
+bool hashhash::relayfile(int srcfd, int dstfd, const int *pipefd) {
+	uint64_t llen;
+
+	do {
+		uint16_t opcode;
+		if(!recvhdr(srcfd, &opcode, &llen, NULL) || opcode != OPC_STF || !relayframe(srcfd, dstfd, pipefd, llen))
+			return false;
+	}
+	while(llen);
+
+	return true;
+}
+
+// Passes the payload of one STF frame, whose header has already been consumed, straight through to another connection as one or more STFs (or as a terminating STF, if it was empty).  Either way, the source is never left in the middle of the frame: if the destination breaks, the rest of the payload is read and thrown away, and if the source itself breaks, it's shut down so that nobody reads on from there.
+// Accepts: source file descriptor, destination file descriptor, an empty pipe to borrow (which is left empty), payload length
+// Returns: whether the whole payload made it across
+bool hashhash::relayframe(int srcfd, int dstfd, const int *pipefd, uint64_t len) {
+	size_t maxdatabytes = getproto(dstfd) >= PROTO_V2 ? SIZE_MAX : MAX_PACKET_LEN - 3;
+
+	do {
+		size_t databytes = std::min((uint64_t)maxdatabytes, len);
+		uint8_t hdr[HDR2_MAXLEN];
+		struct iovec iov = {hdr, mkhdr(dstfd, hdr, OPC_STF, databytes, 0)};
+		if(!writevall(dstfd, &iov, 1)) {
+			discard(srcfd, len);
+			return false;
+		}
+		len -= databytes;
+		if(!splicen(srcfd, dstfd, pipefd, databytes)) {
+			discard(srcfd, len);
+			return false;
+		}
+	}
+	while(len);
+
+	return true;
+}
+
+// Moves bytes from one descriptor to another by way of a pipe, without copying them through userspace.  Should either end break, the source is left just past them all the same (or shut down), and the pipe is left empty.
+// Accepts: source file descriptor, destination file descriptor, an empty pipe to borrow, number of bytes
+// Returns: whether they all made it
+static bool splicen(int srcfd, int dstfd, const int *pipefd, size_t len) {
+	// Whatever we've already read can't be spliced, so send it along first
+	struct rdbuf *rb = rdbufof(srcfd);
+	size_t have = std::min(len, rb->tail - rb->head);
+	if(have) {
+		struct iovec iov = {rb->data + rb->head, have};
+		bool sent = writevall(dstfd, &iov, 1);
+		rb->head += have;
+		len -= have;
+		if(!sent) {
+			discard(srcfd, len);
+			return false;
+		}
+	}
+
+	while(len) {
+		ssize_t in = splice(srcfd, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE|SPLICE_F_MORE);
+		if(in < 0 && errno == EINTR)
+			continue;
+		if(in <= 0) {
+			discard(srcfd, len); // which can only shut it down now
+			return false;
+		}
+		len -= in;
+
+		while(in) {
+			ssize_t out = splice(pipefd[0], NULL, dstfd, NULL, in, SPLICE_F_MOVE|SPLICE_F_MORE);
+			if(out < 0 && errno == EINTR)
+				continue;
+			if(out <= 0) {
+				// Empty the pipe for its next borrower, then catch the source up
+				char scrap[PIPE_BUF];
+				while(in) {
+					ssize_t drained = read(pipefd[0], scrap, std::min((size_t)in, sizeof scrap));
+					if(drained < 0 && errno == EINTR)
+						continue;
+					if(drained <= 0)
+						break;
+					in -= drained;
+				}
+				discard(srcfd, len);
+				return false;
+			}
+			in -= out;
+		}
+	}
+	return true;
+}
+
+// Reads and throws away the rest of a frame that couldn't be passed along, so that whoever reads the connection next starts on a header.  If even that fails, the connection is shut down instead, so that they find out it's broken.
+// Accepts: file descriptor, number of bytes left in the frame
+static void discard(int sfd, uint64_t len) {
+	if(!skipall(sfd, len))
+		shutdown(sfd, SHUT_RDWR);
+}
+
+// Encodes a header in whichever format a connection speaks.
+// Accepts: file descriptor, buffer of at least HDR2_MAXLEN bytes, opcode, payload length (which must fit in a version 1 packet if that's what the connection speaks), request tag (dropped unless the connection speaks version 3), whether a HRZ's value follows packed (dropped unless the connection speaks version 4)
+// Returns: how many bytes of the buffer are now the header
+static size_t mkhdr(int sfd, uint8_t *hdr, uint16_t opcode, uint64_t len, uint32_t tag, bool packed) {
+	uint8_t version = getproto(sfd);
+	if(version >= PROTO_V3)
+		return mkhdr2(hdr, opcode, len, tag, packed && version >= PROTO_V4);
+	if(version >= PROTO_V2)
+		return mkhdr2(hdr, opcode, len, 0, false);
+
+	// Encode the packet size minus three to account for the bytes that are always there
+	*(uint16_t *)hdr = len;
+	hdr[2] = opcode;
+	return 3;
+}
+
+// Encodes a version 2 header, choosing the narrowest length field that fits.
+// Accepts: buffer of at least HDR2_MAXLEN bytes, opcode, payload length, request tag (or 0 to leave it untagged), whether a HRZ's value follows packed
+// Returns: how many bytes of the buffer are now the header
+static size_t mkhdr2(uint8_t *hdr, uint16_t opcode, uint64_t len, uint32_t tag, bool packed) {
+	size_t hdrlen = 3;
+	*(uint16_t *)hdr = opcode;
+	hdr[2] = packed ? FLG_PACKED : 0;
+	if(len > UINT32_MAX) {
+		hdr[2] |= FLG_WIDE;
+		memcpy(hdr + hdrlen, &len, sizeof len);
+		hdrlen += sizeof len;
+	} else {
+		uint32_t narrow = len;
+		memcpy(hdr + hdrlen, &narrow, sizeof narrow);
+		hdrlen += sizeof narrow;
+	}
+
+	if(tag) {
+		hdr[2] |= FLG_TAGGED;
+		memcpy(hdr + hdrlen, &tag, sizeof tag);
+		hdrlen += sizeof tag;
+	}
+	return hdrlen;
+}
+
+// Announces a protocol version as a HEY.  This is always encoded in version 1 format, and v1 peers simply ignore the extra bytes.
+// Accepts: file descriptor, the newest version we're willing to speak, the port on which we take direct reads from clients, how many pairs we restored from disk, and our share of new keys relative to other slaves' (slave registration only; 0 for none)
+// Returns: whether it was sent
+bool hashhash::sendhey(int sfd, uint8_t version, in_port_t readport, uint64_t restored, uint32_t weight) {
+	uint8_t pkt[4 + sizeof readport + sizeof restored + sizeof weight];
+	*(uint16_t *)pkt = sizeof version + (weight ? sizeof readport + sizeof restored + sizeof weight : restored ? sizeof readport + sizeof restored : readport ? sizeof readport : 0);
+	pkt[2] = OPC_HEY;
+	pkt[3] = version;
+	readport = htons(readport);
+	memcpy(pkt + 4, &readport, sizeof readport);
+	memcpy(pkt + 4 + sizeof readport, &restored, sizeof restored);
+	memcpy(pkt + 4 + sizeof readport + sizeof restored, &weight, sizeof weight);
+	struct iovec iov = {pkt, (size_t)*(uint16_t *)pkt + 3};
+	return writevall(sfd, &iov, 1);
+}
+
+// Waits for a HEY, figuring out which protocol version its sender offered (v1 peers don't say).
+// Accepts: file descriptor, spot for the offered version, spot for the port on which the sender takes direct reads, spot for how many pairs it restored from disk, and spot for its share of new keys (each set to 0 if it didn't say, or may be NULL)
+// Returns: whether a HEY arrived
+bool hashhash::recvhey(int sfd, uint8_t *version, in_port_t *readport, uint64_t *restored, uint32_t *weight) {
+	char *payld = NULL;
+	size_t len = 0;
+	if(!recvpkt(sfd, OPC_HEY, &payld, NULL, &len, false))
+		return false;
+	*version = len ? (uint8_t)*payld : PROTO_V1;
+	if(readport) {
+		*readport = 0;
+		if(len >= 1 + sizeof *readport) {
+			memcpy(readport, payld + 1, sizeof *readport);
+			*readport = ntohs(*readport);
+		}
+	}
+	if(restored) {
+		*restored = 0;
+		if(len >= 1 + sizeof(in_port_t) + sizeof *restored)
+			memcpy(restored, payld + 1 + sizeof(in_port_t), sizeof *restored);
+	}
+	if(weight) {
+		*weight = 0;
+		if(len >= 1 + sizeof(in_port_t) + sizeof(uint64_t) + sizeof *weight)
+			memcpy(weight, payld + 1 + sizeof(in_port_t) + sizeof(uint64_t), sizeof *weight);
+	}
+	free(payld);
+	return true;
+}
+
+// Records which protocol version a connection has settled on.  Descriptors get recycled, so this should be reset to PROTO_V1 for each fresh connection, which also throws away anything left in its read buffer by the last connection to use the descriptor.  (Upgrades never go back to version 1, so they keep whatever has been read ahead.)
+// Accepts: file descriptor, version
+void hashhash::setproto(int sfd, uint8_t version) {
+	pthread_mutex_lock(&protos_lock);
+	if((size_t)sfd >= protos.size())
+		protos.resize(sfd+1, PROTO_V1);
+	protos[sfd] = version;
+	pthread_mutex_unlock(&protos_lock);
+
+	if(version == PROTO_V1) {
+		struct rdbuf *rb = rdbufof(sfd);
+		rb->head = rb->tail = 0;
+		rb->flags = 0;
+	}
+}
+
+// Looks up which protocol version a connection has settled on.
+// Accepts: file descriptor
+// Returns: the version, which is PROTO_V1 unless something else was negotiated
+uint8_t hashhash::getproto(int sfd) {
+	uint8_t version = PROTO_V1;
+	pthread_mutex_lock(&protos_lock);
+	if(sfd >= 0 && (size_t)sfd < protos.size())
+		version = protos[sfd];
+	pthread_mutex_unlock(&protos_lock);
+	return version;
+}
+
+// Throws away everything known about a connection that's about to be closed, so whichever connection is next handed its descriptor starts afresh.  Nobody else may be reading from it by now.
+// Accepts: file descriptor
+void hashhash::rdforget(int sfd) {
+	if(sfd < 0)
+		return;
+	pthread_mutex_lock(&rdbufs_lock);
+	struct rdbuf *rb = NULL;
+	if((size_t)sfd < rdbufs.size()) {
+		rb = rdbufs[sfd];
+		rdbufs[sfd] = NULL;
+	}
+	pthread_mutex_unlock(&rdbufs_lock);
+	if(rb) {
+		free(rb->data);
+		free(rb);
+	}
+
+	pthread_mutex_lock(&protos_lock);
+	if((size_t)sfd < protos.size())
+		protos[sfd] = PROTO_V1;
+	pthread_mutex_unlock(&protos_lock);
+}
+
+// Appends a key-value pair to an MPT's payload.
+// Accepts: the payload so far, the key, the value, its length, and whether it's packed (which only slaves speaking version 4 will expect)
+void hashhash::packpair(std::string *pairs, const char *key, const char *val, uint64_t vlen, bool packed) {
+	uint64_t lenfield = packed ? vlen | PAIR_PACKED : vlen;
+	pairs->append(key, strlen(key) + 1);
+	pairs->append((const char *)&lenfield, sizeof lenfield);
+	pairs->append(val, vlen);
+}
+
+// Walks the key-value pairs packed into an MPT's payload, without copying any of them.
+// Accepts: the payload, its length, the offset of the next pair (which is advanced past it), spots for its key, value, value length, and whether the value is packed (or NULL to treat packed values as malformed)
+// Returns: whether there was another whole pair
+bool hashhash::nextpair(const char *pairs, size_t plen, size_t *off, const char **key, const char **val, uint64_t *vlen, bool *packed) {
+	const char *keyend = (const char *)memchr(pairs + *off, '\0', plen - *off);
+	if(!keyend || (size_t)(pairs + plen - keyend - 1) < sizeof *vlen)
+		return false;
+	memcpy(vlen, keyend + 1, sizeof *vlen);
+	if(*vlen & PAIR_PACKED && !packed)
+		return false;
+	if(packed)
+		*packed = *vlen & PAIR_PACKED;
+	*vlen &= ~PAIR_PACKED;
+	size_t valoff = keyend + 1 + sizeof *vlen - pairs;
+	if(*vlen > plen - valoff)
+		return false;
+
+	*key = pairs + *off;
+	*val = pairs + valoff;
+	*off = valoff + *vlen;
+	return true;
+}
+
+// Packs a value with a byte-oriented LZ77 scheme: its unpacked length, then runs of literal bytes each followed by a repeat of earlier bytes.  Each run starts with a byte whose high nibble counts the literals and low nibble the repeat's length past PACK_MIN_MATCH, with 15 meaning that more of the count follows in bytes of up to 255 each; the literals and the repeat's 16-bit distance back come after that.  The last run has no repeat.  Values that barely shrink (or grow) are left alone, giving up early on those that clearly won't.
+// Accepts: the value, its length, spots for the packed value (which is ours to free) and its length
+// Returns: whether the value was worth packing; if not, the spots are untouched
+bool hashhash::packval(const char *val, size_t len, char **packed, size_t *plen) {
+	if(len < PACK_MIN_LEN)
+		return false;
+	size_t limit = len - len / 100 * PACK_MIN_SAVINGS_PCT;
+	uint8_t *dest = (uint8_t *)malloc(sizeof(uint64_t) + len + len / 255 + 16);
+	if(!dest)
+		return false; // it'll just have to go unpacked
+	uint64_t rawlen = len;
+	memcpy(dest, &rawlen, sizeof rawlen);
+	uint8_t *out = dest + sizeof rawlen;
+
+	size_t seen[1 << PACK_HASH_BITS] = {0}; // one past where each hash was last seen
+	const uint8_t *in = (const uint8_t *)val;
+	const uint8_t *end = in + len;
+	const uint8_t *lits = in;
+	const uint8_t *pos = in;
+	while((size_t)(end - pos) >= PACK_MIN_MATCH) {
+		uint32_t next;
+		memcpy(&next, pos, sizeof next);
+		uint32_t hash = (next * 2654435761U) >> (32 - PACK_HASH_BITS);
+		const uint8_t *cand = in + seen[hash] - 1;
+		bool match = seen[hash] && (size_t)(pos - cand) <= PACK_WINDOW && !memcmp(cand, pos, PACK_MIN_MATCH);
+		seen[hash] = pos - in + 1;
+		if(!match) {
+			pos += std::min((size_t)(pos - lits) / 64 + 1, (size_t)(end - pos)); // stride faster through stretches that aren't repeating
+			continue;
+		}
+
+		size_t mlen = PACK_MIN_MATCH;
+		while(pos + mlen < end && cand[mlen] == pos[mlen])
+			++mlen;
+		size_t nlits = pos - lits;
+		uint8_t *token = out++;
+		*token = (std::min(nlits, (size_t)15) << 4) | std::min(mlen - PACK_MIN_MATCH, (size_t)15);
+		if(nlits >= 15)
+			out = packlen(out, nlits - 15);
+		memcpy(out, lits, nlits);
+		out += nlits;
+		uint16_t back = pos - cand;
+		memcpy(out, &back, sizeof back);
+		out += sizeof back;
+		if(mlen - PACK_MIN_MATCH >= 15)
+			out = packlen(out, mlen - PACK_MIN_MATCH - 15);
+		pos += mlen;
+		lits = pos;
+
+		if((size_t)(out - dest) >= limit) {
+			free(dest);
+			return false;
+		}
+	}
+
+	size_t nlits = end - lits;
+	*out++ = std::min(nlits, (size_t)15) << 4;
+	if(nlits >= 15)
+		out = packlen(out, nlits - 15);
+	memcpy(out, lits, nlits);
+	out += nlits;
+	if((size_t)(out - dest) >= limit) {
+		free(dest);
+		return false;
+	}
+
+	*packed = (char *)dest;
+	*plen = out - dest;
+	return true;
+}
+
+// Restores a value packed by packval(), checking as it goes that the packed form describes nothing impossible
+// Accepts: the packed value, its length, spots for the value (which is ours to free, and null terminated) and its length
+// Returns: whether the packed value was well formed; if not, the spots are untouched
+bool hashhash::unpackval(const char *packed, size_t plen, char **val, size_t *len) {
+	uint64_t rawlen;
+	if(plen < sizeof rawlen)
+		return false;
+	memcpy(&rawlen, packed, sizeof rawlen);
+	if(rawlen / 255 > plen) // no run can grow by more than this much, so it's garbage
+		return false;
+
+	char *dest = (char *)malloc(rawlen + 1);
+	if(!dest)
+		return false;
+	const uint8_t *in = (const uint8_t *)packed + sizeof rawlen;
+	const uint8_t *end = (const uint8_t *)packed + plen;
+	size_t done = 0;
+	bool intact = false;
+	while(in < end) {
+		uint8_t token = *in++;
+		size_t nlits = token >> 4;
+		if(nlits == 15 && !unpacklen(&in, end, &nlits))
+			break;
+		if(nlits > (size_t)(end - in) || nlits > rawlen - done)
+			break;
+		memcpy(dest + done, in, nlits);
+		in += nlits;
+		done += nlits;
+		if(in == end) {
+			intact = done == rawlen; // the last run has no repeat
+			break;
+		}
+
+		uint16_t back;
+		if((size_t)(end - in) < sizeof back)
+			break;
+		memcpy(&back, in, sizeof back);
+		in += sizeof back;
+		size_t mlen = token & 15;
+		if(mlen == 15 && !unpacklen(&in, end, &mlen))
+			break;
+		mlen += PACK_MIN_MATCH;
+		if(!back || back > done || mlen > rawlen - done)
+			break;
+		if(back >= mlen)
+			memcpy(dest + done, dest + done - back, mlen);
+		else
+			for(size_t each = 0; each < mlen; ++each) // the repeat overlaps itself
+				dest[done + each] = dest[done - back + each];
+		done += mlen;
+	}
+
+	if(!intact) {
+		free(dest);
+		return false;
+	}
+	dest[done] = '\0';
+	*val = dest;
+	*len = done;
+	return true;
+}
+
+// Writes the rest of a count too big for its nibble, for packval()
+// Accepts: where to write, and how much is left of the count after the nibble's 15
+// Returns: where to write next
+static uint8_t *packlen(uint8_t *out, size_t left) {
+	for(; left >= 255; left -= 255)
+		*out++ = 255;
+	*out++ = left;
+	return out;
+}
+
+// Reads the rest of a count too big for its nibble, for unpackval()
+// Accepts: spot for where to read (which is advanced past the count), where the packed value ends, and the count so far (which is added to)
+// Returns: whether the count ended before the packed value did
+static bool unpacklen(const uint8_t **in, const uint8_t *end, size_t *count) {
+	uint8_t more;
+	do {
+		if(*in == end || *count > SIZE_MAX - 255)
+			return false;
+		more = *(*in)++;
+		*count += more;
+	}
+	while(more == 255);
+	return true;
+}
+
+// Sets how many bytes of value go into each version 2 STF frame we send.
+// Accepts: frame length in bytes
+void hashhash::setframelen(size_t len) {
+	if(len)
+		frame_len = len;
+}
+
+// Reads exactly the requested number of bytes, however many reads that takes.
+// Accepts: file descriptor, destination buffer, number of bytes
+// Returns: whether they all arrived before the connection broke
+bool hashhash::readall(int sfd, void *buf, size_t len) {
+	struct rdbuf *rb = rdbufof(sfd);
+	while(len) {
+		ssize_t got = rdtake(sfd, rb, (char *)buf, len, false);
+		if(got <= 0)
+			return false;
+		buf = (char *)buf + got;
+		len -= got;
+	}
+	return true;
+}
+
+// Reads and throws away the given number of bytes, such as the rest of a frame nobody wants.
+// Accepts: file descriptor, number of bytes
+// Returns: whether they all arrived before the connection broke
+bool hashhash::skipall(int sfd, uint64_t len) {
+	struct rdbuf *rb = rdbufof(sfd);
+	while(len) {
+		if(rb->head == rb->tail && rdfill(sfd, rb, false) <= 0)
+			return false;
+		size_t chunk = std::min(len, (uint64_t)(rb->tail - rb->head));
+		rb->head += chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+// Finds a connection's read buffer, setting one up if it has none, and puts back the byte under the terminator of the last view of it
+// Accepts: file descriptor
+// Returns: the buffer
+static struct rdbuf *rdbufof(int sfd) {
+	pthread_mutex_lock(&rdbufs_lock);
+	if((size_t)sfd >= rdbufs.size())
+		rdbufs.resize(sfd+1, NULL);
+	struct rdbuf *rb = rdbufs[sfd];
+	if(!rb) {
+		rb = (struct rdbuf *)calloc(1, sizeof(struct rdbuf));
+		rb->stashat = SIZE_MAX;
+		rdbufs[sfd] = rb;
+	}
+	pthread_mutex_unlock(&rdbufs_lock);
+
+	if(rb->stashat != SIZE_MAX) {
+		rb->data[rb->stashat] = rb->stashed;
+		rb->stashat = SIZE_MAX;
+	}
+	return rb;
+}
+
+// Reads as much as has arrived on a connection (up to what its buffer will hold) into the buffer, which must have room.  Once the buffer has been emptied, any extra room it grew to hold a big view is given back.
+// Accepts: file descriptor, its buffer, whether to give up straight away if nothing has arrived yet
+// Returns: how many bytes were read, 0 if the connection closed, or -1 if it broke (or nothing had arrived, with errno set to EAGAIN)
+static ssize_t rdfill(int sfd, struct rdbuf *rb, bool nowait) {
+	if(rb->head == rb->tail) {
+		rb->head = rb->tail = 0;
+		if(rb->cap > RDBUF_LEN) {
+			free(rb->data);
+			rb->data = NULL;
+		}
+	}
+	if(!rb->data) {
+		rb->cap = RDBUF_LEN;
+		rb->data = (char *)malloc(rb->cap);
+	}
+	else if(rb->tail == rb->cap) {
+		memmove(rb->data, rb->data + rb->head, rb->tail - rb->head);
+		rb->tail -= rb->head;
+		rb->head = 0;
+	}
+
+	ssize_t got;
+	do
+		got = recv(sfd, rb->data + rb->tail, rb->cap - rb->tail, nowait ? MSG_DONTWAIT : 0);
+	while(got < 0 && errno == EINTR);
+	if(got > 0)
+		rb->tail += got;
+	return got;
+}
+
+// Waits until a connection's buffer holds at least the given number of bytes in one piece, with room for a terminator after them, growing it if need be
+// Accepts: file descriptor, its buffer, number of bytes
+// Returns: whether they all arrived before the connection broke
+static bool rdneed(int sfd, struct rdbuf *rb, size_t len) {
+	if(rb->head + len >= rb->cap) {
+		size_t have = rb->tail - rb->head;
+		if(len >= rb->cap) {
+			size_t cap = std::max(RDBUF_LEN, len + 1);
+			char *grown = (char *)malloc(cap);
+			if(!grown)
+				return false;
+			if(have)
+				memcpy(grown, rb->data + rb->head, have);
+			free(rb->data);
+			rb->data = grown;
+			rb->cap = cap;
+		}
+		else
+			memmove(rb->data, rb->data + rb->head, have);
+		rb->head = 0;
+		rb->tail = have;
+	}
+
+	while(rb->tail - rb->head < len) {
+		ssize_t got;
+		do
+			got = recv(sfd, rb->data + rb->tail, rb->cap - rb->tail, 0);
+		while(got < 0 && errno == EINTR);
+		if(got <= 0)
+			return false;
+		rb->tail += got;
+	}
+	return true;
+}
+
+// Moves bytes from a connection's buffer to where they're wanted, reading more into it first if it's empty.  Reads too big to be worth buffering go straight into place, so they aren't copied twice.
+// Accepts: file descriptor, its buffer, destination, how many bytes are wanted, whether to give up straight away if nothing has arrived yet
+// Returns: how many bytes were moved, 0 if the connection closed, or -1 if it broke (or nothing had arrived, with errno set to EAGAIN)
+static ssize_t rdtake(int sfd, struct rdbuf *rb, char *dst, size_t len, bool nowait) {
+	if(rb->head == rb->tail) {
+		if(len >= RDBUF_LEN / 2) {
+			ssize_t got;
+			do
+				got = recv(sfd, dst, len, nowait ? MSG_DONTWAIT : 0);
+			while(got < 0 && errno == EINTR);
+			return got;
+		}
+		ssize_t got = rdfill(sfd, rb, nowait);
+		if(got <= 0)
+			return got;
+	}
+
+	size_t moved = std::min(len, rb->tail - rb->head);
+	memcpy(dst, rb->data + rb->head, moved);
+	rb->head += moved;
+	return moved;
+}
+
+// Writes out every byte described by an I/O vector, resuming after partial writes.  The vector itself is consumed in the process.
+// Accepts: file descriptor, I/O vector, its number of entries
+// Returns: whether everything was written
+static bool writevall(int sfd, struct iovec *iov, size_t cnt) {
+	while(cnt) {
+		ssize_t sent = writev(sfd, iov, std::min(cnt, (size_t)IOV_MAX));
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0)
+			return false;
+		while(cnt && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if(cnt) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
 // Bails out of the program, printing an error based on the given context and errno.
 // Accepts: the context of the problem
 void hashhash::handle_error(const char *desc)
@@ -241,6 +1243,63 @@ unsigned long hashhash::min(unsigned long a, unsigned long b) {
 	return b;
 }
 
+// Hashes a key in place, for tables that shouldn't copy it on every lookup
+// Accepts: the key and its length
+// Returns: a 64-bit FNV-1a hash, mixed so that its low bits alone make a good table index
+uint64_t hashhash::keyhash(const char *key, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t each = 0; each < len; ++each) {
+		hash ^= (uint8_t)key[each];
+		hash *= 1099511628211ULL;
+	}
+	return keymix(hash);
+}
+
+// Hashes a null-terminated key in a single pass, without measuring it first
+// Accepts: the key
+// Returns: the same hash as keyhash() gives for the key and its length
+uint64_t hashhash::keyhash(const char *key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for(; *key; ++key) {
+		hash ^= (uint8_t)*key;
+		hash *= 1099511628211ULL;
+	}
+	return keymix(hash);
+}
+
+// Spreads an FNV-1a hash's entropy into its low bits
+// Accepts: the raw hash
+// Returns: the mixed one
+uint64_t keymix(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Reads a clock that only ever moves forward, for timing things like leases
+// Returns: milliseconds since some arbitrary point
+uint64_t hashhash::nowms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Reads the same clock as nowms(), for timing things that are over much more quickly
+// Returns: microseconds since some arbitrary point
+uint64_t hashhash::nowus() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Sleeps for however long it's asked to, unlike usleep(), which may refuse to sleep for a second or more
+// Accepts: microseconds to sleep
+void hashhash::sleepus(uint64_t us) {
+	struct timespec left = {(time_t)(us / 1000000), (long)(us % 1000000 * 1000)};
+	while(nanosleep(&left, &left) && errno == EINTR);
+}
+
 // Reads one line of input from standard input into the provided buffer.  Each time the buffer would overflow, it is reallocated at double its previous size.
 // Accepts: the target buffer, its length in bytes
 // Returns: whether we got EOF
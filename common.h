@@ -28,6 +28,10 @@
 #include <stdlib.h>
 #include <string>
 
+namespace hashhash {
+	uint64_t keyhash(const char *); // so that tables keyed on strings needn't copy them to hash them
+}
+
 namespace std {
 	template <>
 	struct equal_to<const char *> {
@@ -39,8 +43,7 @@ namespace std {
 	template <>
 	struct hash<const char *> {
 		size_t operator()(const char *val) const {
-			hash<string> hasher;
-			return hasher(string(val));
+			return hashhash::keyhash(val);
 		}
 	};
 }
@@ -50,34 +53,94 @@ namespace hashhash {
 	const int PORT_MASTER_REGISTER = 1031;
 	const int PORT_MASTER_HEARTBEAT = 1032;
 	const int PORT_SLAVE_MAIN = 1033;
+	const int PORT_SLAVE_READS = 1034;
 
-	const int MAX_MASTER_BACKLOG = 1;
+	const int MAX_MASTER_BACKLOG = SOMAXCONN; // the kernel quietly caps this at net.core.somaxconn
 
 	const int MAX_PACKET_LEN = 512;
+	const size_t DEFAULT_FRAME_LEN = 1 << 20;
+	const int RELAY_PIPE_LEN = 1 << 20;
+
+	const uint8_t PROTO_V1 = 1; // 16-bit lengths, packets capped at MAX_PACKET_LEN
+	const uint8_t PROTO_V2 = 2; // 32/64-bit lengths, frames capped at the configured frame length
+	const uint8_t PROTO_V3 = 3; // version 2 frames tagged with request IDs, so that requests may be pipelined (master-slave control links only)
+	const uint8_t PROTO_V4 = 4; // version 3, plus values may travel packed
+	const uint8_t PROTO_LATEST = PROTO_V4;
+	const uint8_t PROTO_CLIENT_LATEST = PROTO_V4; // clients have nothing to pipeline, so they never tag anything
+	const int HANDSHAKE_TIMEOUT = 1000; // ms to await a HEY before assuming a v1 peer
+	const int COPY_TIMEOUT = 30000; // ms a slave may spend on a CPY before throwing away what it pulled; the master waits twice as long for the answer
+
+	const uint8_t FLG_WIDE = 1; // v2 frame length is 64 bits rather than 32
+	const uint8_t FLG_TAGGED = 2; // v2 frame length is followed by a 32-bit request tag
+	const uint8_t FLG_PACKED = 4; // HRZ's value follows packed, as by packval() (v4 and later only)
+
+	const size_t PACK_MIN_LEN = 64; // values shorter than this are never worth packing
+	const unsigned int PACK_MIN_SAVINGS_PCT = 10; // a packed value must be at least this much smaller to be kept
 	
 	const int SLAVE_KEEPALIVE_TIME = 500000;
 	const int MASTER_REG_GRACE_PRD = 500000;
 
 	const unsigned long MIN_STOR_REDUN = 2;
 
-	const uint8_t OPC_PLZ = 1;
-	const uint8_t OPC_HRZ = 2;
-	const uint8_t OPC_STF = 4;
-	const uint8_t OPC_HEY = 8;
-	const uint8_t OPC_BYE = 16;
-	const uint8_t OPC_THX = 32;
-	const uint8_t OPC_FKU = 64;
-	const uint8_t OPC_SUP = 128;
+	const uint16_t OPC_PLZ = 1;
+	const uint16_t OPC_HRZ = 2;
+	const uint16_t OPC_STF = 4;
+	const uint16_t OPC_HEY = 8;
+	const uint16_t OPC_BYE = 16;
+	const uint16_t OPC_THX = 32;
+	const uint16_t OPC_FKU = 64;
+	const uint16_t OPC_SUP = 128;
+	const uint16_t OPC_MGT = 256; // v2 and later only
+	const uint16_t OPC_MPT = 512; // v2 and later only
+	const uint16_t OPC_DIB = 1024; // v2 client connections only
+	const uint16_t OPC_NVM = 2048; // v2 client connections only
+	const uint16_t OPC_WHR = 4096; // v2 client connections only
+	const uint16_t OPC_WUT = 8192; // v3 only
+	const uint16_t OPC_CPY = 16384; // v3 only
+	const uint16_t OPC_NIX = 32768; // v3 only
 
 	const int RETVAL_INVALID_ARG = 1;
 	const int RETVAL_CONN_FAILED = 2;
 
+	// A packet that's still trickling in; zero it before reading the first one
+	struct partpkt {
+		uint16_t opcode; // valid once payld is set
+		uint64_t len; // valid once payld is set
+		char *payld; // null terminated; the caller takes ownership once the packet is complete
+		uint64_t paygot;
+	};
+
 	int tcpskt(int, int);
 	bool rslvconn(int *, const char *, in_port_t);
-	bool recvpkt(int, uint16_t, char **, bool *, uint16_t *, bool);
+	bool recvpkt(int, uint16_t, char **, uint16_t *, size_t *, bool);
 	bool recvfile(int, char **, size_t *);
-	bool sendpkt(int, uint8_t, const char *, int);
-	bool sendfile(int, const char *, const char*, size_t);
+	bool recvchunk(int, char *, size_t, size_t *, uint64_t *);
+	int recvpart(int, struct partpkt *);
+	bool recvhdr(int, uint16_t *, uint64_t *, uint32_t *);
+	bool recvview(int, uint16_t *, const char **, uint64_t *, uint32_t *);
+	bool viewall(int, size_t, const char **);
+	bool buffered(int);
+	bool ispacked(int);
+	bool sendpkt(int, uint16_t, const char *, int, uint32_t = 0, bool = false);
+	void queuepkt(int, std::string *, uint16_t, const char *, int);
+	bool flushpkts(int, std::string *, bool);
+	bool sendfile(int, const char *, const char*, size_t, uint32_t = 0, bool = false);
+	size_t fanout(const int *, size_t, const uint32_t *, uint16_t, const char *, size_t, bool *, bool = false);
+	bool relayfile(int, int, const int *);
+	bool relayframe(int, int, const int *, uint64_t);
+	bool readall(int, void *, size_t);
+	bool skipall(int, uint64_t);
+	void packpair(std::string *, const char *, const char *, uint64_t, bool = false);
+	bool nextpair(const char *, size_t, size_t *, const char **, const char **, uint64_t *, bool * = NULL);
+	bool packval(const char *, size_t, char **, size_t *);
+	bool unpackval(const char *, size_t, char **, size_t *);
+
+	bool sendhey(int, uint8_t, in_port_t = 0, uint64_t = 0, uint32_t = 0);
+	bool recvhey(int, uint8_t *, in_port_t * = NULL, uint64_t * = NULL, uint32_t * = NULL);
+	void setproto(int, uint8_t);
+	uint8_t getproto(int);
+	void rdforget(int);
+	void setframelen(size_t);
 	
 	bool readin(char **, size_t *);
 	bool homog(const char *, char);
@@ -85,6 +148,11 @@ namespace hashhash {
 	void handle_error(const char *);
 	
 	unsigned long min(unsigned long, unsigned long);
+	uint64_t keyhash(const char *, size_t);
+	uint64_t keyhash(const char *);
+	uint64_t nowms();
+	uint64_t nowus();
+	void sleepus(uint64_t);
 }
 
 #endif
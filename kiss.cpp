@@ -28,8 +28,7 @@ int main(int argc, char **argv) {
 			handle_error("incoming from master accept()");
 
 		char *payld = NULL;
-		bool inbound;
-		if(!recvpkt(incoming, OPC_HRZ, &payld, &inbound, 0, false))
+		if(!recvpkt(incoming, OPC_HRZ, &payld, NULL, 0, false))
 			handle_error("recvpkt()");
 
 		printf("Text 'ignored' came through as: '%s'\n", payld);
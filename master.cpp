@@ -17,11 +17,17 @@
 #include "common.h"
 #include <algorithm>
 #include <cstring>
+#include <fcntl.h>
 #include <functional>
 #include <iterator>
+#include <list>
 #include <map>
 #include <pthread.h>
 #include <queue>
+#include <set>
+#include <string>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
@@ -30,14 +36,23 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 
 using namespace hashhash;
-using std::copy_if;
 using std::function;
-using std::inserter;
+using std::list;
 using std::map;
+using std::max;
 using std::min;
 using std::queue;
+using std::set;
+using std::stable_sort;
+using std::string;
 using std::unordered_map;
 using std::unordered_set;
 using std::vector;
@@ -49,51 +64,361 @@ static const char *const SHL_PS1 = "#hashtable> ";
 // Interactive commands (must not share a first character)
 static const char *const CMD_SLV = "slaves";
 static const char *const CMD_FIL = "files";
+static const char *const CMD_CCH = "cache";
+static const char *const CMD_RPR = "repairs";
 static const char *const CMD_GFO = "quit";
 static const char *const CMD_HLP = "?";
 
+static const size_t PUT_WINDOW_LEN = 1 << 20; // most of a value being written that we'll hold at once
+static const time_t CLIENT_STALL_SECS = 10; // longest a client may leave a value it's sending hanging, while it ties up a worker, before the write is called off
+static const unsigned int DEFAULT_CLIENT_WORKERS = 16;
+static const unsigned int DEFAULT_REPAIR_WORKERS = 4;
+static const unsigned int DEFAULT_REBALANCE_PCT = 10;
+static const size_t REBALANCE_BATCH_LEN = 256; // files moved between one pair of slaves before their loads are weighed again
+static const unsigned int MAX_SLAVE_INFLIGHT = 32; // requests outstanding at once on a slave that tags them
+static const uint64_t LATENCY_EWMA_DIV = 8; // each read's response time makes up this fraction of its slave's moving average
+static const unsigned int LATENCY_PROBE_ODDS = 64; // one read in this many goes to the costlier of the two holders drawn, so that a slave that's sped up since it was last timed gets a chance to show it
+static const unsigned int LATENCY_BUCKETS = 256; // of the histogram of reads' response times: four to each power of two microseconds
+static const unsigned long LATENCY_HIST_HALFLIFE = 4096; // reads timed between halvings of the histogram, so that it follows how the slaves have been doing lately
+static const unsigned long HEDGE_MIN_SAMPLES = 64; // reads that must have been timed before any are hedged
+static const int MAX_EPOLL_EVENTS = 64;
+static const double DEFAULT_SUSPICION_PHI = 8; // a slave is presumed dead once the odds that a heartbeat it sent would still be on its way fall to one in 10 to this power
+static const uint64_t HEARTBEAT_EWMA_DIV = 8; // each gap between a slave's heartbeats makes up this fraction of their moving average
+static const uint64_t HEARTBEAT_MIN_DEV = SLAVE_KEEPALIVE_TIME / 10; // least standard deviation assumed of the gaps, so that a slave whose heart has beaten like clockwork isn't condemned for the slightest hiccup
+static const size_t CACHE_PROTECTED_PCT = 80; // share of the cache reserved for values that have been read again since they were cached
+static const size_t CACHE_ENTRY_FRACTION = 8; // values bigger than this fraction of the cache aren't worth evicting everything else for
+static const uint32_t DEFAULT_LEASE_MS = 5000;
+static const unsigned int FILES_SHARDS = 64; // independently locked slices of the key directory
+static const unsigned int WRITE_STRIPES = 1024; // write locks shared among all the keys, so that each needn't carry its own
+static const uint32_t INLINE_HOLDERS = 4; // holders a file keeps in its own entry before spilling onto the heap
+static const size_t KEY_ARENA_CHUNK = 1 << 20; // keys are interned into chunks of this size
+static const char *const JOURNAL_NAME = "journal";
+static const char *const CHECKPOINT_NAME = "checkpoint";
+static const size_t CHECKPOINT_JOURNAL_LEN = 16 << 20; // journal length past which the key directory is checkpointed
+static const time_t CHECKPOINT_SECS = 60; // longest a nonempty journal goes without a checkpoint
+
+// Journal record types
+static const uint16_t JRN_ADD = 1; // a slave took on a file
+static const uint16_t JRN_DEL = 2; // a slave gave one up
+
 typedef vector<int>::size_type slave_idx;
 
+// A request that has been sent to a slave and is awaiting (or receiving) its response
+struct slavereq {
+	uint32_t tag; // 0 on links that can only carry one request at a time
+	pthread_cond_t notify; // paired with the slave's waiting_lock, and signalled when a frame is handed over or the connection dies
+	bool posted; // acquire waiting_lock; a frame's header has been read on our behalf, and the rest of it awaits us on ctlfd
+	bool severed; // acquire waiting_lock; the connection died, so no (more) response is coming
+	uint16_t opcode; // acquire waiting_lock; of the posted frame
+	uint64_t len; // acquire waiting_lock; of the posted frame's payload
+	uint64_t began; // when the request was granted its slot, in microseconds
+	bool answered; // acquire waiting_lock; whether its first frame has arrived
+	struct hedge *race; // acquire waiting_lock; NULL unless it's one of a hedged read's requests
+};
+
+// Shared by the requests of a hedged read, so that whoever's waiting on them hears about whichever is answered first
+struct hedge {
+	pthread_mutex_t lock; // acquire after the slaves' waiting_locks, and never hold it while taking one
+	pthread_cond_t notify; // paired with lock, and broadcast when a frame is handed to either request or either's connection dies
+	unsigned long events; // acquire lock
+};
+
+// A request waiting its turn for one of a slave's slots
+struct slotwaiter {
+	pthread_cond_t notify;
+	bool granted; // acquire waiting_lock
+};
+
 struct slavinfo {
 	bool alive; // access is atomic
+	bool mux; // whether ctlfd speaks version 3, and so may carry several requests at once
 	pthread_mutex_t *waiting_lock;
-	pthread_cond_t *waiting_notify;
-	queue<int> *waiting_clients; // acquire waiting_lock before reading or writing, then wait on waiting_notify until at head
+	queue<struct slotwaiter *> *waiting_clients; // acquire waiting_lock before reading or writing; served first come, first served as slots free up
+	unsigned int inflight; // acquire waiting_lock; how many requests hold slots
+	bool severed; // acquire waiting_lock; whether ctlfd has died
+	uint32_t lasttag; // acquire waiting_lock
+	unordered_map<uint32_t, struct slavereq *> *pending; // acquire waiting_lock; requests holding slots, by tag (all frames on ctlfd are for one of these)
+	pthread_mutex_t *send_lock; // hold while writing to ctlfd, so frames of different requests don't interleave
+	pthread_t demux; // the only thread that may read headers from ctlfd
+	bool handedoff; // acquire waiting_lock; whether a request is busy reading the rest of a frame from ctlfd
+	pthread_cond_t *handback_notify; // paired with waiting_lock, and signalled when ctlfd is handed back to demux
 	int supfd; // should only be used by keepalive thread
-	int ctlfd; // only head of waiting_clients may use
-	long long howfull; // only head of waiting_clients may write
+	uint64_t lastbeat; // update atomically; when its last heartbeat arrived, in microseconds
+	uint64_t beatgap; // update atomically; moving average of the time between its heartbeats, in microseconds
+	uint64_t beatvar; // update atomically; moving average of the square of how far each gap strayed from beatgap
+	int ctlfd;
+	struct sockaddr_in reads; // where clients may read from the slave directly; sin_port is 0 if it doesn't take direct reads
+	long long howfull; // update atomically
+	unsigned long diedat; // acquire slaves_lock; write_clock when the slave was found dead
+	uint32_t weight; // its share of new keys relative to the other slaves', under rendezvous placement
+	uint64_t latency; // update atomically; moving average of how long the slave takes to start answering a read, in microseconds (0 until it first has)
+	unsigned int load; // update atomically; requests holding or awaiting one of its slots
+};
+
+// A living slave as rendezvous placement sees it
+struct candidate {
+	slave_idx idx;
+	slavinfo *slave;
+	uint64_t seed; // from where it takes direct reads, so that a slave that restarts is handed the same keys as before
+	double weight;
+};
+
+// A file for the rebalancer to move from one slave to another
+struct movejob {
+	const char *key; // interned
+	slave_idx from;
+	slave_idx to;
+};
+
+// The share of a client's MGT that's been passed along to one slave
+struct batchpart {
+	slavinfo *slave;
+	vector<const char *> keys; // in the order the slave will answer them
+	struct slavereq req;
+};
+
+// A value the master is keeping on hand for repeat readers
+struct cachedval {
+	char *key;
+	char *data;
+	size_t len;
+	bool packed; // whether data is as packval() left it
+	size_t cost; // bytes charged against the cache's budget
+	bool protect; // whether it's been read again since it was cached, which earns it a place in the protected segment
+	list<struct cachedval *>::iterator where; // its place in whichever segment it's in
 };
 
+struct clientconn {
+	int fd;
+	struct partpkt pending; // request that's still arriving; only the worker that's been handed this connection may touch it
+	pthread_mutex_t *send_lock; // held by the worker serving a request, and by anyone pushing an NVM between requests
+	bool leasing; // whether the client has asked for leases; only the worker that's been handed this connection may touch it
+	unordered_set<const char *> *leased; // acquire leases_lock; keys we've leased to this client, pointing at those in leases
+	vector<char *> *revoked; // acquire leases_lock; keys whose NVMs must wait until the current request has been served
+	string *unsent; // acquire send_lock; NVMs the client's socket couldn't take without waiting, which must be flushed before anything else is sent to it
+	bool idle; // acquire send_lock; whether the connection is waiting in epoll, rather than in a worker's hands or on its way to one
+	bool lost; // whether we've lost our place in the client's stream, so it must be hung up on; only the worker that's been handed this connection may touch it
+};
+
+// A handful of slave indices, without a heap allocation of its own unless it outgrows INLINE_HOLDERS
+struct holderset {
+	uint32_t count;
+	uint32_t cap;
+	union {
+		uint32_t inlined[INLINE_HOLDERS]; // while cap is INLINE_HOLDERS
+		uint32_t *spilled; // once it's grown past
+	};
+};
+
+// Kept by value in its shard, so that its address is stable but it costs no allocation of its own
 struct filinfo {
-	pthread_mutex_t *write_lock; // acquire before changing the value, hold until every slave in holders is consistent and stores the same value
-	unordered_set<slave_idx> *holders; // reads are safe, but must be holding write_lock to write
+	struct holderset holders; // acquire the key's write lock and its shard exclusively to write
+	unsigned long written; // acquire the key's write lock; write_clock when the value was last replaced
+	uint64_t len; // acquire the key's write lock; as of its last successful write
+};
+
+// Journal record, followed by the null-terminated key
+struct jrnlrec {
+	uint16_t op;
+	uint16_t unused;
+	uint32_t keylen;
+	uint64_t place; // the slave's direct read address and port
+	uint64_t len; // of the value, for JRN_ADDs
+	uint64_t check;
+};
+
+// A file to be brought back up to its redundancy
+struct repairjob {
+	const char *key; // interned, so it outlasts even the file's entry
+	slave_idx slavid; // the slave that failed, or the new one to mirror onto
+	bool failed; // whether slavid failed (as opposed to joining a degraded system)
+	bool replicate; // whether to copy the value anywhere, or just to forget the failed slave
+};
+
+struct orphan {
+	uint64_t len;
+	unordered_set<uint64_t> *places; // of the slaves that held the file before the master restarted, and haven't registered since
+};
+
+struct filshard {
+	pthread_rwlock_t *lock;
+	unordered_map<const char *, struct filinfo> *files; // acquire lock before reading, or exclusively before writing (including to any entry's holders); keys point into the arena
+	vector<char *> *arena; // acquire lock exclusively; chunks holding the shard's keys, which are only freed when the master exits
+	char *arena_next; // acquire lock exclusively; where the next key goes
+	size_t arena_left; // acquire lock exclusively; room left after arena_next
 };
 
 static pthread_mutex_t *slaves_lock = NULL;
 static vector<struct slavinfo *> *slaves_info = NULL; // acquire slaves_lock before reading or writing
 static vector<int>::size_type living_count; // acquire slaves_lock before writing
-static pthread_mutex_t *files_lock = NULL;
-static unordered_map<const char *, struct filinfo *> *files = NULL; // acquire files_lock before reading or writing
+static struct filshard *files = NULL; // FILES_SHARDS of them, each key living in the one its hash picks; always lock more than one in index order, and before slaves_lock
+static pthread_mutex_t *write_locks = NULL; // WRITE_STRIPES of them; acquire a key's before changing its value, and hold it until every slave in its holders stores the same value; always lock more than one in address order
+static int clients_epoll = -1;
+static int heartbeats_epoll = -1; // watches each living slave's supfd, tagged with its index
+static double suspicion_phi = DEFAULT_SUSPICION_PHI;
+static double suspicion_devs = 0; // how many standard deviations past its usual gap a slave's heartbeat may be before its suspicion reaches suspicion_phi
+static pthread_mutex_t *ready_lock = NULL;
+static pthread_cond_t *ready_notify = NULL;
+static queue<struct clientconn *> *ready_clients = NULL; // acquire ready_lock before reading or writing
+static pthread_mutex_t *flush_lock = NULL; // acquire before a client's send_lock, if both
+static unordered_set<struct clientconn *> *flush_clients = NULL; // acquire flush_lock before reading or writing; idle clients with NVMs left to send, which clientregistration() should have woken once there's room
+static int flush_wake = -1; // eventfd that tells clientregistration() to look at flush_clients
+static unsigned long write_clock = 0; // update atomically; ticks once for every value replaced, so restarted slaves can tell which of their pairs are still current
+static size_t cache_budget = 0; // 0 disables the cache
+static pthread_mutex_t *cache_lock = NULL;
+static unordered_map<const char *, struct cachedval *> *cache = NULL; // acquire cache_lock before reading or writing
+static list<struct cachedval *> *cache_probation = NULL; // acquire cache_lock; values read once, most recently used first
+static list<struct cachedval *> *cache_protected = NULL; // acquire cache_lock; values read again since, most recently used first
+static size_t cache_probation_bytes = 0; // acquire cache_lock
+static size_t cache_protected_bytes = 0; // acquire cache_lock
+static unsigned long *cache_epochs = NULL; // WRITE_STRIPES of them; acquire cache_lock; each bumped by every invalidation of a key in that write stripe, so fills that raced a write to it can be turned away
+static unsigned long cache_hits = 0; // acquire cache_lock
+static unsigned long cache_misses = 0; // acquire cache_lock
+static uint32_t lease_ms = DEFAULT_LEASE_MS; // 0 refuses clients' requests for leases
+static pthread_mutex_t *leases_lock = NULL;
+static unordered_map<const char *, unordered_map<struct clientconn *, uint64_t> *> *leases = NULL; // acquire leases_lock; who holds a lease on each key, and until when
+static unsigned int repair_workers = DEFAULT_REPAIR_WORKERS;
+static uint64_t repair_rate = 0; // bytes per second the repair workers may copy between them; 0 for no limit
+static pthread_mutex_t *repair_lock = NULL;
+static pthread_cond_t *repair_notify = NULL;
+static vector<queue<struct repairjob>> *repairs = NULL; // acquire repair_lock; indexed by how many other living slaves held each file when it was queued, up to MIN_STOR_REDUN
+static size_t repair_queued = 0; // acquire repair_lock
+static size_t repair_active = 0; // acquire repair_lock
+static size_t repair_done = 0; // acquire repair_lock; since the queues were last idle
+static size_t repair_total = 0; // acquire repair_lock; since the queues were last idle
+static uint64_t repair_bytes = 0; // acquire repair_lock; since the queues were last idle
+static uint64_t repair_started = 0; // acquire repair_lock; when the queues last stopped being idle, in ms
+static uint64_t repair_paced = 0; // acquire repair_lock; when the repair workers may next start copying, in ms
+static unsigned int rebalance_pct = DEFAULT_REBALANCE_PCT; // how far the slaves' loads may deviate from their mean, as a percentage of it, before files are moved to even them out; 0 never moves them
+static uint64_t rebalance_rate = 0; // bytes per second the rebalancer may move; 0 for no limit
+static bool rendezvous_placement = false; // place new keys by weighted rendezvous hashing rather than on the emptiest slaves
+static unsigned int hedge_pct = 0; // percentile of recent reads' response times past which a read is also sent to another holder; 0 never hedges
+static unsigned long read_latencies[LATENCY_BUCKETS] = {}; // update atomically; how many recent reads took how long to start being answered
+static unsigned long read_timings = 0; // update atomically; reads ever timed
+static unsigned long hedges_sent = 0; // update atomically
+static unsigned long hedges_won = 0; // update atomically; by the holder asked second
+static pthread_rwlock_t *candidates_lock = NULL;
+static vector<struct candidate> *candidates = NULL; // acquire candidates_lock, after slaves_lock if holding both; the living slaves, for rendezvous placement
+static unsigned long candidates_gen = 0; // acquire candidates_lock; bumped whenever a slave joins or dies
+static char *journal_dir = NULL; // NULL unless the key directory is being journaled
+static pthread_mutex_t *journal_lock = NULL;
+static int journal_fd = -1; // acquire journal_lock, after any shard locks
+static size_t journal_len = 0; // acquire journal_lock
+static unordered_map<const char *, struct orphan *> *orphans = NULL; // acquire journal_lock; files recovered from the journal that no registered slave holds yet
+static size_t orphans_left = 0; // acquire journal_lock before writing; only ever shrinks once the journal has been replayed
 
 /** Thread functions */
-static void *each_client(void *);
-static void *rereplicate(void *);
+static void *each_worker(void *);
+static void *demultiplex(void *);
+static void *repairer(void *);
+static void *rebalancer(void *);
 static void *registration(void *);
 static void *clientregistration(void *);
 static void *keepalive(void *);
+static void *checkpointer(void *);
+
+/** Request handlers */
+static void each_packet(struct clientconn *, uint16_t, char *, size_t, char *, const int *);
+static bool servefile(int, const char *, const int *);
+static void hangup(struct clientconn *);
+static void rearm(struct clientconn *);
 
 
 /** Communication functions */
-bool getfile(const char *, char **, size_t *, const int);
-bool putfile(slavinfo *, const char *, const char *, const size_t, const int, bool);
+int beginread(const char *, slavinfo **, slave_idx *, struct slavereq *);
+static int awaitrace(struct hedge *, slavinfo *const *, struct slavereq *, int, uint64_t);
+static void racenotify(struct hedge *);
+bool getfile(const char *, char **, size_t *, bool *);
+bool relayfile(const char *, const int, const int *);
+void getbatch(const int, const char *, size_t, const int *);
+void putbatch(const char *, size_t);
+bool forwardframe(int, int, const int *, uint64_t);
+bool locate(const char *, string *);
+void reclaim(slave_idx);
+bool putfile(slavinfo *, const char *, const char *, const size_t, bool, bool);
+bool copyfile(slavinfo *, const struct sockaddr_in *, const char *, size_t *);
+bool dropfile(slavinfo *, const char *);
+bool beginreq(slavinfo *, struct slavereq *);
+bool nextframe(slavinfo *, struct slavereq *, uint16_t *, uint64_t *, uint64_t = 0);
+void doneframe(slavinfo *, struct slavereq *);
+bool awaitack(slavinfo *, struct slavereq *);
+void endreq(slavinfo *, struct slavereq *);
+size_t fanslaves(slavinfo *const *, const struct slavereq *, size_t, uint16_t, const char *, size_t, bool *, bool = false);
+
+/** Cache functions */
+bool cacheget(const char *, char **, size_t *, bool *, unsigned long *);
+void cacheput(const char *, const char *, size_t, bool, unsigned long);
+void cacheforget(const char *);
+static void cachetrim();
+static void cachedrop(struct cachedval *);
+
+/** Lease functions */
+void grantlease(struct clientconn *, const char *);
+void revokeleases(const char *);
+static void sendrevoked(struct clientconn *);
+static void dropleases(struct clientconn *);
+
+/** Repair functions */
+void schedulerepairs(bool, slave_idx);
+size_t repairfile(const struct repairjob *);
+static void repairpace(size_t);
+
+/** Rebalance functions */
+bool imbalance(slave_idx *, slave_idx *, uint64_t *);
+void planeven(vector<struct movejob> *);
+bool planhome(vector<struct movejob> *);
+size_t movefile(const char *, slave_idx, slave_idx);
+
+/** Journal functions */
+void journalopen(const char *);
+void journalclose();
+void journalholder(uint16_t, const char *, slave_idx, uint64_t);
+void journalforget(const char *);
+bool journaladopt(slave_idx, const char *, uint64_t);
+void journalcheckpoint();
+static size_t journalappend(int, uint16_t, const char *, uint64_t, uint64_t);
+static size_t journalreplay(const char *, unordered_map<const char *, struct orphan *> *);
+static uint64_t placeof(const struct sockaddr_in *);
+
+/** Failure detection functions */
+static void heard(slavinfo *, uint64_t);
+static double suspicion(slavinfo *, uint64_t);
+static inline uint64_t beatdev(slavinfo *);
+static inline uint64_t deadlineof(slavinfo *);
+static double devsfor(double);
+static void condemn(slave_idx);
 
 /** Utility functions */
 slave_idx bestslave(const function<bool(slave_idx)> &);
+void rendezvous(const char *, size_t, const function<bool(slave_idx)> &, map<slave_idx, slavinfo *> *);
+void candidatesync();
+static inline double unitof(uint64_t);
+slave_idx pickholder(const char *, slave_idx = -1);
+static bool stillholds(const char *, slave_idx);
+static inline uint64_t readcost(slavinfo *);
+static void observe(slavinfo *, uint64_t);
+static inline unsigned int latencybucket(uint64_t);
+bool hedgedelay(uint64_t *);
+static inline struct filshard *shardof(const char *);
+static inline unsigned int writestripe(const char *);
+static inline pthread_mutex_t *writelock(const char *);
+struct filinfo *findfile(const char *);
+struct filinfo *addfile(struct filshard *, const char *);
+static const char *internkey(struct filshard *, const char *);
+bool holdersadd(struct holderset *, slave_idx);
+bool holdersdrop(struct holderset *, slave_idx);
+bool holdershas(const struct holderset *, slave_idx);
+vector<slave_idx> holderslist(const struct holderset *);
+static inline const uint32_t *holdersof(const struct holderset *);
+static void holdersfree(struct holderset *);
+static void unlockmutex(void *);
 void writelog(int, const char *, ...);
 
 /** CLI functions */
 static void print_slaves();
 static void print_files();
+static void print_cache();
+static void print_repairs();
 static void print_help();
 
 static const int PRI_SRS = 0;
@@ -101,21 +426,126 @@ static const int PRI_INF = 1;
 static const int PRI_DBG = 2;
 
 static int logpri = PRI_INF;
+static bool relay_gets = true; // stream values from slave to client rather than buffering them here
+static bool pack_batches = false; // pack the values in clients' MPTs before passing them on to slaves that take packed values
+static unsigned int client_workers = DEFAULT_CLIENT_WORKERS;
 
 int main(int argc, char **argv) {
+	int opt;
+	const char *journal = NULL;
+	while((opt = getopt(argc, argv, "bc:f:h:l:p:r:t:v:w:zPR:V:")) != -1) {
+		switch(opt) {
+			case 'b':
+				relay_gets = false;
+				break;
+			case 'P':
+				rendezvous_placement = true;
+				break;
+			case 'c':
+				cache_budget = atol(optarg);
+				break;
+			case 'f':
+				setframelen(atol(optarg));
+				break;
+			case 'h':
+				if(atoi(optarg) > 0 && atoi(optarg) < 100)
+					hedge_pct = atoi(optarg);
+				break;
+			case 'l':
+				lease_ms = atol(optarg);
+				break;
+			case 'p':
+				journal = optarg;
+				break;
+			case 'r':
+				if(atoi(optarg) > 0)
+					repair_workers = atoi(optarg);
+				break;
+			case 'R':
+				repair_rate = atol(optarg);
+				break;
+			case 't':
+				if(atof(optarg) > 0)
+					suspicion_phi = atof(optarg);
+				break;
+			case 'v':
+				rebalance_pct = atoi(optarg);
+				break;
+			case 'V':
+				rebalance_rate = atol(optarg);
+				break;
+			case 'w':
+				if(atoi(optarg) > 0)
+					client_workers = atoi(optarg);
+				break;
+			case 'z':
+				pack_batches = true;
+				break;
+			default:
+				printf("USAGE: %s [-b] [-P] [-c cache bytes] [-f frame bytes] [-h hedge percentile] [-l lease ms] [-p journal directory] [-r repair workers] [-R repair bytes/s] [-t suspicion phi] [-v rebalance variation %%] [-V rebalance bytes/s] [-w client workers] [-z] [log priority]\n", argv[0]);
+				return RETVAL_INVALID_ARG;
+		}
+	}
+
 	// Get debug log priority
-	if(argc > 1 && atoi(argv[1])) {
-		logpri = atoi(argv[1]);
+	if(argc > optind && atoi(argv[optind])) {
+		logpri = atoi(argv[optind]);
 	}
 	
+	signal(SIGPIPE, SIG_IGN); // a slave or client hanging up on us shows up as a failed write instead
+
 	slaves_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(slaves_lock, NULL);
 	slaves_info = new vector<slavinfo *>();
 	living_count = 0;
-	files_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-	pthread_mutex_init(files_lock, NULL);
-	files = new unordered_map<const char *, struct filinfo *>();
+	candidates_lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+	pthread_rwlock_init(candidates_lock, NULL);
+	candidates = new vector<struct candidate>();
+	files = (struct filshard *)malloc(FILES_SHARDS * sizeof(struct filshard));
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard) {
+		files[shard].lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+		pthread_rwlock_init(files[shard].lock, NULL);
+		files[shard].files = new unordered_map<const char *, struct filinfo>();
+		files[shard].arena = new vector<char *>();
+		files[shard].arena_next = NULL;
+		files[shard].arena_left = 0;
+	}
+	write_locks = (pthread_mutex_t *)malloc(WRITE_STRIPES * sizeof(pthread_mutex_t));
+	for(unsigned int stripe = 0; stripe < WRITE_STRIPES; ++stripe)
+		pthread_mutex_init(write_locks + stripe, NULL);
+	cache_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(cache_lock, NULL);
+	cache_epochs = (unsigned long *)calloc(WRITE_STRIPES, sizeof(unsigned long));
+	cache = new unordered_map<const char *, struct cachedval *>();
+	cache_probation = new list<struct cachedval *>();
+	cache_protected = new list<struct cachedval *>();
+	leases_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(leases_lock, NULL);
+	leases = new unordered_map<const char *, unordered_map<struct clientconn *, uint64_t> *>();
+	pthread_t chkthr;
+	memset(&chkthr, 0, sizeof chkthr);
+	if(journal) {
+		journalopen(journal);
+		writelog(PRI_INF, "Recovered %lu files from the journal in %s\n", orphans_left, journal);
+		pthread_create(&chkthr, NULL, &checkpointer, NULL);
+	}
+
+	repair_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(repair_lock, NULL);
+	repair_notify = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(repair_notify, NULL);
+	repairs = new vector<queue<struct repairjob>>(MIN_STOR_REDUN + 1);
+	pthread_t *repairthrs = (pthread_t *)malloc(repair_workers * sizeof(pthread_t));
+	for(unsigned int i = 0; i < repair_workers; ++i)
+		pthread_create(repairthrs + i, NULL, &repairer, NULL);
+	pthread_t balthr;
+	memset(&balthr, 0, sizeof balthr);
+	if(rebalance_pct)
+		pthread_create(&balthr, NULL, &rebalancer, NULL);
 
+	suspicion_devs = devsfor(suspicion_phi);
+	if((heartbeats_epoll = epoll_create1(0)) < 0)
+		handle_error("epoll_create1()");
 	pthread_t regthr;
 	memset(&regthr, 0, sizeof regthr);
 	pthread_create(&regthr, NULL, &registration, NULL);
@@ -123,10 +553,25 @@ int main(int argc, char **argv) {
 	memset(&supthr, 0, sizeof supthr);
 	pthread_create(&supthr, NULL, &keepalive, NULL);
 	
-	queue<pthread_t *> connected_clients;
+	if((clients_epoll = epoll_create1(0)) < 0)
+		handle_error("epoll_create1()");
+	ready_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(ready_lock, NULL);
+	ready_notify = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
+	pthread_cond_init(ready_notify, NULL);
+	ready_clients = new queue<struct clientconn *>();
+	flush_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(flush_lock, NULL);
+	flush_clients = new unordered_set<struct clientconn *>();
+	if((flush_wake = eventfd(0, EFD_NONBLOCK)) < 0)
+		handle_error("eventfd()");
+
+	pthread_t *workerthrs = (pthread_t *)malloc(client_workers * sizeof(pthread_t));
+	for(unsigned int i = 0; i < client_workers; ++i)
+		pthread_create(workerthrs + i, NULL, &each_worker, NULL);
 	pthread_t clientregthr;
 	memset(&clientregthr, 0, sizeof clientregthr);
-	pthread_create(&clientregthr, NULL, &clientregistration, &connected_clients);
+	pthread_create(&clientregthr, NULL, &clientregistration, NULL);
 	
 	// Allocate (small) space to store user input:
 	char *buf = (char*)malloc(1);
@@ -154,6 +599,10 @@ int main(int argc, char **argv) {
 			print_slaves();
 		} else if(strncmp(cmd, CMD_FIL, len) == 0) {
 			print_files();
+		} else if(strncmp(cmd, CMD_CCH, len) == 0) {
+			print_cache();
+		} else if(strncmp(cmd, CMD_RPR, len) == 0) {
+			print_repairs();
 		} else if(strncmp(cmd, CMD_HLP, len) == 0) {
 			print_help();
 		} else if(strncmp(cmd, CMD_GFO, len) == 0) {
@@ -170,26 +619,59 @@ int main(int argc, char **argv) {
 	pthread_join(regthr, NULL);
 	pthread_join(supthr, NULL);
 	pthread_join(clientregthr, NULL);
+	close(heartbeats_epoll);
+
+	for(unsigned int i = 0; i < client_workers; ++i) {
+		pthread_cancel(workerthrs[i]);
+		pthread_join(workerthrs[i], NULL);
+	}
+	free(workerthrs);
+	close(clients_epoll);
+	close(flush_wake);
+
+	if(rebalance_pct) {
+		pthread_cancel(balthr);
+		pthread_join(balthr, NULL);
+	}
+	for(unsigned int i = 0; i < repair_workers; ++i) {
+		pthread_cancel(repairthrs[i]);
+		pthread_join(repairthrs[i], NULL);
+	}
+	free(repairthrs);
+	delete repairs;
+	repairs = NULL;
+	pthread_cond_destroy(repair_notify);
+	free(repair_notify);
+	repair_notify = NULL;
+	pthread_mutex_destroy(repair_lock);
+	free(repair_lock);
+	repair_lock = NULL;
 
-	while(connected_clients.size()) {
-		pthread_cancel(*connected_clients.front());
-		pthread_join(*connected_clients.front(), NULL);
-		free(connected_clients.front());
-		connected_clients.pop();
+	if(journal_dir) {
+		pthread_cancel(chkthr);
+		pthread_join(chkthr, NULL);
+		journalclose();
 	}
 
 	pthread_mutex_lock(slaves_lock);
 	while(slaves_info->size()) {
 		struct slavinfo *each = slaves_info->back();
 		slaves_info->pop_back();
+		pthread_cancel(each->demux);
+		pthread_join(each->demux, NULL);
 		pthread_mutex_destroy(each->waiting_lock);
 		free(each->waiting_lock);
 		each->waiting_lock = NULL;
-		pthread_cond_destroy(each->waiting_notify);
-		free(each->waiting_notify);
-		each->waiting_notify = NULL;
 		delete each->waiting_clients;
 		each->waiting_clients = NULL;
+		delete each->pending;
+		each->pending = NULL;
+		pthread_mutex_destroy(each->send_lock);
+		free(each->send_lock);
+		each->send_lock = NULL;
+		pthread_cond_destroy(each->handback_notify);
+		free(each->handback_notify);
+		each->handback_notify = NULL;
 		free(each);
 	}
 	delete slaves_info;
@@ -197,20 +679,53 @@ int main(int argc, char **argv) {
 	pthread_mutex_destroy(slaves_lock);
 	free(slaves_lock);
 	slaves_lock = NULL;
+	delete candidates;
+	candidates = NULL;
+	pthread_rwlock_destroy(candidates_lock);
+	free(candidates_lock);
+	candidates_lock = NULL;
 
-	pthread_mutex_lock(files_lock);
-	for(auto it = files->begin(); it != files->end(); ++it) {
-		pthread_mutex_destroy(it->second->write_lock);
-		free(it->second->write_lock);
-		delete it->second->holders;
-		free(it->second);
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard) {
+		pthread_rwlock_wrlock(files[shard].lock);
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end(); ++it)
+			holdersfree(&it->second.holders);
+		delete files[shard].files;
+		for(char *chunk : *files[shard].arena)
+			free(chunk);
+		delete files[shard].arena;
+		pthread_rwlock_unlock(files[shard].lock);
+		pthread_rwlock_destroy(files[shard].lock);
+		free(files[shard].lock);
+	}
+	free(files);
+	files = NULL;
+	for(unsigned int stripe = 0; stripe < WRITE_STRIPES; ++stripe)
+		pthread_mutex_destroy(write_locks + stripe);
+	free(write_locks);
+	write_locks = NULL;
+
+	pthread_mutex_lock(cache_lock);
+	while(cache->size())
+		cachedrop(cache->begin()->second);
+	delete cache;
+	delete cache_probation;
+	delete cache_protected;
+	free(cache_epochs);
+	pthread_mutex_unlock(cache_lock);
+	pthread_mutex_destroy(cache_lock);
+	free(cache_lock);
+	cache_lock = NULL;
+
+	pthread_mutex_lock(leases_lock);
+	for(auto it = leases->begin(); it != leases->end(); ++it) {
+		delete it->second;
 		free((char *)it->first);
 	}
-	delete files;
-	pthread_mutex_unlock(files_lock);
-	pthread_mutex_destroy(files_lock);
-	free(files_lock);
-	files_lock = NULL;
+	delete leases;
+	pthread_mutex_unlock(leases_lock);
+	pthread_mutex_destroy(leases_lock);
+	free(leases_lock);
+	leases_lock = NULL;
 }
 
 // Selects the most ideal slave from the slave vector
@@ -235,344 +750,2510 @@ slave_idx bestslave(const function<bool(slave_idx)> &redundant) {
 	return bestslaveidx;
 }
 
-void *each_client(void *f) {
-	int fd = *(int *)f;
-	free(f);
+// Ranks the living slaves for a key by weighted rendezvous hashing, so that where a key belongs follows from which slaves are alive, and a slave joining or dying only ever moves the keys it ranks first for
+// Accepts: the key, how many slaves to pick, a lambda expression that returns whether a particular slave has already been chosen, and where to add the picks
+void rendezvous(const char *key, size_t count, const function<bool(slave_idx)> &redundant, map<slave_idx, slavinfo *> *chosen) {
+	if(!count)
+		return;
+	uint64_t hash = keyhash(key);
+	vector<pair<double, const struct candidate *>> best; // highest scoring first
+	pthread_rwlock_rdlock(candidates_lock);
+	for(const struct candidate &each : *candidates) {
+		if(redundant(each.idx))
+			continue;
+		double score = each.weight / -log(unitof(hash ^ each.seed));
+		if(best.size() == count && score <= best.back().first)
+			continue;
+		auto spot = best.begin();
+		while(spot != best.end() && spot->first >= score)
+			++spot;
+		best.insert(spot, pair<double, const struct candidate *>(score, &each));
+		if(best.size() > count)
+			best.pop_back();
+	}
+	for(const pair<double, const struct candidate *> &pick : best)
+		(*chosen)[pick.second->idx] = pick.second->slave;
+	pthread_rwlock_unlock(candidates_lock);
+}
 
-	while(true) {
-		char *payld = NULL;
-		char *junk = NULL;
-		bool inbound = 0; // whether a HRZ message
-		if(recvpkt(fd, OPC_PLZ|OPC_HRZ, &payld, &inbound, 0, false)) {
-			writelog(PRI_INF, "Received %s packet for key %s\n", inbound ? "HRZ" : "PLZ", payld);
-			if(inbound) {
-				// We got a HRZ packet
-				size_t jsize;
-				recvfile(fd, &junk, &jsize);
-				// printf("It was %lu bytes long\n", jsize);
-				// printf("\tAND IT WAS CARRYING ALL THIS: %s\n", junk);
-				
-				// Store the file with some slaves
-				unordered_map<slave_idx, slavinfo *> slavestorecv;
-				
-				bool already_stored = false;
-				
-				pthread_mutex_lock(files_lock);
-				if(files->find(payld) != files->end()) {
-					already_stored = true;
-					writelog(PRI_INF, "File '%s' has already been stored on the following slaves: ", payld);
-					// The file exists in the table
-					struct filinfo *file_info = (*files)[payld];
-					pthread_mutex_lock(slaves_lock);
-					for(slave_idx slaveidx : *(file_info->holders)) {
-						writelog(PRI_INF, "%lu ", slaveidx);
-						slavinfo *slave = (*slaves_info)[slaveidx];
-						slavestorecv[slaveidx] = slave;
-					}
-					pthread_mutex_unlock(slaves_lock);
-					writelog(PRI_INF, "\n");
+// Rebuilds the list of slaves that rendezvous placement chooses among, after one joins or dies
+// Assumes that you ALREADY hold the slaves_lock
+void candidatesync() {
+	pthread_rwlock_wrlock(candidates_lock);
+	candidates->clear();
+	for(slave_idx idx = 0; idx < slaves_info->size(); ++idx) {
+		slavinfo *slave = (*slaves_info)[idx];
+		if(!slave->alive)
+			continue;
+		uint64_t place = slave->reads.sin_port ? placeof(&slave->reads) : idx;
+		struct candidate each = {idx, slave, keyhash((const char *)&place, sizeof place), (double)slave->weight};
+		candidates->push_back(each);
+	}
+	++candidates_gen;
+	pthread_rwlock_unlock(candidates_lock);
+}
+
+// Turns a key's hash combined with a slave's seed into a number strictly between 0 and 1, mixing it once more so that keys differing in few bits still rank the slaves independently
+// Accepts: the combined hash
+// Returns: the number
+static inline double unitof(uint64_t hash) {
+	hash ^= hash >> 31;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 29;
+	return ((hash >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+// Handles one request from a client, which may stream a value in or out on the client's connection before returning
+// Accepts: the client's connection, the request's opcode and payload (which we take ownership of) and its length, a window's worth of buffer, and an empty pipe to splice through
+static void each_packet(struct clientconn *conn, uint16_t opcode, char *payld, size_t plen, char *window, const int *relaypipe) {
+	int fd = conn->fd;
+	if(opcode == OPC_HEY) {
+		// The client wants to upgrade, so meet it at the newest version we both speak
+		uint8_t version = min(*payld ? (uint8_t)*payld : PROTO_V1, PROTO_CLIENT_LATEST);
+		free(payld);
+		sendhey(fd, version);
+		setproto(fd, version);
+		writelog(PRI_DBG, "Client speaks protocol version %u\n", version);
+		return;
+	}
+	if(opcode == OPC_MPT) {
+		writelog(PRI_INF, "Received MPT packet carrying %lu bytes of pairs\n", plen);
+		putbatch(payld, plen);
+		free(payld);
+		return;
+	}
+	if(opcode == OPC_WHR) {
+		// The client would rather read the value straight from a slave, so tell it whom to ask
+		writelog(PRI_DBG, "Received WHR packet for key %s\n", payld);
+		string where;
+		if(locate(payld, &where))
+			sendpkt(fd, OPC_WHR, where.data(), where.size());
+		else
+			sendpkt(fd, OPC_FKU, NULL, 0);
+		free(payld);
+		return;
+	}
+	if(opcode == OPC_DIB) {
+		// The client wants to cache values, so tell it how long it may trust each one
+		free(payld);
+		conn->leasing = lease_ms > 0;
+		sendpkt(fd, OPC_DIB, (const char *)&lease_ms, sizeof lease_ms);
+		writelog(PRI_DBG, "Client asked for leases, and got %u ms\n", lease_ms);
+		return;
+	}
+	if(opcode == OPC_MGT) {
+		writelog(PRI_INF, "Received MGT packet for %lu bytes of keys\n", plen);
+		getbatch(fd, payld, plen, relaypipe);
+		free(payld);
+		return;
+	}
+	bool inbound = opcode == OPC_HRZ;
+	writelog(PRI_INF, "Received %s packet for key %s\n", inbound ? "HRZ" : "PLZ", payld);
+	if(inbound) {
+		// We got a HRZ packet; its value will be streamed on to the slaves as it arrives
+		bool packed = ispacked(fd);
+		
+		// Store the file with some slaves, visiting them in index order so concurrent writers can't deadlock on each other's queues
+		map<slave_idx, slavinfo *> slavestorecv;
+		
+		bool already_stored = false;
+		struct filshard *shard = shardof(payld);
+		
+		pthread_rwlock_rdlock(shard->lock);
+		auto found = shard->files->find(payld);
+		if(found != shard->files->end()) {
+			already_stored = true;
+			writelog(PRI_INF, "File '%s' has already been stored on the following slaves: ", payld);
+			// The file exists in the table
+			const struct holderset *holders = &found->second.holders;
+			pthread_mutex_lock(slaves_lock);
+			for(uint32_t each = 0; each < holders->count; ++each) {
+				slave_idx slaveidx = holdersof(holders)[each];
+				writelog(PRI_INF, "%lu ", slaveidx);
+				slavinfo *slave = (*slaves_info)[slaveidx];
+				slavestorecv[slaveidx] = slave;
+			}
+			pthread_mutex_unlock(slaves_lock);
+			writelog(PRI_INF, "\n");
+		}
+		pthread_rwlock_unlock(shard->lock);
+		
+		// If it's a new file, store it with the MIN_STOR_REDUN most ideal slaves
+		if(!already_stored && rendezvous_placement) {
+			rendezvous(payld, MIN_STOR_REDUN, [](slave_idx check){return false;}, &slavestorecv);
+			writelog(PRI_INF, "Placed '%s' on %lu slaves by rendezvous hashing\n", payld, slavestorecv.size());
+		}
+		else if(!already_stored) {
+			pthread_mutex_lock(slaves_lock);
+			auto numslaves = living_count;
+			unsigned int numtoget = min(numslaves, MIN_STOR_REDUN);
+			writelog(PRI_INF, "Selecting %u best slaves from %lu responsive slaves\n", numtoget, numslaves);
+			for(unsigned int i = 0; i < numtoget; ++i) {
+				writelog(PRI_DBG, "on iter %u < %u\n", i, numtoget);
+				slave_idx bestslaveidx = bestslave([&slavestorecv](slave_idx check){return slavestorecv.count(check);});
+				slavinfo *bestslave = (*slaves_info)[bestslaveidx];
+				if(bestslave == NULL) {
+					writelog(PRI_DBG, "Something went very wrong; I selected a null best slave from index %lu!\n", bestslaveidx);
 				}
-				pthread_mutex_unlock(files_lock);
 				
-				// If it's a new file, store it with the MIN_STOR_REDUN most ideal slaves
-				if(!already_stored) {
-					pthread_mutex_lock(slaves_lock);
-					auto numslaves = living_count;
-					unsigned int numtoget = min(numslaves, MIN_STOR_REDUN);
-					writelog(PRI_INF, "Selecting %u best slaves from %lu responsive slaves\n", numtoget, numslaves);
-					for(unsigned int i = 0; i < numtoget; ++i) {
-						writelog(PRI_DBG, "on iter %u < %u\n", i, numtoget);
-						slave_idx bestslaveidx = bestslave([slavestorecv](slave_idx check){return slavestorecv.count(check);});
-						slavinfo *bestslave = (*slaves_info)[bestslaveidx];
-						if(bestslave == NULL) {
-							writelog(PRI_DBG, "Something went very wrong; I selected a null best slave from index %lu!\n", bestslaveidx);
-						}
-						
-						slavestorecv[bestslaveidx] = bestslave;
-						writelog(PRI_DBG, "Selecting slave %lu as a best slave\n", bestslaveidx);
-					}
-					pthread_mutex_unlock(slaves_lock);
+				slavestorecv[bestslaveidx] = bestslave;
+				writelog(PRI_DBG, "Selecting slave %lu as a best slave\n", bestslaveidx);
+			}
+			pthread_mutex_unlock(slaves_lock);
+		}
+		
+		writelog(PRI_DBG, "slavestorecv has %lu slaves\n", slavestorecv.size());
+		
+		// We need to grab this either way
+		pthread_mutex_t *writeprotect_lock = writelock(payld);
+
+		pthread_mutex_lock(writeprotect_lock);
+
+		// Only now that a repair can't wipe it out from under us, look the file up again, adding it if it's new
+		pthread_rwlock_wrlock(shard->lock);
+		found = shard->files->find(payld);
+		struct filinfo *file_entry = found == shard->files->end() ? addfile(shard, payld) : &found->second; // stays put for as long as we hold the write protect lock
+		journalforget(payld); // slaves yet to come back would otherwise return with the old value
+		pthread_rwlock_unlock(shard->lock);
+
+		size_t numrepl = slavestorecv.size();
+		vector<slavinfo *> repls;
+		struct slavereq *reqs = (struct slavereq *)malloc(numrepl * sizeof(struct slavereq));
+		bool *healthy = (bool *)malloc(numrepl * sizeof(bool)); // whether each replica's copy is still on track
+		for(pair<slave_idx, slavinfo *> entry: slavestorecv) {
+			writelog(PRI_INF, "Sending file to slave %lu\n", entry.first);
+			healthy[repls.size()] = beginreq(entry.second, &reqs[repls.size()]);
+			repls.push_back(entry.second);
+		}
+		// Slaves too old to know a packed value would store it as though it weren't, so any such replica means unpacking it for them all
+		bool unpack = false;
+		for(slavinfo *repl : repls)
+			unpack = unpack || (packed && getproto(repl->ctlfd) < PROTO_V4);
+		fanslaves(repls.data(), reqs, numrepl, OPC_HRZ, payld, strlen(payld), healthy, packed && !unpack);
+
+		size_t jsize = 0;
+		bool succeeded = true;
+		if(unpack) {
+			// That takes the whole value at once, which is fine for as long as older slaves are still around
+			char *value = NULL;
+			size_t vlen = 0;
+			char *raw = NULL;
+			if((succeeded = recvfile(fd, &value, &vlen) && unpackval(value, vlen, &raw, &jsize))) {
+				if(jsize)
+					fanslaves(repls.data(), reqs, numrepl, OPC_STF, raw, jsize, healthy);
+			}
+			else
+				writelog(PRI_SRS, "Couldn't unpack '%s' for slaves that can't hold it packed\n", payld);
+			free(value);
+			free(raw);
+		}
+		else {
+			// Pass each chunk along to every slave at once before accepting the next, so we never hold more than one window of the value
+			size_t chunklen;
+			uint64_t frameleft = 0;
+			do {
+				if(!recvchunk(fd, window, PUT_WINDOW_LEN, &chunklen, &frameleft)) {
+					writelog(PRI_SRS, "Client hung up or stalled partway through sending '%s'\n", payld);
+					succeeded = false;
+					break;
 				}
-				
-				writelog(PRI_DBG, "slavestorecv has %lu slaves\n", slavestorecv.size());
-				
-				// Lock on the files so we can get the write protect lock, and check again if we're a new file
-				pthread_mutex_lock(files_lock);
-				if(!already_stored) {
-					// The file doesn't exist in the table yet
-					struct filinfo *file_entry = (struct filinfo *)malloc(sizeof(struct filinfo));
-					file_entry->write_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
-					pthread_mutex_init(file_entry->write_lock, NULL);
-					file_entry->holders = new unordered_set<slave_idx>();
-					(*files)[payld] = file_entry;
+				if(chunklen)
+					fanslaves(repls.data(), reqs, numrepl, OPC_STF, window, chunklen, healthy);
+				jsize += chunklen;
+			}
+			while(chunklen);
+		}
+
+		// Terminate the value, or call it off if the client didn't finish it, so the slaves' streams stay in step either way
+		fanslaves(repls.data(), reqs, numrepl, succeeded ? OPC_STF : OPC_FKU, NULL, 0, healthy);
+
+		size_t stored = 0;
+		size_t repl = 0;
+		for(pair<slave_idx, slavinfo *> entry: slavestorecv) {
+			slave_idx slaveidx = entry.first;
+			slavinfo *slave = entry.second;
+			
+			// Slaves that tag their requests also tell us once they've stored the value, but say nothing once it's been called off
+			if(healthy[repl] && slave->mux && succeeded)
+				healthy[repl] = awaitack(slave, &reqs[repl]);
+			endreq(slave, &reqs[repl]);
+
+			if(!succeeded) {
+				// Those that don't tag them can't be told to throw away what they got, so their copy can't be trusted any more
+				if(!slave->mux && already_stored) {
+					pthread_rwlock_wrlock(shard->lock);
+					if(holdersdrop(&file_entry->holders, slaveidx))
+						journalholder(JRN_DEL, payld, slaveidx, 0);
+					pthread_rwlock_unlock(shard->lock);
 				}
+				++repl;
+				continue;
+			}
+
+			if(healthy[repl++] && succeeded) {
+				writelog(PRI_DBG, "Succeeded in sending to slave %lu!\n", slaveidx);
+				if(!already_stored) // It's a Brand New File (for this slave, that is)
+					__sync_fetch_and_add(&slave->howfull, jsize);
 				
-				// We need to grab this either way
-				pthread_mutex_t *writeprotect_lock = (*files)[payld]->write_lock;
-				pthread_mutex_unlock(files_lock);
-
-				pthread_mutex_lock(writeprotect_lock);
-				for(pair<slave_idx, slavinfo *> entry: slavestorecv) {
-					slave_idx slaveidx = entry.first;
-					slavinfo *slave = entry.second;
-					
-					writelog(PRI_INF, "Sending file to slave %lu\n", slaveidx);
-					
-					if(putfile(slave, payld, junk, jsize, fd, !already_stored)) {
-						writelog(PRI_DBG, "Succeeded in sending to slave %lu!\n", slaveidx);
-						
-						// Lock and update the file map
-						pthread_mutex_lock(files_lock);
-						(*files)[payld]->holders->insert(slaveidx);
-						pthread_mutex_unlock(files_lock);
-					} else {
-						// TODO handle the case where the transfer was not successful
-						writelog(PRI_SRS, "The transfer to slave %lu was not successful\n", slaveidx);
-					}
-				}
-				pthread_mutex_unlock(writeprotect_lock);
-				free(junk);
+				// Lock and update the file map
+				pthread_rwlock_wrlock(shard->lock);
+				holdersadd(&file_entry->holders, slaveidx);
+				journalholder(JRN_ADD, payld, slaveidx, jsize);
+				pthread_rwlock_unlock(shard->lock);
+				++stored;
 			} else {
-				// We got a PLZ packet
-				
-				// Get the file from the best containing slave
-				char *filedata;
-				size_t dlen;
-				if(getfile(payld, &filedata, &dlen, fd)) {
-					// Send the file to the client
-					sendfile(fd, payld, filedata, dlen);
-				} else {
-					writelog(PRI_DBG, "A client's get FAILED!\n");
-					sendpkt(fd, OPC_FKU, NULL, 0);
-				}
-				
-				free(payld);
+				// TODO handle the case where the transfer was not successful
+				writelog(PRI_SRS, "The transfer to slave %lu was not successful\n", slaveidx);
 			}
 		}
+		free(healthy);
+		free(reqs);
+		if(!succeeded) {
+			// The old value (if any) still stands, so there's nothing for readers to hear about; the client has lost its place, though
+			writelog(PRI_SRS, "Abandoned the write of '%s'\n", payld);
+			pthread_mutex_unlock(writeprotect_lock);
+			sendpkt(fd, OPC_FKU, payld, 0);
+			conn->lost = true;
+			free(payld);
+			return;
+		}
+		writelog(stored < numrepl ? PRI_SRS : PRI_DBG, "Stored '%s' on %lu of %lu slaves\n", payld, stored, numrepl);
+		file_entry->written = __sync_add_and_fetch(&write_clock, 1);
+		if(stored)
+			file_entry->len = jsize;
+		cacheforget(payld); // only now that the slaves have the new value, or readers that missed partway through could cache the old one
+		revokeleases(payld);
+		pthread_mutex_unlock(writeprotect_lock);
+		free(payld);
+	} else {
+		// We got a PLZ packet
+		if(conn->leasing)
+			grantlease(conn, payld); // before we look up the value, so that a write landing in between is sure to revoke it
+		
+		// Get the file from the best containing slave
+		if(!servefile(fd, payld, relaypipe)) {
+			writelog(PRI_DBG, "A client's get FAILED!\n");
+			sendpkt(fd, OPC_FKU, NULL, 0);
+		}
+		
+		free(payld);
 	}
-
-	return NULL;
 }
 
-// Gets a file from what it deems to be the best slave (based currently on queue size)
-// Accepts: a filename string to request, a pointer to where the data should be stored, a pointer to the length of the data, and a unique ID to add to the slave's queue (client file descriptor is a good choice)
-bool getfile(const char *filename, char **databuf, size_t *dlen, const int queueid) {
-	pthread_mutex_lock(files_lock);
-	if(!files->count(filename)) {
-		pthread_mutex_unlock(files_lock);
+// Sends a client one file from the best slave holding it, either relaying it as it arrives or buffering it whole first
+// Accepts: the client's file descriptor, the key, and an empty pipe to splice through (or -1s to buffer instead)
+// Returns: whether the file was found, in which case at least its HRZ has been sent
+static bool servefile(int fd, const char *key, const int *relaypipe) {
+	char *filedata;
+	size_t dlen;
+	bool packed;
+	unsigned long epoch;
+	if(cacheget(key, &filedata, &dlen, &packed, &epoch)) {
+		sendfile(fd, key, filedata, dlen, 0, packed);
+		free(filedata);
+		return true;
+	}
+
+	// A relayed value never passes through our memory, so there'd be nothing to cache (or to unpack for clients too old to do so themselves)
+	if(relay_gets && relaypipe[0] >= 0 && !cache_budget && getproto(fd) >= PROTO_V4)
+		return relayfile(key, fd, relaypipe);
+
+	if(!getfile(key, &filedata, &dlen, &packed))
 		return false;
+	cacheput(key, filedata, dlen, packed, epoch);
+	sendfile(fd, key, filedata, dlen, 0, packed);
+	free(filedata);
+	return true;
+}
+
+// Waits for clients with requests ready to be read, and serves them one request at a time
+void *each_worker(void *ignored) {
+	char *window = (char *)malloc(PUT_WINDOW_LEN); // a write's worth of value in flight
+	int relaypipe[2] = {-1, -1};
+	if(relay_gets && !pipe(relaypipe)) {
+#ifdef F_SETPIPE_SZ
+		fcntl(relaypipe[0], F_SETPIPE_SZ, RELAY_PIPE_LEN); // fewer, larger splices
+#endif
 	}
-	unordered_set<slave_idx> *containing_slaves = (*files)[filename]->holders;
-	pthread_mutex_unlock(files_lock);
-	
-	slave_idx bestslaveidx = -1;
-	slave_idx bestqueuesize = 0;
-	bool sentinel = true;
-	for(slave_idx slaveidx : *containing_slaves) {
-		pthread_mutex_lock(slaves_lock);
-		slavinfo *slave = (*slaves_info)[slaveidx];
-		if(slave->alive) {
-			pthread_mutex_lock(slave->waiting_lock);
-			slave_idx queuesize = slave->waiting_clients->size();
-			pthread_mutex_unlock(slave->waiting_lock);
-			if(queuesize < bestqueuesize || sentinel) {
-				sentinel = false;
-				bestslaveidx = slaveidx;
-				bestqueuesize = queuesize;
-			}
+
+	while(true) {
+		pthread_mutex_lock(ready_lock);
+		pthread_cleanup_push(unlockmutex, ready_lock); // we're cancelled at shutdown while waiting, which reacquires the lock
+		while(!ready_clients->size())
+			pthread_cond_wait(ready_notify, ready_lock);
+		pthread_cleanup_pop(false);
+		struct clientconn *conn = ready_clients->front();
+		ready_clients->pop();
+		pthread_mutex_unlock(ready_lock);
+
+		// We may have been woken only because there's room for NVMs that didn't fit before
+		pthread_mutex_lock(conn->send_lock);
+		flushpkts(conn->fd, conn->unsent, true);
+		pthread_mutex_unlock(conn->send_lock);
+
+		int state = recvpart(conn->fd, &conn->pending);
+		if(state < 0) {
+			// The client hung up (or mangled its header beyond repair, or claimed a request too long to be one)
+			hangup(conn);
+			continue;
 		}
-		pthread_mutex_unlock(slaves_lock);
+		if(state) {
+			uint16_t opcode = conn->pending.opcode;
+			char *payld = conn->pending.payld;
+			size_t plen = conn->pending.len;
+			memset(&conn->pending, 0, sizeof conn->pending);
+			pthread_mutex_lock(conn->send_lock); // keep NVMs from landing in the middle of our answer
+			flushpkts(conn->fd, conn->unsent, false); // and get any that are already on their way out of the way first
+			if(opcode & (OPC_PLZ|OPC_HRZ|OPC_HEY|OPC_MGT|OPC_MPT|OPC_DIB|OPC_WHR))
+				each_packet(conn, opcode, payld, plen, window, relaypipe);
+			else
+				free(payld); // not the opcode we're looking for
+			if(conn->leasing)
+				sendrevoked(conn);
+			else
+				pthread_mutex_unlock(conn->send_lock);
+		}
+		if(conn->lost) {
+			// Whatever it sends next would be read from the middle of something else
+			hangup(conn);
+			continue;
+		}
+
+		// Serve one request at a time, so that a chatty client can't starve the rest; if there's more to read, we'll be woken right back up
+		if(buffered(conn->fd)) {
+			// We've already read some of its next request, so epoll wouldn't wake us for it
+			pthread_mutex_lock(ready_lock);
+			ready_clients->push(conn);
+			pthread_mutex_unlock(ready_lock);
+			pthread_cond_signal(ready_notify);
+			continue;
+		}
+		pthread_mutex_lock(conn->send_lock);
+		rearm(conn);
+		pthread_mutex_unlock(conn->send_lock);
 	}
-	
-	if(bestslaveidx == (slave_idx)-1) {
-		// TODO: No slave is alive
-		writelog(PRI_SRS, "No slave is alive from which we may receive file '%s'!\n", filename);
+
+	return NULL;
+}
+
+// Hands a client's connection back to epoll, to be woken once its next request starts to arrive, or once there's room to send it NVMs that are still waiting.  Call while holding its send_lock, either from the worker that has it or, if it's idle, from clientregistration() once that's seen every wakeup epoll has given it.
+// Accepts: the client
+void rearm(struct clientconn *conn) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT|(conn->unsent->size() ? (unsigned)EPOLLOUT : 0);
+	ev.data.ptr = conn;
+	conn->idle = true;
+	epoll_ctl(clients_epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// Closes a client's connection and forgets everything about it
+// Accepts: the client, which we take ownership of
+void hangup(struct clientconn *conn) {
+	dropleases(conn); // before closing, so no one pushes an NVM to a recycled descriptor
+	pthread_mutex_lock(flush_lock);
+	flush_clients->erase(conn);
+	pthread_mutex_unlock(flush_lock);
+	rdforget(conn->fd);
+	close(conn->fd);
+	free(conn->pending.payld);
+	pthread_mutex_destroy(conn->send_lock);
+	free(conn->send_lock);
+	delete conn->leased;
+	delete conn->revoked;
+	delete conn->unsent;
+	free(conn);
+}
+
+// Looks for a value in the cache, counting the hit or miss
+// Accepts: the key, spots for a copy of the value, its length, and whether it's packed, and a spot for the key's cache epoch, which must be passed to cacheput() if it's then fetched from a slave
+// Returns: whether it was there, in which case the copy is ours to free
+bool cacheget(const char *key, char **data, size_t *len, bool *packed, unsigned long *epoch) {
+	if(!cache_budget)
+		return false;
+
+	pthread_mutex_lock(cache_lock);
+	*epoch = cache_epochs[writestripe(key)];
+	auto found = cache->find(key);
+	if(found == cache->end()) {
+		++cache_misses;
+		pthread_mutex_unlock(cache_lock);
 		return false;
 	}
-	
-	pthread_mutex_lock(slaves_lock);
-	
-	slavinfo *bestslave = (*slaves_info)[bestslaveidx];
-	// Lock on the slave's queue
-	pthread_mutex_lock(bestslave->waiting_lock);
-	// Add ourselves to the slave's queue
-	bestslave->waiting_clients->push(queueid);
-	// Wait while we're not first in the slave's queue
-	while(bestslave->waiting_clients->front() != queueid) {
-		pthread_cond_wait(bestslave->waiting_notify, bestslave->waiting_lock);
+	++cache_hits;
+
+	// Anything read a second time graduates to the protected segment; there, it just moves to the front
+	struct cachedval *hit = found->second;
+	if(hit->protect) {
+		cache_protected->splice(cache_protected->begin(), *cache_protected, hit->where);
+	} else {
+		cache_probation->erase(hit->where);
+		cache_probation_bytes -= hit->cost;
+		cache_protected->push_front(hit);
+		cache_protected_bytes += hit->cost;
+		hit->where = cache_protected->begin();
+		hit->protect = true;
+		cachetrim();
 	}
-	
-	pthread_mutex_unlock(bestslave->waiting_lock);
-	
-	sendpkt(bestslave->ctlfd, OPC_PLZ, filename, 0);
-	bool blackhole; // we know it's going to be a HRZ, so we ignore this
-	
-	char *receivedfilename;
-	recvpkt(bestslave->ctlfd, OPC_HRZ, &receivedfilename, &blackhole, NULL, false);
-	writelog(PRI_INF, "Receiving file '%s' from slave %lu\n", receivedfilename, bestslaveidx);
-	recvfile(bestslave->ctlfd, databuf, dlen);
-	
-	// Lock and pop ourselves off the queue
-	pthread_mutex_lock(bestslave->waiting_lock);
-	bestslave->waiting_clients->pop();
-	
-	// Unlock just in case broadcast doesn't
-	pthread_mutex_unlock(bestslave->waiting_lock);
-	
-	// Notify all others waiting on the slave
-	pthread_cond_broadcast(bestslave->waiting_notify);
-	
-	pthread_mutex_unlock(slaves_lock);
-	
+
+	*len = hit->len;
+	*packed = hit->packed;
+	*data = (char *)malloc(hit->len + 1);
+	memcpy(*data, hit->data, hit->len + 1);
+	pthread_mutex_unlock(cache_lock);
 	return true;
 }
 
-bool putfile(slavinfo *slave, const char *filename, const char *filedata, const size_t dlen, const int queueid, bool newfile) {
-	bool succeeded = true;
-	
-	// Lock on the slave's queue
-	pthread_mutex_lock(slave->waiting_lock);
-	// Add ourselves to the slave's queue
-	slave->waiting_clients->push(queueid);
-	// Wait while we're not first in the slave's queue
-	while(slave->waiting_clients->front() != queueid) {
-		pthread_cond_wait(slave->waiting_notify, slave->waiting_lock);
+// Offers the cache a value just fetched from a slave, which it takes on probation if there's room and no write has come through since
+// Accepts: the key, the value, its length, whether it's packed (in which case it's kept that way, so it takes less of the budget), and the epoch cacheget() gave when it missed
+void cacheput(const char *key, const char *data, size_t len, bool packed, unsigned long epoch) {
+	size_t cost = strlen(key) + 1 + len;
+	if(!cache_budget || cost > cache_budget / CACHE_ENTRY_FRACTION)
+		return;
+
+	pthread_mutex_lock(cache_lock);
+	if(epoch == cache_epochs[writestripe(key)] && !cache->count(key)) {
+		struct cachedval *fill = new struct cachedval;
+		fill->key = strdup(key);
+		fill->data = (char *)malloc(len + 1);
+		memcpy(fill->data, data, len);
+		fill->data[len] = '\0';
+		fill->len = len;
+		fill->packed = packed;
+		fill->cost = cost;
+		fill->protect = false;
+		cache_probation->push_front(fill);
+		cache_probation_bytes += cost;
+		fill->where = cache_probation->begin();
+		(*cache)[fill->key] = fill;
+		cachetrim();
 	}
-	
-	pthread_mutex_unlock(slave->waiting_lock);
-	
-	// Send the file to the slave; this is the moment we've all been waiting for!
-	succeeded = sendfile(slave->ctlfd, filename, filedata, dlen);
-	if(newfile) // It's a Brand New File (for this slave, that is)
-		slave->howfull = slave->howfull + strlen(filedata);
-	
-	// Lock and pop ourselves off the queue
-	pthread_mutex_lock(slave->waiting_lock);
-	slave->waiting_clients->pop();
-	
-	// Unlock just in case broadcast doesn't
-	pthread_mutex_unlock(slave->waiting_lock);
-	
-	// Notify all others waiting on the slave
-	pthread_cond_broadcast(slave->waiting_notify);
-	
-	return succeeded;
+	pthread_mutex_unlock(cache_lock);
 }
 
-// 3 modes:
-//   registering?	replicate *all*
-//   burying?
-//     healthy?		replicate selectively
-//     degrading?	wipe
-void *rereplicate(void *i) {
-	bool slave_failed = *(bool *)i;
-	slave_idx failed_slavid = *(slave_idx *)((bool *)i+1);
-	free(i);
-	pthread_detach(pthread_self());
-
-	map<const char *, struct filinfo *> *files_local = new map<const char *, struct filinfo *>();
-	bool actually_replicate = true;
+// Throws out any cached copy of a value that's being replaced, and turns away fills of keys in its write stripe that began before now.  Call while holding the file's write_lock, once the slaves have the new value.
+// Accepts: the key
+void cacheforget(const char *key) {
+	if(!cache_budget)
+		return;
 
-	pthread_mutex_lock(slaves_lock);
+	pthread_mutex_lock(cache_lock);
+	++cache_epochs[writestripe(key)];
+	auto found = cache->find(key);
+	if(found != cache->end())
+		cachedrop(found->second);
+	pthread_mutex_unlock(cache_lock);
+}
 
-	if(slave_failed) {
-		copy_if(files->begin(), files->end(), inserter(*files_local, files_local->begin()), [failed_slavid](const pair<const char *, struct filinfo *> &it){return it.second->holders->count(failed_slavid);});
-		if(living_count < MIN_STOR_REDUN) actually_replicate = false; // All nodes are already identical, so replicating is pointless
+// Demotes the least recently used protected values until that segment fits its share, then evicts from the tail of probation until the whole cache fits its budget.  Call while holding cache_lock.
+void cachetrim() {
+	while(cache_protected_bytes > cache_budget / 100 * CACHE_PROTECTED_PCT) {
+		struct cachedval *demoted = cache_protected->back();
+		cache_protected->pop_back();
+		cache_protected_bytes -= demoted->cost;
+		cache_probation->push_front(demoted);
+		cache_probation_bytes += demoted->cost;
+		demoted->where = cache_probation->begin();
+		demoted->protect = false;
 	}
-	else
-		copy(files->begin(), files->end(), inserter(*files_local, files_local->begin()));
-
-	pthread_mutex_unlock(slaves_lock);
+	while(cache_probation_bytes + cache_protected_bytes > cache_budget)
+		cachedrop(cache_probation->size() ? cache_probation->back() : cache_protected->back());
+}
 
-	for(auto file_corr = files_local->begin(); file_corr != files_local->end(); ++file_corr) {
-		slave_idx dest_slavid = -1;
-		if(actually_replicate) {
-			pthread_mutex_lock(file_corr->second->write_lock);
+// Removes a value from the cache and frees it.  Call while holding cache_lock.
+// Accepts: the cached value
+void cachedrop(struct cachedval *victim) {
+	if(victim->protect) {
+		cache_protected->erase(victim->where);
+		cache_protected_bytes -= victim->cost;
+	} else {
+		cache_probation->erase(victim->where);
+		cache_probation_bytes -= victim->cost;
+	}
+	cache->erase(victim->key);
+	free(victim->key);
+	free(victim->data);
+	delete victim;
+}
 
-			pthread_mutex_lock(slaves_lock);
-			if(slave_failed) {
-				unordered_set<slave_idx> *holders = file_corr->second->holders;
-				dest_slavid = bestslave([holders](slave_idx check){return holders->count(check);});
-			}
-			else
-				dest_slavid = failed_slavid; // Propagate to the new node
+// Promises a client that it'll hear about it if a value changes within the next lease_ms.  Call before looking up the value, so that any write that lands in between revokes the lease.
+// Accepts: the client's connection and the key
+void grantlease(struct clientconn *conn, const char *key) {
+	pthread_mutex_lock(leases_lock);
+	auto found = leases->find(key);
+	if(found == leases->end())
+		found = leases->insert({strdup(key), new unordered_map<struct clientconn *, uint64_t>()}).first;
+	(*found->second)[conn] = nowms() + lease_ms;
+	conn->leased->insert(found->first);
+	pthread_mutex_unlock(leases_lock);
+}
 
-			struct slavinfo *dest_slavif = (*slaves_info)[dest_slavid];
-			pthread_mutex_unlock(slaves_lock);
+// Sends an NVM to every client still holding a lease on a value that's been replaced, then forgets the leases.  Call while holding the file's write_lock, once the slaves have the new value.  Clients that are in the middle of a request get theirs as soon as it's been served, and whatever a client's socket won't take without waiting is sent once it has room (or ahead of its next answer), so that one client that isn't reading can't hold up writers.
+// Accepts: the key
+void revokeleases(const char *key) {
+	if(!lease_ms)
+		return;
 
-			if(!slave_failed && !dest_slavif->alive) {
-				// We're trying to mirror onto a brand new node that just died on us!
-				// Our work here is done: a separate cleanup thread was spawned, so we defer to it.
-				pthread_mutex_unlock(file_corr->second->write_lock);
-				return NULL;
+	pthread_mutex_lock(leases_lock);
+	auto found = leases->find(key);
+	if(found != leases->end()) {
+		uint64_t now = nowms();
+		for(const pair<struct clientconn *const, uint64_t> &holder : *found->second) {
+			holder.first->leased->erase(found->first);
+			if(holder.second < now)
+				continue; // the client has already stopped trusting its copy
+			if(!pthread_mutex_trylock(holder.first->send_lock)) {
+				queuepkt(holder.first->fd, holder.first->unsent, OPC_NVM, key, 0);
+				flushpkts(holder.first->fd, holder.first->unsent, true);
+				bool stuck = holder.first->unsent->size() && holder.first->idle;
+				pthread_mutex_unlock(holder.first->send_lock);
+				if(stuck) {
+					// Have the rest sent once there's room, even if the client never asks for anything else; our leases_lock keeps it from being hung up meanwhile
+					pthread_mutex_lock(flush_lock);
+					flush_clients->insert(holder.first);
+					pthread_mutex_unlock(flush_lock);
+					uint64_t one = 1;
+					if(write(flush_wake, &one, sizeof one)) {}
+				}
+			} else {
+				holder.first->revoked->push_back(strdup(key));
 			}
+		}
+		char *interned = (char *)found->first;
+		delete found->second;
+		leases->erase(found);
+		free(interned);
+	}
+	pthread_mutex_unlock(leases_lock);
+}
 
-			char *value = NULL;
-			size_t vallen;
-			// Our use of the same identifier for both newly-added and failed slaves is threadsafe because the thread that handles the "newly-added" case bails out as soon as it discovers its slave has been lost.
-			if(!getfile(file_corr->first, &value, &vallen, -failed_slavid)) // Use additive inverse of faild slave ID as our unique queue identifier
-				// TODO This is unlikely, but not impossible; figure out what to do?
-				writelog(PRI_DBG, "This project is open source, and just failed to rereplicate one of your pieces of data. If you think you know how to handle this case, why not contribute?");
+// Sends a client the NVMs that piled up while we were serving it, then lets others push them to it directly again
+// Accepts: the client's connection, whose send_lock we hold and release
+void sendrevoked(struct clientconn *conn) {
+	pthread_mutex_lock(leases_lock);
+	while(conn->revoked->size()) {
+		vector<char *> batch;
+		batch.swap(*conn->revoked);
+		pthread_mutex_unlock(leases_lock);
+		for(char *key : batch) {
+			sendpkt(conn->fd, OPC_NVM, key, 0);
+			free(key);
+		}
+		pthread_mutex_lock(leases_lock);
+	}
+	pthread_mutex_unlock(conn->send_lock); // while still holding leases_lock, so no revocation can slip in and be left waiting
+	pthread_mutex_unlock(leases_lock);
+}
 
-			if(!putfile(dest_slavif, file_corr->first, value, vallen, -failed_slavid, true)) // We'll use that same unique ID to mark our place in line
-				// TODO Release the writelock, repeat this run of the for loop?
-				writelog(PRI_DBG, "Failed to put the file during cremation; case not handled!");
+// Forgets every lease held by a client that's hanging up
+// Accepts: the client's connection
+void dropleases(struct clientconn *conn) {
+	pthread_mutex_lock(leases_lock);
+	for(const char *key : *conn->leased) {
+		auto found = leases->find(key);
+		found->second->erase(conn);
+		if(!found->second->size()) {
+			delete found->second;
+			leases->erase(found);
+			free((char *)key);
 		}
+	}
+	conn->leased->clear();
+	for(char *key : *conn->revoked)
+		free(key);
+	conn->revoked->clear();
+	pthread_mutex_unlock(leases_lock);
+}
 
-		pthread_mutex_lock(files_lock);
+// Queues up every file that a slave's failure or arrival affects, for the repair workers to see to, most endangered first
+// Accepts: whether a slave failed (as opposed to joining a degraded system), and which
+void schedulerepairs(bool slave_failed, slave_idx slavid) {
+	bool actually_replicate = true;
+	vector<bool> alive;
+	pthread_mutex_lock(slaves_lock);
+	if(slave_failed && living_count < MIN_STOR_REDUN) actually_replicate = false; // All nodes are already identical, so replicating is pointless
+	for(struct slavinfo *slave : *slaves_info)
+		alive.push_back(slave->alive);
+	pthread_mutex_unlock(slaves_lock);
 
-		struct filinfo *entry = (*files)[file_corr->first];
-		entry->holders->erase(failed_slavid);
-		if(actually_replicate)
-			entry->holders->insert(dest_slavid);
-		else if(!entry->holders->size()) { // No more Mr. Nice Guy (i.e. nobody has this file anymore)
-			writelog(PRI_SRS, "The last keeper of '%s' has been vanquished!", file_corr->first);
-			files->erase(file_corr->first);
-			pthread_mutex_destroy(entry->write_lock);
-			free(entry->write_lock);
-			delete entry->holders;
-			free(entry);
-			free((char *)file_corr->first);
+	vector<pair<size_t, struct repairjob>> jobs;
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard) {
+		pthread_rwlock_rdlock(files[shard].lock);
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end(); ++it) {
+			const struct holderset *holders = &it->second.holders;
+			if(slave_failed && !holdershas(holders, slavid))
+				continue;
+			size_t live = 0;
+			for(uint32_t each = 0; each < holders->count; ++each)
+				if(holdersof(holders)[each] != slavid && alive[holdersof(holders)[each]])
+					++live;
+			struct repairjob job = {it->first, slavid, slave_failed, actually_replicate};
+			jobs.push_back(pair<size_t, struct repairjob>(min(live, MIN_STOR_REDUN), job));
 		}
+		pthread_rwlock_unlock(files[shard].lock);
+	}
+
+	pthread_mutex_lock(repair_lock);
+	if(!repair_queued && !repair_active) {
+		// Start counting progress afresh
+		repair_done = 0;
+		repair_total = 0;
+		repair_bytes = 0;
+		repair_started = nowms();
+	}
+	for(pair<size_t, struct repairjob> &each : jobs)
+		(*repairs)[each.first].push(each.second);
+	repair_queued += jobs.size();
+	repair_total += jobs.size();
+	pthread_cond_broadcast(repair_notify);
+	pthread_mutex_unlock(repair_lock);
+	writelog(PRI_INF, "Queued %lu files for repair after slave %lu %s\n", jobs.size(), slavid, slave_failed ? "died" : "joined");
+}
 
-		pthread_mutex_unlock(files_lock);
+// Brings one file back up to its redundancy after a slave failed (or forgets the slave, if there's nowhere else to copy it), or mirrors it onto a slave joining a degraded system
+// Accepts: what to do
+// Returns: how many bytes of value were copied
+size_t repairfile(const struct repairjob *job) {
+	const char *key = job->key;
+	slave_idx failed_slavid = job->slavid;
+	bool slave_failed = job->failed;
+	pthread_mutex_t *writeprotect_lock = writelock(key);
+	pthread_mutex_lock(writeprotect_lock);
 
-		if(actually_replicate)
-			pthread_mutex_unlock(file_corr->second->write_lock);
+	// Someone may have beaten us to it, or the file may have been wiped, since it was queued
+	struct filinfo *entry = findfile(key);
+	if(!entry || (slave_failed && !holdershas(&entry->holders, failed_slavid))) {
+		pthread_mutex_unlock(writeprotect_lock);
+		return 0;
 	}
 
-	delete files_local;
-	return NULL;
-}
+	slave_idx dest_slavid = -1;
+	bool copied = false;
+	size_t vallen = 0;
+	if(job->replicate) {
+		pthread_mutex_lock(slaves_lock);
+		struct holderset *holders = &entry->holders;
+		bool needed = true;
+		if(slave_failed) {
+			if(rendezvous_placement) {
+				// The next slave in the file's ranking, which is where it would have been placed had the failed one never been there
+				map<slave_idx, slavinfo *> next;
+				rendezvous(key, 1, [holders](slave_idx check){return holdershas(holders, check);}, &next);
+				dest_slavid = next.size() ? next.begin()->first : -1;
+			}
+			else
+				dest_slavid = bestslave([holders](slave_idx check){return holdershas(holders, check);});
 
-void *registration(void *ignored) {
-	int single_source_of_slaves = tcpskt(PORT_MASTER_REGISTER, MAX_MASTER_BACKLOG);
-	while(true) {
-		struct sockaddr_in location;
-		socklen_t loclen = sizeof location;
-		int heartbeat = accept(single_source_of_slaves, (struct sockaddr *)&location, &loclen);
-		if(!recvpkt(heartbeat, OPC_HEY, NULL, NULL, NULL, false)) {
-			sendpkt(heartbeat, OPC_FKU, NULL, 0);
-			continue;
+			// A restarted slave may already have reclaimed its copy
+			unsigned int living = 0;
+			for(slave_idx holder : holderslist(holders))
+				if(holder != failed_slavid && (*slaves_info)[holder]->alive)
+					++living;
+			needed = living < MIN_STOR_REDUN && dest_slavid != (slave_idx)-1;
 		}
-		int control = socket(AF_INET, SOCK_STREAM, 0);
-		usleep(10000); // TODO fix this crap
-		location.sin_port = htons(PORT_SLAVE_MAIN);
-		if(connect(control, (struct sockaddr *)&location, loclen)) {
-			sendpkt(heartbeat, OPC_FKU, NULL, 0);
-			continue;
+		else {
+			dest_slavid = failed_slavid; // Propagate to the new node
+			needed = !holdershas(holders, dest_slavid) && (*slaves_info)[dest_slavid]->alive; // unless it restored its own copy, or has died on us (in which case its own failure will be seen to)
 		}
-		struct slavinfo *rec = (struct slavinfo *)malloc(sizeof(struct slavinfo));
+		struct slavinfo *dest_slavif = needed ? (*slaves_info)[dest_slavid] : NULL;
+		pthread_mutex_unlock(slaves_lock);
 
-		rec->alive = true;
-		rec->waiting_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+		// Have the new holder copy the value from an old one if both are up to it, and otherwise carry it across ourselves
+		struct sockaddr_in source;
+		memset(&source, 0, sizeof source);
+		slave_idx source_slavid = needed && dest_slavif->mux ? pickholder(key) : -1;
+		if(source_slavid != (slave_idx)-1) {
+			pthread_mutex_lock(slaves_lock);
+			source = (*slaves_info)[source_slavid]->reads;
+			pthread_mutex_unlock(slaves_lock);
+		}
+		if(source.sin_port && (copied = copyfile(dest_slavif, &source, key, &vallen))) {
+			writelog(PRI_DBG, "Slave %lu copied '%s' straight from slave %lu\n", dest_slavid, key, source_slavid);
+			needed = false;
+		}
+
+		char *value = NULL;
+		bool packed;
+		if(needed) {
+			if(!getfile(key, &value, &vallen, &packed))
+				// TODO This is unlikely, but not impossible; figure out what to do?
+				writelog(PRI_SRS, "Couldn't read '%s' back from any of its holders to repair it\n", key);
+			else {
+				if(!(copied = putfile(dest_slavif, key, value, vallen, true, packed)))
+					writelog(PRI_SRS, "Couldn't copy '%s' onto slave %lu to repair it\n", key, dest_slavid);
+				free(value);
+			}
+		}
+	}
+
+	struct filshard *shard = shardof(key);
+	pthread_rwlock_wrlock(shard->lock);
+	if(slave_failed && holdersdrop(&entry->holders, failed_slavid))
+		journalholder(JRN_DEL, key, failed_slavid, 0);
+	if(copied) {
+		holdersadd(&entry->holders, dest_slavid);
+		journalholder(JRN_ADD, key, dest_slavid, vallen);
+	}
+	else if(!job->replicate && !entry->holders.count) { // No more Mr. Nice Guy (i.e. nobody has this file anymore)
+		writelog(PRI_SRS, "The last keeper of '%s' has been vanquished!\n", key);
+		holdersfree(&entry->holders);
+		shard->files->erase(key); // its key stays behind in the arena
+	}
+	pthread_rwlock_unlock(shard->lock);
+
+	pthread_mutex_unlock(writeprotect_lock);
+	if(!copied)
+		return 0;
+	repairpace(vallen); // only once we've let go of the file, so its writers needn't wait out our limit too
+	return vallen;
+}
+
+// Holds a repair worker back until the bytes it's just copied fit under the repairs' bandwidth limit
+// Accepts: how many bytes it copied
+void repairpace(size_t bytes) {
+	if(!repair_rate)
+		return;
+	pthread_mutex_lock(repair_lock);
+	uint64_t now = nowms();
+	uint64_t until = (repair_paced > now ? repair_paced : now) + bytes * 1000 / repair_rate;
+	repair_paced = until;
+	pthread_mutex_unlock(repair_lock);
+	if(until > now)
+		sleepus((until - now) * 1000);
+}
+
+// Weighs the living slaves' loads to decide whether files should be moved to even them out, and if so, between which two
+// Accepts: spots for the fullest slave, the emptiest, and how many bytes may move from the one to the other before either passes the mean
+// Returns: whether the loads' standard deviation is more than rebalance_pct percent of their mean, and the fullest slave can be asked to forget what it gives up
+bool imbalance(slave_idx *fullest, slave_idx *emptiest, uint64_t *excess) {
+	long long most = -1;
+	long long least = -1;
+	double sum = 0;
+	double sumsq = 0;
+	pthread_mutex_lock(slaves_lock);
+	size_t living = living_count;
+	for(slave_idx s = 0; s < slaves_info->size(); ++s) {
+		slavinfo *slave = (*slaves_info)[s];
+		if(!slave->alive)
+			continue;
+		long long full = __sync_fetch_and_add(&slave->howfull, 0);
+		sum += full;
+		sumsq += (double)full * full;
+		if(full > most) {
+			most = full;
+			*fullest = s;
+		}
+		if(full < least || least == -1) {
+			least = full;
+			*emptiest = s;
+		}
+	}
+	bool shedding = most >= 0 && (*slaves_info)[*fullest]->mux;
+	pthread_mutex_unlock(slaves_lock);
+
+	// With no more slaves than copies of each file, every slave holds every file
+	if(living <= MIN_STOR_REDUN || !shedding || sum <= 0)
+		return false;
+	double mean = sum / living;
+	double deviation = sqrt(max(sumsq / living - mean * mean, 0.0));
+	*excess = (uint64_t)min(most - mean, mean - least);
+	return deviation * 100 > mean * rebalance_pct && *excess;
+}
+
+// Picks files to move from the fullest slave to the emptiest if their loads have grown uneven, choosing only those that won't tip either past the mean
+// Accepts: where to add each move, up to REBALANCE_BATCH_LEN of them
+void planeven(vector<struct movejob> *batch) {
+	slave_idx from_slavid;
+	slave_idx to_slavid;
+	uint64_t excess;
+	if(!imbalance(&from_slavid, &to_slavid, &excess))
+		return;
+
+	// Lengths are only a guide until each file is moved under its write lock
+	uint64_t planned = 0;
+	for(unsigned int shard = 0; shard < FILES_SHARDS && planned < excess && batch->size() < REBALANCE_BATCH_LEN; ++shard) {
+		pthread_rwlock_rdlock(files[shard].lock);
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end() && planned < excess && batch->size() < REBALANCE_BATCH_LEN; ++it) {
+			const struct filinfo *entry = &it->second;
+			if(entry->len <= excess - planned && holdershas(&entry->holders, from_slavid) && !holdershas(&entry->holders, to_slavid)) {
+				struct movejob job = {it->first, from_slavid, to_slavid};
+				batch->push_back(job);
+				planned += entry->len;
+			}
+		}
+		pthread_rwlock_unlock(files[shard].lock);
+	}
+}
+
+// Picks files held by slaves other than those rendezvous placement now ranks first for them, as happens to the files a joining slave outranks their holders for
+// Accepts: where to add each move, up to REBALANCE_BATCH_LEN of them
+// Returns: whether every file was looked at, rather than stopping once the batch was full
+bool planhome(vector<struct movejob> *batch) {
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard) {
+		pthread_rwlock_rdlock(files[shard].lock);
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end(); ++it) {
+			if(batch->size() >= REBALANCE_BATCH_LEN) {
+				pthread_rwlock_unlock(files[shard].lock);
+				return false;
+			}
+
+			// Pair each holder that doesn't belong with a slave that does but lacks the file
+			const struct holderset *holders = &it->second.holders;
+			map<slave_idx, slavinfo *> home;
+			rendezvous(it->first, MIN_STOR_REDUN, [](slave_idx check){return false;}, &home);
+			auto dest = home.begin();
+			for(slave_idx holder : holderslist(holders)) {
+				if(home.count(holder))
+					continue;
+				while(dest != home.end() && holdershas(holders, dest->first))
+					++dest;
+				if(dest == home.end())
+					break;
+				struct movejob job = {it->first, holder, dest->first};
+				batch->push_back(job);
+				++dest;
+			}
+		}
+		pthread_rwlock_unlock(files[shard].lock);
+	}
+	return true;
+}
+
+// Moves a file from one slave to another, switching its holders only once the new copy is in place, then has the old one forget it
+// Accepts: the key (interned), the slave to move it off of, and the one to move it onto
+// Returns: how many bytes of value were moved
+size_t movefile(const char *key, slave_idx from_slavid, slave_idx to_slavid) {
+	pthread_mutex_t *writeprotect_lock = writelock(key);
+	pthread_mutex_lock(writeprotect_lock);
+
+	// The file may have been wiped, written elsewhere, or repaired since we picked it
+	struct filinfo *entry = findfile(key);
+	bool movable = entry && holdershas(&entry->holders, from_slavid) && !holdershas(&entry->holders, to_slavid);
+	pthread_mutex_lock(slaves_lock);
+	struct slavinfo *from = (*slaves_info)[from_slavid];
+	struct slavinfo *to = (*slaves_info)[to_slavid];
+	movable = movable && from->alive && to->alive;
+	struct sockaddr_in source = from->reads;
+	pthread_mutex_unlock(slaves_lock);
+
+	size_t vallen = 0;
+	bool copied = false;
+	if(movable && to->mux && source.sin_port)
+		copied = copyfile(to, &source, key, &vallen);
+	if(movable && !copied) {
+		char *value = NULL;
+		bool packed;
+		if(getfile(key, &value, &vallen, &packed)) {
+			copied = putfile(to, key, value, vallen, true, packed);
+			free(value);
+		}
+	}
+
+	bool moved = false;
+	if(copied) {
+		struct filshard *shard = shardof(key);
+		pthread_rwlock_wrlock(shard->lock);
+
+		// If the new holder died during the copy, its failure may already have been seen to without this file
+		pthread_mutex_lock(slaves_lock);
+		moved = to->alive;
+		pthread_mutex_unlock(slaves_lock);
+		if(moved) {
+			holdersadd(&entry->holders, to_slavid);
+			journalholder(JRN_ADD, key, to_slavid, vallen);
+			holdersdrop(&entry->holders, from_slavid);
+			journalholder(JRN_DEL, key, from_slavid, 0);
+		}
+		pthread_rwlock_unlock(shard->lock);
+	}
+	if(moved) {
+		__sync_fetch_and_sub(&from->howfull, vallen);
+		if(!dropfile(from, key))
+			writelog(PRI_DBG, "Slave %lu wouldn't forget '%s' after it was moved off of it\n", from_slavid, key);
+	}
+
+	pthread_mutex_unlock(writeprotect_lock);
+	return moved ? vallen : 0;
+}
+
+// Recovers the key directory from a checkpoint and the journal after it, then starts journaling.  Recovered files are held as orphans until the slaves that hold them register again.
+// Accepts: the directory keeping the checkpoint and journal, which is created if need be
+void journalopen(const char *dir) {
+	mkdir(dir, 0755);
+	journal_dir = strdup(dir);
+	journal_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(journal_lock, NULL);
+	orphans = new unordered_map<const char *, struct orphan *>();
+
+	char path[strlen(dir) + 32];
+	sprintf(path, "%s/%s", dir, CHECKPOINT_NAME);
+	size_t records = journalreplay(path, orphans);
+	sprintf(path, "%s/%s", dir, JOURNAL_NAME);
+	records += journalreplay(path, orphans);
+	orphans_left = orphans->size();
+	writelog(PRI_DBG, "Replayed %lu journal records\n", records);
+
+	if((journal_fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0)
+		handle_error("journal open()");
+	journalcheckpoint(); // fold what we just replayed into a fresh checkpoint, dropping any torn record at the journal's end
+}
+
+// Checkpoints the key directory one last time and stops journaling
+void journalclose() {
+	journalcheckpoint();
+	close(journal_fd);
+	journal_fd = -1;
+	for(auto it = orphans->begin(); it != orphans->end(); ++it) {
+		delete it->second->places;
+		free(it->second);
+		free((char *)it->first);
+	}
+	delete orphans;
+	orphans = NULL;
+	pthread_mutex_destroy(journal_lock);
+	free(journal_lock);
+	journal_lock = NULL;
+	free(journal_dir);
+	journal_dir = NULL;
+}
+
+// Notes in the journal that a slave has taken on or given up a file.  Call while holding the file's shard exclusively, right as its holders change.
+// Accepts: JRN_ADD or JRN_DEL, the key, the slave, and the value's length (for JRN_ADDs)
+void journalholder(uint16_t op, const char *key, slave_idx slaveidx, uint64_t len) {
+	if(!journal_dir)
+		return;
+	pthread_mutex_lock(slaves_lock);
+	uint64_t place = placeof(&(*slaves_info)[slaveidx]->reads);
+	pthread_mutex_unlock(slaves_lock);
+
+	pthread_mutex_lock(journal_lock);
+	journal_len += journalappend(journal_fd, op, key, place, len);
+	pthread_mutex_unlock(journal_lock);
+}
+
+// Disowns any copies of a file held by slaves that haven't come back since the master restarted, because it's about to be replaced.  Call while holding the file's shard exclusively.
+// Accepts: the key
+void journalforget(const char *key) {
+	if(!journal_dir || !__sync_fetch_and_add(&orphans_left, 0))
+		return;
+	pthread_mutex_lock(journal_lock);
+	auto found = orphans->find(key);
+	if(found != orphans->end()) {
+		for(uint64_t place : *found->second->places)
+			journal_len += journalappend(journal_fd, JRN_DEL, key, place, 0);
+		const char *orphankey = found->first;
+		delete found->second->places;
+		free(found->second);
+		orphans->erase(found);
+		free((char *)orphankey);
+		--orphans_left;
+	}
+	pthread_mutex_unlock(journal_lock);
+}
+
+// Makes a newly-registered slave a holder of a file, if the journal says it held it before the master restarted
+// Accepts: the slave, the key, and the length of its copy
+// Returns: whether it was adopted
+bool journaladopt(slave_idx slaveidx, const char *key, uint64_t len) {
+	if(!journal_dir || !__sync_fetch_and_add(&orphans_left, 0))
+		return false;
+	pthread_mutex_lock(slaves_lock);
+	uint64_t place = placeof(&(*slaves_info)[slaveidx]->reads);
+	pthread_mutex_unlock(slaves_lock);
+
+	struct filshard *shard = shardof(key);
+	pthread_rwlock_wrlock(shard->lock);
+	pthread_mutex_lock(journal_lock);
+	auto found = orphans->find(key);
+	bool adopted = found != orphans->end() && found->second->places->erase(place);
+	if(adopted) {
+		auto file = shard->files->find(key);
+		struct filinfo *entry = file == shard->files->end() ? addfile(shard, key) : &file->second;
+		entry->len = len;
+		holdersadd(&entry->holders, slaveidx);
+
+		if(found->second->places->empty()) {
+			const char *orphankey = found->first;
+			delete found->second->places;
+			free(found->second);
+			orphans->erase(found);
+			free((char *)orphankey);
+			--orphans_left;
+		}
+	}
+	pthread_mutex_unlock(journal_lock);
+	pthread_rwlock_unlock(shard->lock);
+	return adopted;
+}
+
+// Writes out every file's holders, including the orphans', as a new checkpoint, then empties the journal.  Writers wait for it to finish, but readers needn't.
+void journalcheckpoint() {
+	if(!journal_dir)
+		return;
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard)
+		pthread_rwlock_rdlock(files[shard].lock);
+	vector<uint64_t> places;
+	pthread_mutex_lock(slaves_lock);
+	for(struct slavinfo *slave : *slaves_info)
+		places.push_back(placeof(&slave->reads));
+	pthread_mutex_unlock(slaves_lock);
+	pthread_mutex_lock(journal_lock);
+
+	char path[strlen(journal_dir) + 32];
+	char tmppath[strlen(journal_dir) + 32];
+	sprintf(path, "%s/%s", journal_dir, CHECKPOINT_NAME);
+	sprintf(tmppath, "%s.new", path);
+	int fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd < 0)
+		handle_error("checkpoint open()");
+	size_t records = 0;
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard)
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end(); ++it)
+			for(uint32_t each = 0; each < it->second.holders.count; ++each) {
+				journalappend(fd, JRN_ADD, it->first, places[holdersof(&it->second.holders)[each]], it->second.len);
+				++records;
+			}
+	for(auto it = orphans->begin(); it != orphans->end(); ++it)
+		for(uint64_t place : *it->second->places) {
+			journalappend(fd, JRN_ADD, it->first, place, it->second->len);
+			++records;
+		}
+
+	// The old checkpoint and journal stay valid until the new checkpoint has safely replaced it
+	fdatasync(fd);
+	close(fd);
+	if(rename(tmppath, path))
+		handle_error("checkpoint rename()");
+	if((fd = open(journal_dir, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	if(ftruncate(journal_fd, 0))
+		writelog(PRI_SRS, "Couldn't empty the journal; it will be replayed over the checkpoint\n");
+	journal_len = 0;
+
+	pthread_mutex_unlock(journal_lock);
+	for(unsigned int shard = FILES_SHARDS; shard--; )
+		pthread_rwlock_unlock(files[shard].lock);
+	writelog(PRI_DBG, "Checkpointed %lu holdings\n", records);
+}
+
+// Writes one record to a checkpoint or the journal
+// Accepts: file descriptor, record type, the key, the slave's place, and the value's length
+// Returns: how many bytes were written
+size_t journalappend(int fd, uint16_t op, const char *key, uint64_t place, uint64_t len) {
+	size_t keylen = strlen(key);
+	string rec(sizeof(struct jrnlrec), '\0');
+	struct jrnlrec *hdr = (struct jrnlrec *)&rec[0];
+	hdr->op = op;
+	hdr->keylen = keylen;
+	hdr->place = place;
+	hdr->len = len;
+	hdr->check = keyhash(rec.data(), rec.size()) ^ keyhash(key, keylen);
+	rec.append(key, keylen + 1);
+
+	for(size_t sent = 0; sent < rec.size(); ) {
+		ssize_t wrote = write(fd, rec.data() + sent, rec.size() - sent);
+		if(wrote < 0 && errno == EINTR)
+			continue;
+		if(wrote <= 0) {
+			writelog(PRI_SRS, "Couldn't write to the journal!\n");
+			return sent;
+		}
+		sent += wrote;
+	}
+	return rec.size();
+}
+
+// Applies every intact record in a checkpoint or journal to the files recovered so far, stopping at the first torn or corrupt one
+// Accepts: the file's path, and the recovered files
+// Returns: how many records were applied
+size_t journalreplay(const char *path, unordered_map<const char *, struct orphan *> *into) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	struct stat info;
+	if(fstat(fd, &info) || !info.st_size) {
+		close(fd);
+		return 0;
+	}
+	char *log = (char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(log == MAP_FAILED)
+		return 0;
+	madvise(log, info.st_size, MADV_SEQUENTIAL);
+
+	size_t size = info.st_size;
+	size_t off = 0;
+	size_t records = 0;
+	while(size - off >= sizeof(struct jrnlrec)) {
+		struct jrnlrec hdr;
+		memcpy(&hdr, log + off, sizeof hdr);
+		const char *key = log + off + sizeof hdr;
+		if(size - off - sizeof hdr <= hdr.keylen || key[hdr.keylen])
+			break;
+		uint64_t check = hdr.check;
+		hdr.check = 0;
+		if(check != (keyhash((const char *)&hdr, sizeof hdr) ^ keyhash(key, hdr.keylen)))
+			break;
+
+		auto found = into->find(key);
+		if(hdr.op == JRN_ADD) {
+			if(found == into->end()) {
+				struct orphan *entry = (struct orphan *)malloc(sizeof(struct orphan));
+				entry->places = new unordered_set<uint64_t>();
+				found = into->insert(pair<const char *, struct orphan *>(strdup(key), entry)).first;
+			}
+			found->second->len = hdr.len;
+			found->second->places->insert(hdr.place);
+		} else if(hdr.op == JRN_DEL && found != into->end()) {
+			found->second->places->erase(hdr.place);
+			if(found->second->places->empty()) {
+				const char *orphankey = found->first;
+				delete found->second->places;
+				free(found->second);
+				into->erase(found);
+				free((char *)orphankey);
+			}
+		}
+		off += sizeof hdr + hdr.keylen + 1;
+		++records;
+	}
+
+	munmap(log, size);
+	return records;
+}
+
+// Names a slave in a way that outlasts its index, which is all the journal knows it by
+// Accepts: where it takes direct reads
+// Returns: that address and port packed together (with a port of 0 if it doesn't take them)
+uint64_t placeof(const struct sockaddr_in *reads) {
+	return (uint64_t)ntohl(reads->sin_addr.s_addr) << 16 | ntohs(reads->sin_port);
+}
+
+// Finds the slice of the key directory responsible for a key
+// Accepts: the key
+// Returns: its shard
+static inline struct filshard *shardof(const char *key) {
+	return &files[keyhash(key) % FILES_SHARDS];
+}
+
+// Works out which stripe of keys a key shares its write lock (and its cache epoch) with
+// Accepts: the key
+// Returns: the stripe's index
+static inline unsigned int writestripe(const char *key) {
+	return (keyhash(key) >> 32) % WRITE_STRIPES;
+}
+
+// Finds the write lock a key shares with the others in its stripe
+// Accepts: the key
+// Returns: the lock
+static inline pthread_mutex_t *writelock(const char *key) {
+	return &write_locks[writestripe(key)];
+}
+
+// Looks up a key in the directory, contending only with writers to the same shard
+// Accepts: the key
+// Returns: its entry, or NULL if nobody has the file
+struct filinfo *findfile(const char *key) {
+	struct filshard *shard = shardof(key);
+	pthread_rwlock_rdlock(shard->lock);
+	auto file = shard->files->find(key);
+	struct filinfo *entry = file == shard->files->end() ? NULL : &file->second;
+	pthread_rwlock_unlock(shard->lock);
+	return entry;
+}
+
+// Adds an entry for a file nobody has yet.  Call while holding its shard exclusively.
+// Accepts: the shard, and the key, which is copied
+// Returns: the new entry
+struct filinfo *addfile(struct filshard *shard, const char *key) {
+	struct filinfo *entry = &(*shard->files)[internkey(shard, key)];
+	entry->holders.count = 0;
+	entry->holders.cap = INLINE_HOLDERS;
+	entry->written = 0;
+	entry->len = 0;
+	return entry;
+}
+
+// Copies a key into its shard's arena, so that it needn't take an allocation of its own.  Call while holding the shard exclusively.
+// Accepts: the shard and the key
+// Returns: the copy, which lasts until the master exits
+const char *internkey(struct filshard *shard, const char *key) {
+	size_t len = strlen(key) + 1;
+	if(len > KEY_ARENA_CHUNK / 4) {
+		// Too big to share a chunk, but still freed along with the rest
+		char *copy = (char *)malloc(len);
+		shard->arena->push_back(copy);
+		return (const char *)memcpy(copy, key, len);
+	}
+	if(len > shard->arena_left) {
+		shard->arena_next = (char *)malloc(KEY_ARENA_CHUNK);
+		shard->arena->push_back(shard->arena_next);
+		shard->arena_left = KEY_ARENA_CHUNK;
+	}
+	char *copy = shard->arena_next;
+	memcpy(copy, key, len);
+	shard->arena_next += len;
+	shard->arena_left -= len;
+	return copy;
+}
+
+// Makes a slave a holder of a file
+// Accepts: the holders and the slave
+// Returns: whether it wasn't already one
+bool holdersadd(struct holderset *set, slave_idx slaveidx) {
+	if(holdershas(set, slaveidx))
+		return false;
+	if(set->count == set->cap) {
+		uint32_t *grown = (uint32_t *)malloc(2 * set->cap * sizeof *grown);
+		memcpy(grown, holdersof(set), set->count * sizeof *grown);
+		holdersfree(set);
+		set->spilled = grown;
+		set->cap *= 2;
+	}
+	(set->cap > INLINE_HOLDERS ? set->spilled : set->inlined)[set->count++] = slaveidx;
+	return true;
+}
+
+// Stops a slave being a holder of a file
+// Accepts: the holders and the slave
+// Returns: whether it was one
+bool holdersdrop(struct holderset *set, slave_idx slaveidx) {
+	uint32_t *idxs = set->cap > INLINE_HOLDERS ? set->spilled : set->inlined;
+	for(uint32_t each = 0; each < set->count; ++each)
+		if(idxs[each] == slaveidx) {
+			idxs[each] = idxs[--set->count];
+			return true;
+		}
+	return false;
+}
+
+// Checks whether a slave holds a file
+// Accepts: the holders and the slave
+// Returns: whether it does
+bool holdershas(const struct holderset *set, slave_idx slaveidx) {
+	const uint32_t *idxs = holdersof(set);
+	for(uint32_t each = 0; each < set->count; ++each)
+		if(idxs[each] == slaveidx)
+			return true;
+	return false;
+}
+
+// Copies out the holders of a file, so they can be looked over once its shard has been unlocked
+// Accepts: the holders
+// Returns: their indices
+vector<slave_idx> holderslist(const struct holderset *set) {
+	return vector<slave_idx>(holdersof(set), holdersof(set) + set->count);
+}
+
+// Finds where a file's holders are kept, which depends on whether they've outgrown its entry
+// Accepts: the holders
+// Returns: the first of their indices
+static inline const uint32_t *holdersof(const struct holderset *set) {
+	return set->cap > INLINE_HOLDERS ? set->spilled : set->inlined;
+}
+
+// Gives back any memory the holders took from the heap, leaving them unusable until they're reset
+// Accepts: the holders
+void holdersfree(struct holderset *set) {
+	if(set->cap > INLINE_HOLDERS)
+		free(set->spilled);
+}
+
+// Tells whether a slave still holds a file, which it may not by the time it answers a read, if the file's been moved off of it meanwhile
+// Accepts: a filename string and the slave's index
+// Returns: whether the slave is among the file's holders
+bool stillholds(const char *filename, slave_idx slavid) {
+	struct filshard *shard = shardof(filename);
+	pthread_rwlock_rdlock(shard->lock);
+	auto file = shard->files->find(filename);
+	bool holds = file != shard->files->end() && holdershas(&file->second.holders, slavid);
+	pthread_rwlock_unlock(shard->lock);
+	return holds;
+}
+
+// Picks the holder of a file that it deems to be the best slave, by the power of two choices: of two living holders drawn at random, the one expected to answer soonest given how quickly it's been answering reads and how many requests it has outstanding
+// Accepts: a filename string, and optionally a holder to pass over
+// Returns: the chosen slave's index, or -1 if nobody living (besides the one passed over) has the file
+slave_idx pickholder(const char *filename, slave_idx passover) {
+	struct filshard *shard = shardof(filename);
+	pthread_rwlock_rdlock(shard->lock);
+	auto file = shard->files->find(filename);
+	if(file == shard->files->end()) {
+		pthread_rwlock_unlock(shard->lock);
+		return -1;
+	}
+	vector<slave_idx> containing_slaves = holderslist(&file->second.holders);
+	pthread_rwlock_unlock(shard->lock);
+	if(passover != (slave_idx)-1)
+		containing_slaves.erase(std::remove(containing_slaves.begin(), containing_slaves.end(), passover), containing_slaves.end());
+
+	static __thread unsigned int draws = 0;
+	if(!draws)
+		draws = nowus() ^ (uintptr_t)&draws;
+	size_t count = containing_slaves.size();
+	size_t first = count ? rand_r(&draws) % count : 0;
+	size_t second = count > 1 ? (first + 1 + rand_r(&draws) % (count - 1)) % count : first;
+	bool probe = !(rand_r(&draws) % LATENCY_PROBE_ODDS);
+
+	slave_idx bestslaveidx = -1;
+	uint64_t bestcost = 0;
+	pthread_mutex_lock(slaves_lock);
+	for(size_t pick : {first, second}) {
+		if(pick >= count)
+			break;
+		slavinfo *slave = (*slaves_info)[containing_slaves[pick]];
+		uint64_t cost = readcost(slave);
+		if(slave->alive && ((cost < bestcost) != probe || bestslaveidx == (slave_idx)-1)) {
+			bestslaveidx = containing_slaves[pick];
+			bestcost = cost;
+		}
+	}
+	if(bestslaveidx == (slave_idx)-1) {
+		// Both draws are dead, which is rare enough that we may as well weigh every holder
+		for(slave_idx slaveidx : containing_slaves) {
+			slavinfo *slave = (*slaves_info)[slaveidx];
+			uint64_t cost = readcost(slave);
+			if(slave->alive && (cost < bestcost || bestslaveidx == (slave_idx)-1)) {
+				bestslaveidx = slaveidx;
+				bestcost = cost;
+			}
+		}
+	}
+	pthread_mutex_unlock(slaves_lock);
+	
+	if(bestslaveidx == (slave_idx)-1 && passover == (slave_idx)-1) {
+		// TODO: No slave is alive
+		writelog(PRI_SRS, "No slave is alive from which we may receive file '%s'!\n", filename);
+	}
+	
+	return bestslaveidx;
+}
+
+// Estimates how long a slave would take to start answering a read sent now: about as long as it's been taking, for each request ahead of it and then ours
+// Accepts: the slave
+// Returns: the estimate, in microseconds
+static inline uint64_t readcost(slavinfo *slave) {
+	return (__sync_fetch_and_add(&slave->latency, 0) + 1) * (__sync_fetch_and_add(&slave->load, 0) + 1);
+}
+
+// Folds how long a slave took to start answering a read into its moving average, and into the histogram hedged reads are timed by
+// Accepts: the slave, and the time taken in microseconds
+static void observe(slavinfo *slave, uint64_t took) {
+	uint64_t was;
+	uint64_t now;
+	do {
+		was = slave->latency;
+		now = was ? was - was / LATENCY_EWMA_DIV + took / LATENCY_EWMA_DIV : took;
+	} while(!__sync_bool_compare_and_swap(&slave->latency, was, now));
+
+	__sync_fetch_and_add(read_latencies + latencybucket(took), 1);
+	if(!(__sync_add_and_fetch(&read_timings, 1) % LATENCY_HIST_HALFLIFE)) {
+		// Age out what we saw long ago; a racing increment may slip through, which doesn't matter much
+		for(unsigned int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+			__sync_fetch_and_sub(read_latencies + bucket, read_latencies[bucket] / 2);
+	}
+}
+
+// Finds which of the histogram's buckets a response time falls in: below 4 us each has its own, and above that each power of two is split in four
+// Accepts: the time, in microseconds
+// Returns: the bucket's index
+static inline unsigned int latencybucket(uint64_t us) {
+	if(us < 4)
+		return us;
+	unsigned int lg = 63 - __builtin_clzll(us);
+	return lg * 4 + (us >> (lg - 2) & 3);
+}
+
+// Works out how long a read may go unanswered before it's worth asking another holder as well: as long as it took hedge_pct percent of recent reads to start being answered
+// Accepts: a spot for the delay, in microseconds
+// Returns: whether enough reads have been timed to tell
+bool hedgedelay(uint64_t *delay) {
+	unsigned long counts[LATENCY_BUCKETS];
+	unsigned long total = 0;
+	for(unsigned int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+		total += counts[bucket] = __sync_fetch_and_add(read_latencies + bucket, 0);
+	if(total < HEDGE_MIN_SAMPLES)
+		return false;
+
+	unsigned int bucket = 0;
+	for(unsigned long seen = counts[0]; seen * 100 < total * hedge_pct; seen += counts[++bucket]);
+	*delay = bucket < 4 ? bucket + 1 : (uint64_t)(5 + bucket % 4) << (bucket / 4 - 2); // the bucket's upper bound
+	return true;
+}
+
+// Asks the best holder of a file for it, and if hedging is on and that holder hasn't started sending it by the time hedge_pct percent of reads have (or has said it can't), asks another holder as well and settles on whichever sends it first.  The other's request is retired, so the rest of its answer is dropped on the floor as it arrives.
+// Accepts: a filename string to request, and spots for two slaves, their indices, and their requests
+// Returns: which of the two is answering, whose request must be read from with nextframe() and then passed to endreq(), or -1 if nobody could be asked
+int beginread(const char *filename, slavinfo **slaves, slave_idx *idxs, struct slavereq *reqs) {
+	idxs[0] = pickholder(filename);
+	if(idxs[0] == (slave_idx)-1)
+		return -1;
+
+	pthread_mutex_lock(slaves_lock);
+	slaves[0] = (*slaves_info)[idxs[0]];
+	pthread_mutex_unlock(slaves_lock);
+
+	if(!beginreq(slaves[0], reqs)) {
+		endreq(slaves[0], reqs);
+		return -1;
+	}
+
+	// Only a slave that tags its requests can be walked out on without garbling the answer to its next one
+	uint64_t delay = 0;
+	bool hedging = hedge_pct && slaves[0]->mux && hedgedelay(&delay);
+	struct hedge race;
+	if(hedging) {
+		pthread_mutex_init(&race.lock, NULL);
+		pthread_condattr_t monotonic;
+		pthread_condattr_init(&monotonic);
+		pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC); // the clock nowus() reads
+		pthread_cond_init(&race.notify, &monotonic);
+		pthread_condattr_destroy(&monotonic);
+		race.events = 0;
+		pthread_mutex_lock(slaves[0]->waiting_lock);
+		reqs[0].race = &race;
+		pthread_mutex_unlock(slaves[0]->waiting_lock);
+	}
+
+	pthread_mutex_lock(slaves[0]->send_lock);
+	sendpkt(slaves[0]->ctlfd, OPC_PLZ, filename, 0, reqs[0].tag);
+	pthread_mutex_unlock(slaves[0]->send_lock);
+	if(!hedging)
+		return 0;
+
+	int asked = 1;
+	int winner = awaitrace(&race, slaves, reqs, asked, nowus() + delay);
+	if(winner == -1) {
+		idxs[1] = pickholder(filename, idxs[0]);
+		if(idxs[1] != (slave_idx)-1) {
+			pthread_mutex_lock(slaves_lock);
+			slaves[1] = (*slaves_info)[idxs[1]];
+			pthread_mutex_unlock(slaves_lock);
+
+			if(slaves[1]->mux) {
+				if(beginreq(slaves[1], reqs + 1)) {
+					pthread_mutex_lock(slaves[1]->waiting_lock);
+					reqs[1].race = &race;
+					pthread_mutex_unlock(slaves[1]->waiting_lock);
+					pthread_mutex_lock(slaves[1]->send_lock);
+					sendpkt(slaves[1]->ctlfd, OPC_PLZ, filename, 0, reqs[1].tag);
+					pthread_mutex_unlock(slaves[1]->send_lock);
+					__sync_fetch_and_add(&hedges_sent, 1);
+					writelog(PRI_DBG, "Slave %lu is slow to answer for file '%s', so asking slave %lu too\n", idxs[0], filename, idxs[1]);
+					asked = 2;
+				}
+				else
+					endreq(slaves[1], reqs + 1);
+			}
+		}
+		winner = awaitrace(&race, slaves, reqs, asked, 0);
+	}
+
+	if(asked == 2) {
+		if(winner == 1) {
+			// The first holder's taken at least this long, and that's worth knowing before it's asked again
+			__sync_fetch_and_add(&hedges_won, 1);
+			observe(slaves[0], nowus() - reqs[0].began);
+		}
+		endreq(slaves[1 - winner], reqs + 1 - winner);
+	}
+	pthread_mutex_lock(slaves[winner]->waiting_lock);
+	reqs[winner].race = NULL;
+	pthread_mutex_unlock(slaves[winner]->waiting_lock);
+	pthread_cond_destroy(&race.notify);
+	pthread_mutex_destroy(&race.lock);
+
+	return winner;
+}
+
+// Waits for any of a hedged read's requests to start being answered with the value.  A holder that says FKU instead only wins once every other has failed too.
+// Accepts: the race, the slaves and requests taking part in it, how many of them there are, and a deadline in microseconds (0 for none)
+// Returns: the index of the first to have an HRZ waiting (or failing that, an FKU, or 0 if every connection has died), or -1 if the deadline passed first or, when there's a deadline, every request has failed before it
+static int awaitrace(struct hedge *race, slavinfo *const *slaves, struct slavereq *reqs, int count, uint64_t deadline) {
+	struct timespec until;
+	until.tv_sec = deadline / 1000000;
+	until.tv_nsec = deadline % 1000000 * 1000;
+	while(true) {
+		// Note how many events we've heard of before looking, so that none can slip by between looking and waiting
+		pthread_mutex_lock(&race->lock);
+		unsigned long events = race->events;
+		pthread_mutex_unlock(&race->lock);
+
+		int failed = 0;
+		int refused = -1; // the first to have said FKU
+		for(int i = 0; i < count; ++i) {
+			pthread_mutex_lock(slaves[i]->waiting_lock);
+			bool posted = reqs[i].posted;
+			uint16_t opcode = reqs[i].opcode;
+			bool severed = reqs[i].severed;
+			pthread_mutex_unlock(slaves[i]->waiting_lock);
+			if(posted && opcode == OPC_HRZ)
+				return i;
+			if(posted && refused == -1)
+				refused = i;
+			failed += posted || severed;
+		}
+		if(failed == count) {
+			if(deadline)
+				return -1; // no use waiting to ask another holder
+			return refused == -1 ? 0 : refused;
+		}
+
+		pthread_mutex_lock(&race->lock);
+		bool timedout = false;
+		while(race->events == events && !timedout) {
+			if(deadline)
+				timedout = pthread_cond_timedwait(&race->notify, &race->lock, &until) == ETIMEDOUT;
+			else
+				pthread_cond_wait(&race->notify, &race->lock);
+		}
+		pthread_mutex_unlock(&race->lock);
+		if(timedout)
+			return -1;
+	}
+}
+
+// Tells whoever's waiting on a hedged read that one of its requests has news; the caller must hold the request's slave's waiting_lock
+// Accepts: the race
+static void racenotify(struct hedge *race) {
+	pthread_mutex_lock(&race->lock);
+	++race->events;
+	pthread_cond_broadcast(&race->notify);
+	pthread_mutex_unlock(&race->lock);
+}
+
+// Gets a file from what it deems to be the best slave, hedging if it's slow to answer
+// Accepts: a filename string to request, a pointer to where the data should be stored (left NULL if it couldn't be had, so it's always safe to free), a pointer to the length of the data, and a pointer to whether it's packed
+bool getfile(const char *filename, char **databuf, size_t *dlen, bool *packed) {
+	slavinfo *slaves[2];
+	slave_idx idxs[2];
+	struct slavereq reqs[2];
+	int answering = beginread(filename, slaves, idxs, reqs);
+	if(answering == -1)
+		return false;
+	slavinfo *bestslave = slaves[answering];
+	slave_idx bestslaveidx = idxs[answering];
+	struct slavereq &req = reqs[answering];
+
+	writelog(PRI_INF, "Receiving file '%s' from slave %lu\n", filename, bestslaveidx);
+
+	bool found = false;
+	size_t cap = MAX_PACKET_LEN;
+	*databuf = (char *)malloc(cap);
+	*dlen = 0;
+	*packed = false;
+	uint16_t opcode = 0;
+	uint64_t len;
+	while(nextframe(bestslave, &req, &opcode, &len)) {
+		bool sane;
+		if(opcode == OPC_STF) {
+			if(cap - *dlen <= len) {
+				while(cap - *dlen <= len)
+					cap *= 2;
+				*databuf = (char *)realloc(*databuf, cap);
+			}
+			sane = readall(bestslave->ctlfd, *databuf + *dlen, len);
+			*dlen += len;
+			found = !len;
+		}
+		else {
+			if(opcode == OPC_HRZ)
+				*packed = ispacked(bestslave->ctlfd);
+			sane = skipall(bestslave->ctlfd, len); // the key we asked for, or an FKU
+		}
+		doneframe(bestslave, &req);
+		if(!sane || found || (opcode != OPC_HRZ && opcode != OPC_STF))
+			break;
+	}
+
+	if(found)
+		(*databuf)[*dlen] = '\0';
+	else {
+		free(*databuf);
+		*databuf = NULL;
+	}
+	endreq(bestslave, &req);
+
+	if(opcode == OPC_FKU && !stillholds(filename, bestslaveidx)) {
+		// It was moved off the slave while we were asking, so ask where it lives now
+		writelog(PRI_DBG, "Slave %lu let go of file '%s' while we were reading it, so trying again\n", bestslaveidx, filename);
+		return getfile(filename, databuf, dlen, packed);
+	}
+	return found;
+}
+
+// Streams a file from what it deems to be the best slave straight through to a client, without ever holding the whole value
+// Accepts: a filename string to request, the client's file descriptor, and an empty pipe to splice through
+// Returns: whether the file was found; if so, the HRZ and at least some of the value have already been sent
+bool relayfile(const char *filename, const int clientfd, const int *pipefd) {
+	slavinfo *slaves[2];
+	slave_idx idxs[2];
+	struct slavereq reqs[2];
+	int answering = beginread(filename, slaves, idxs, reqs);
+	if(answering == -1)
+		return false;
+	slavinfo *bestslave = slaves[answering];
+	slave_idx bestslaveidx = idxs[answering];
+	struct slavereq &req = reqs[answering];
+
+	bool started = false;
+	bool finished = false;
+	uint16_t opcode = 0;
+	uint64_t len;
+	while(nextframe(bestslave, &req, &opcode, &len)) {
+		bool sane;
+		if(opcode == OPC_HRZ) {
+			const char *receivedfilename;
+			bool packed = ispacked(bestslave->ctlfd); // before the view, which looking at the buffer would invalidate
+			if((sane = viewall(bestslave->ctlfd, len, &receivedfilename))) {
+				writelog(PRI_INF, "Relaying file '%s' from slave %lu\n", receivedfilename, bestslaveidx);
+				sendpkt(clientfd, OPC_HRZ, receivedfilename, 0, 0, packed);
+				started = true;
+			}
+		}
+		else if(opcode == OPC_STF) {
+			sane = hashhash::relayframe(bestslave->ctlfd, clientfd, pipefd, len);
+			finished = !len;
+		}
+		else
+			sane = skipall(bestslave->ctlfd, len); // an FKU
+		doneframe(bestslave, &req);
+		if(!sane || finished || (opcode != OPC_HRZ && opcode != OPC_STF))
+			break;
+	}
+	endreq(bestslave, &req);
+
+	if(started && !finished)
+		writelog(PRI_SRS, "Relay of file '%s' from slave %lu broke off partway!\n", filename, bestslaveidx);
+	if(opcode == OPC_FKU && !stillholds(filename, bestslaveidx)) {
+		// It was moved off the slave while we were asking, so ask where it lives now
+		writelog(PRI_DBG, "Slave %lu let go of file '%s' while we were relaying it, so trying again\n", bestslaveidx, filename);
+		return relayfile(filename, clientfd, pipefd);
+	}
+	
+	return started;
+}
+
+// Serves a client's MGT by asking each holder for every key it's best placed to serve in a single batch, then passing the answers along as they're read back.  Each key is answered exactly once, with either an HRZ and STFs or an FKU naming it, and the lot is followed by a THX.  Clients too old to unpack values have every key served on its own instead, so that packed ones can be unpacked for them.
+// Accepts: the client's file descriptor, its keys (each null-terminated), their total length, and an empty pipe to splice through (or -1s to copy instead)
+void getbatch(const int clientfd, const char *keys, size_t klen, const int *pipefd) {
+	map<slave_idx, struct batchpart *> parts; // in index order, like every other multi-slave operation
+	vector<const char *> singles; // held by slaves that can't take batches
+	bool unpacks = getproto(clientfd) >= PROTO_V4;
+	for(const char *key = keys; key < keys + klen; key += strlen(key) + 1) {
+		char *filedata;
+		size_t dlen;
+		bool packed;
+		unsigned long epoch;
+		if(cacheget(key, &filedata, &dlen, &packed, &epoch)) {
+			sendfile(clientfd, key, filedata, dlen, 0, packed);
+			free(filedata);
+			continue;
+		}
+
+		slave_idx idx = pickholder(key);
+		if(idx == (slave_idx)-1) {
+			sendpkt(clientfd, OPC_FKU, key, 0);
+			continue;
+		}
+		
+		pthread_mutex_lock(slaves_lock);
+		slavinfo *slave = (*slaves_info)[idx];
+		pthread_mutex_unlock(slaves_lock);
+		if(!slave->mux || !unpacks) {
+			singles.push_back(key);
+			continue;
+		}
+		
+		if(!parts.count(idx)) {
+			parts[idx] = new struct batchpart;
+			parts[idx]->slave = slave;
+		}
+		parts[idx]->keys.push_back(key);
+	}
+
+	// Send every batch before reading any answers, so the slaves all work at once
+	for(pair<slave_idx, struct batchpart *> entry : parts) {
+		struct batchpart *part = entry.second;
+		if(!beginreq(part->slave, &part->req))
+			continue;
+		vector<char> packed;
+		for(const char *key : part->keys)
+			packed.insert(packed.end(), key, key + strlen(key) + 1);
+		pthread_mutex_lock(part->slave->send_lock);
+		sendpkt(part->slave->ctlfd, OPC_MGT, packed.data(), packed.size(), part->req.tag);
+		pthread_mutex_unlock(part->slave->send_lock);
+		writelog(PRI_DBG, "Asked slave %lu for %lu keys\n", entry.first, part->keys.size());
+	}
+
+	bool intact = true; // whether the client's stream is still well-formed
+	for(pair<slave_idx, struct batchpart *> entry : parts) {
+		struct batchpart *part = entry.second;
+		size_t answered = 0;
+		bool midvalue = false;
+		uint16_t opcode;
+		uint64_t len;
+		while(intact && nextframe(part->slave, &part->req, &opcode, &len)) {
+			bool sane;
+			if(opcode == OPC_FKU && answered < part->keys.size() && !stillholds(part->keys[answered], entry.first)) {
+				// It was moved off the slave while we were asking (its answers come in the order asked), so ask where it lives now
+				writelog(PRI_DBG, "Slave %lu let go of file '%s' while we were batching it, so trying again\n", entry.first, part->keys[answered]);
+				sane = skipall(part->slave->ctlfd, len);
+				singles.push_back(part->keys[answered++]);
+			}
+			else if(opcode == OPC_HRZ || opcode == OPC_FKU) {
+				const char *key;
+				bool packed = ispacked(part->slave->ctlfd); // before the view, which looking at the buffer would invalidate
+				if((sane = viewall(part->slave->ctlfd, len, &key)))
+					sendpkt(clientfd, opcode, key, 0, 0, packed);
+				if(opcode == OPC_HRZ)
+					midvalue = true;
+				else
+					++answered;
+			}
+			else if(opcode == OPC_STF) {
+				sane = forwardframe(part->slave->ctlfd, clientfd, pipefd, len);
+				if(!len) {
+					midvalue = false;
+					++answered;
+				}
+			}
+			else
+				sane = skipall(part->slave->ctlfd, len) && opcode != OPC_THX; // a THX means it's through
+			doneframe(part->slave, &part->req);
+			if(!sane)
+				break;
+		}
+		endreq(part->slave, &part->req);
+
+		if(midvalue) {
+			// There's no way to take back the part of the value the client already has
+			writelog(PRI_SRS, "Batch from slave %lu broke off partway through a value!\n", entry.first);
+			intact = false;
+		}
+		if(intact)
+			for(size_t unanswered = answered; unanswered < part->keys.size(); ++unanswered)
+				sendpkt(clientfd, OPC_FKU, part->keys[unanswered], 0);
+		delete part;
+	}
+
+	// Only once we've let go of every batch's slot, as these take slots of their own on slaves in no particular order
+	if(intact)
+		for(const char *key : singles)
+			if(!servefile(clientfd, key, pipefd))
+				sendpkt(clientfd, OPC_FKU, key, 0);
+
+	if(intact)
+		sendpkt(clientfd, OPC_THX, NULL, 0);
+	else
+		shutdown(clientfd, SHUT_RDWR); // so the client knows better than to trust what it got
+}
+
+// Stores a client's MPT by choosing homes for all its keys in a single pass over the tables, then sending each chosen slave its whole share in one frame.  A key that appears more than once takes its last value.  If we're packing batches, values that shrink are packed once here and sent that way to every slave that takes them so.
+// Accepts: the packed pairs and their total length
+void putbatch(const char *pairs, size_t plen) {
+	unordered_map<const char *, pair<const char *, uint64_t>> values;
+	vector<const char *> keys; // in the order they first appeared
+	size_t off = 0;
+	const char *key;
+	const char *val;
+	uint64_t vlen;
+	while(nextpair(pairs, plen, &off, &key, &val, &vlen)) {
+		if(!values.count(key))
+			keys.push_back(key);
+		values[key] = pair<const char *, uint64_t>(val, vlen);
+	}
+	if(off != plen)
+		writelog(PRI_SRS, "Ignoring %lu bytes of malformed pairs at the end of an MPT\n", plen - off);
+
+	unordered_map<const char *, pair<char *, size_t>> squeezed;
+	if(pack_batches)
+		for(const char *each : keys) {
+			char *packed;
+			size_t packedlen;
+			if(packval(values[each].first, values[each].second, &packed, &packedlen))
+				squeezed[each] = pair<char *, size_t>(packed, packedlen);
+		}
+	auto takespacked = [&squeezed](const char *each, slavinfo *slave) {
+		return slave->mux && getproto(slave->ctlfd) >= PROTO_V4 && squeezed.count(each);
+	};
+	auto heldlen = [&](const char *each, slavinfo *slave) {
+		return takespacked(each, slave) ? squeezed[each].second : values[each].second;
+	};
+
+	// Place every key while holding the tables just once, the same way a lone HRZ would be placed
+	map<slave_idx, vector<const char *>> shares; // in index order, like every other multi-slave operation
+	map<slave_idx, slavinfo *> targets;
+	unordered_set<const char *> brandnew; // keys that no slave had before
+	set<pthread_mutex_t *> writeprotect_locks; // in address order, so concurrent batches can't deadlock on each other
+	set<struct filshard *> shards; // in index order, for the same reason
+	unordered_map<const char *, struct filinfo *> entries;
+	for(const char *each : keys)
+		shards.insert(shardof(each));
+	for(struct filshard *shard : shards)
+		pthread_rwlock_wrlock(shard->lock);
+	pthread_mutex_lock(slaves_lock);
+	for(const char *each : keys) {
+		map<slave_idx, slavinfo *> slavestorecv;
+		struct filshard *shard = shardof(each);
+		auto found = shard->files->find(each);
+		if(found != shard->files->end()) {
+			for(slave_idx slaveidx : holderslist(&found->second.holders))
+				slavestorecv[slaveidx] = (*slaves_info)[slaveidx];
+			entries[each] = &found->second;
+		} else if(rendezvous_placement) {
+			rendezvous(each, MIN_STOR_REDUN, [](slave_idx check){return false;}, &slavestorecv);
+			entries[each] = addfile(shard, each);
+			brandnew.insert(each);
+		} else {
+			unsigned int numtoget = min(living_count, MIN_STOR_REDUN);
+			for(unsigned int i = 0; i < numtoget; ++i) {
+				slave_idx bestslaveidx = bestslave([&slavestorecv](slave_idx check){return slavestorecv.count(check);});
+				slavestorecv[bestslaveidx] = (*slaves_info)[bestslaveidx];
+			}
+
+			entries[each] = addfile(shard, each);
+			brandnew.insert(each);
+		}
+		journalforget(each);
+		writeprotect_locks.insert(writelock(each));
+
+		for(pair<slave_idx, slavinfo *> entry : slavestorecv) {
+			shares[entry.first].push_back(each);
+			targets[entry.first] = entry.second;
+		}
+	}
+	pthread_mutex_unlock(slaves_lock);
+	for(struct filshard *shard : shards)
+		pthread_rwlock_unlock(shard->lock);
+	writelog(PRI_INF, "Placed %lu keys on %lu slaves\n", keys.size(), shares.size());
+
+	for(pthread_mutex_t *writeprotect_lock : writeprotect_locks)
+		pthread_mutex_lock(writeprotect_lock);
+
+	// Send every slave that can take a batch its share before waiting on any of them, so they all store at once.  Slots are claimed in index order, so older slaves must be dealt with in turn too, rather than after we've claimed slots further along.
+	size_t numtargets = shares.size();
+	struct slavereq *reqs = (struct slavereq *)malloc(numtargets * sizeof(struct slavereq));
+	bool *healthy = (bool *)malloc(numtargets * sizeof(bool));
+	map<slave_idx, vector<const char *>> legacystored; // by slaves that only know how to take pairs one at a time
+	size_t target = 0;
+	for(pair<slave_idx, vector<const char *>> share : shares) {
+		slavinfo *slave = targets[share.first];
+		if(!slave->mux) {
+			for(const char *each : share.second)
+				if(putfile(slave, each, values[each].first, values[each].second, brandnew.count(each), false))
+					legacystored[share.first].push_back(each);
+		}
+		else if((healthy[target] = beginreq(slave, &reqs[target]))) {
+			string packed;
+			for(const char *each : share.second)
+				if(takespacked(each, slave))
+					packpair(&packed, each, squeezed[each].first, squeezed[each].second, true);
+				else
+					packpair(&packed, each, values[each].first, values[each].second);
+			pthread_mutex_lock(slave->send_lock);
+			healthy[target] = sendpkt(slave->ctlfd, OPC_MPT, packed.data(), packed.size(), reqs[target].tag);
+			pthread_mutex_unlock(slave->send_lock);
+		}
+		++target;
+	}
+
+	target = 0;
+	for(pair<slave_idx, vector<const char *>> share : shares) {
+		slave_idx slaveidx = share.first;
+		slavinfo *slave = targets[slaveidx];
+		vector<const char *> stored;
+		if(slave->mux) {
+			if(healthy[target])
+				healthy[target] = awaitack(slave, &reqs[target]);
+			endreq(slave, &reqs[target]);
+			if(healthy[target]) {
+				long long added = 0;
+				for(const char *each : share.second)
+					if(brandnew.count(each))
+						added += heldlen(each, slave);
+				__sync_fetch_and_add(&slave->howfull, added);
+				stored = share.second;
+			}
+		} else {
+			stored = legacystored[slaveidx];
+		}
+		++target;
+
+		for(const char *each : stored) {
+			struct filshard *shard = shardof(each);
+			pthread_rwlock_wrlock(shard->lock);
+			holdersadd(&entries[each]->holders, slaveidx);
+			journalholder(JRN_ADD, each, slaveidx, heldlen(each, slave));
+			pthread_rwlock_unlock(shard->lock);
+			entries[each]->len = heldlen(each, slave);
+		}
+		writelog(stored.size() < share.second.size() ? PRI_SRS : PRI_DBG, "Stored %lu of %lu keys on slave %lu\n", stored.size(), share.second.size(), slaveidx);
+	}
+	free(healthy);
+	free(reqs);
+	for(pair<const char *, pair<char *, size_t>> each : squeezed)
+		free(each.second.first);
+
+	for(const char *each : keys)
+		entries[each]->written = __sync_add_and_fetch(&write_clock, 1);
+	for(const char *each : keys) {
+		cacheforget(each);
+		revokeleases(each);
+	}
+	for(pthread_mutex_t *writeprotect_lock : writeprotect_locks)
+		pthread_mutex_unlock(writeprotect_lock);
+}
+
+// Lists where a client may read a file straight from a slave, favoring those expected to answer soonest
+// Accepts: the key, and a spot to append each location to (address, then port, both in network byte order), best first
+// Returns: whether any living holder takes direct reads
+bool locate(const char *key, string *where) {
+	struct filshard *shard = shardof(key);
+	pthread_rwlock_rdlock(shard->lock);
+	auto file = shard->files->find(key);
+	if(file == shard->files->end()) {
+		pthread_rwlock_unlock(shard->lock);
+		return false;
+	}
+	vector<slave_idx> holders = holderslist(&file->second.holders);
+	pthread_rwlock_unlock(shard->lock);
+
+	vector<pair<uint64_t, const struct sockaddr_in *>> ranked;
+	pthread_mutex_lock(slaves_lock);
+	for(slave_idx slaveidx : holders) {
+		slavinfo *slave = (*slaves_info)[slaveidx];
+		if(!slave->alive || !slave->reads.sin_port)
+			continue;
+		ranked.push_back({readcost(slave), &slave->reads});
+	}
+	pthread_mutex_unlock(slaves_lock);
+
+	stable_sort(ranked.begin(), ranked.end(), [](const pair<uint64_t, const struct sockaddr_in *> &l, const pair<uint64_t, const struct sockaddr_in *> &r) {
+		return l.first < r.first;
+	});
+	for(const pair<uint64_t, const struct sockaddr_in *> &each : ranked) {
+		where->append((const char *)&each.second->sin_addr.s_addr, sizeof each.second->sin_addr.s_addr);
+		where->append((const char *)&each.second->sin_port, sizeof each.second->sin_port);
+	}
+	return ranked.size();
+}
+
+// Takes back the pairs a restarted slave restored from disk, for every key that hasn't been replaced since the slave was found dead (or, after the master itself restarted, that the journal says it held), so that they needn't be copied to it all over again.  The rest it keeps, but we'll never read them.
+// Accepts: the index under which the slave has just registered
+void reclaim(slave_idx slaveidx) {
+	// Recognize the slave's former self by where it takes direct reads
+	pthread_mutex_lock(slaves_lock);
+	slavinfo *slave = (*slaves_info)[slaveidx];
+	slave_idx formeridx = -1;
+	for(slave_idx idx = 0; idx < slaveidx; ++idx) {
+		slavinfo *each = (*slaves_info)[idx];
+		if(!each->alive && each->reads.sin_port && each->reads.sin_port == slave->reads.sin_port && each->reads.sin_addr.s_addr == slave->reads.sin_addr.s_addr)
+			formeridx = idx;
+	}
+	unsigned long diedat = formeridx == (slave_idx)-1 ? 0 : (*slaves_info)[formeridx]->diedat;
+	pthread_mutex_unlock(slaves_lock);
+	bool orphaned = journal_dir && __sync_fetch_and_add(&orphans_left, 0);
+	if(formeridx == (slave_idx)-1 && !orphaned) {
+		writelog(PRI_INF, "Slave %lu isn't one we've lost, so its restored pairs are of no use\n", slaveidx);
+		return;
+	}
+
+	struct slavereq req;
+	char *inventory = NULL;
+	uint64_t len = 0;
+	if(beginreq(slave, &req)) {
+		pthread_mutex_lock(slave->send_lock);
+		sendpkt(slave->ctlfd, OPC_WUT, NULL, 0, req.tag);
+		pthread_mutex_unlock(slave->send_lock);
+
+		uint16_t opcode;
+		if(nextframe(slave, &req, &opcode, &len)) {
+			inventory = (char *)malloc(len + 1);
+			if(opcode != OPC_WUT || !readall(slave->ctlfd, inventory, len)) {
+				free(inventory);
+				inventory = NULL;
+			}
+			doneframe(slave, &req);
+		}
+	}
+	endreq(slave, &req);
+	if(!inventory)
+		return;
+	inventory[len] = '\0';
+
+	size_t reclaimed = 0;
+	size_t adopted = 0;
+	for(size_t off = 0; off < len; ) {
+		const char *key = inventory + off;
+		size_t keylen = strnlen(key, len - off);
+		uint64_t vlen;
+		if(len - off - keylen < 1 + sizeof vlen)
+			break;
+		memcpy(&vlen, key + keylen + 1, sizeof vlen);
+		off += keylen + 1 + sizeof vlen;
+
+		if(journaladopt(slaveidx, key, vlen)) {
+			__sync_fetch_and_add(&slave->howfull, vlen);
+			++adopted;
+			continue;
+		}
+
+		struct filinfo *entry = formeridx == (slave_idx)-1 ? NULL : findfile(key);
+		if(!entry)
+			continue;
+
+		pthread_mutex_lock(writelock(key));
+		if(entry->written <= diedat) {
+			struct filshard *shard = shardof(key);
+			pthread_rwlock_wrlock(shard->lock);
+			bool fresh = holdersadd(&entry->holders, slaveidx);
+			if(fresh)
+				journalholder(JRN_ADD, key, slaveidx, vlen);
+			pthread_rwlock_unlock(shard->lock);
+			if(fresh) {
+				__sync_fetch_and_add(&slave->howfull, vlen);
+				++reclaimed;
+			}
+		}
+		pthread_mutex_unlock(writelock(key));
+	}
+	free(inventory);
+	if(formeridx != (slave_idx)-1)
+		writelog(PRI_INF, "Slave %lu is back as slave %lu, and reclaimed %lu of its pairs\n", formeridx, slaveidx, reclaimed);
+	if(orphaned)
+		writelog(PRI_INF, "Slave %lu still holds %lu of the files recovered from the journal\n", slaveidx, adopted);
+}
+
+// Passes a single frame's payload from a slave along to a client, splicing it if we have a pipe to do so or copying it otherwise.  Like relayframe(), it reads the whole frame from the slave even if the client breaks, and shuts the slave's connection down if it can't.
+// Accepts: the slave's file descriptor, the client's file descriptor, an empty pipe (or -1s), and the payload's length
+// Returns: whether the whole frame made it across
+bool forwardframe(int srcfd, int dstfd, const int *pipefd, uint64_t len) {
+	if(pipefd[0] >= 0)
+		return hashhash::relayframe(srcfd, dstfd, pipefd, len);
+
+	char *chunk = (char *)malloc(len);
+	if(!chunk || !readall(srcfd, chunk, len)) {
+		if(chunk || !skipall(srcfd, len))
+			shutdown(srcfd, SHUT_RDWR); // we've lost our place in its stream, so let the demultiplexer find out
+		free(chunk);
+		return false;
+	}
+	bool sane = sendpkt(dstfd, OPC_STF, chunk, len);
+	free(chunk);
+	return sane;
+}
+
+// Stores a whole file on a single slave
+// Accepts: the slave, a filename string, the value, its length, whether the slave didn't have this file already, and whether the value is packed
+// Returns: whether the slave now has it
+bool putfile(slavinfo *slave, const char *filename, const char *filedata, const size_t dlen, bool newfile, bool packed) {
+	struct slavereq req;
+	bool succeeded = beginreq(slave, &req);
+	
+	if(succeeded) {
+		// Send the file to the slave; this is the moment we've all been waiting for!
+		pthread_mutex_lock(slave->send_lock);
+		succeeded = sendfile(slave->ctlfd, filename, filedata, dlen, req.tag, packed);
+		pthread_mutex_unlock(slave->send_lock);
+		if(succeeded && slave->mux)
+			succeeded = awaitack(slave, &req);
+	}
+	if(succeeded && newfile) // It's a Brand New File (for this slave, that is)
+		__sync_fetch_and_add(&slave->howfull, dlen);
+	
+	endreq(slave, &req);
+	
+	return succeeded;
+}
+
+// Has a slave that tags its requests copy a file straight from another slave's direct read port, so that the value never passes through us
+// Accepts: the slave to copy onto, where to copy from, a filename string, and a spot for the value's length
+// Returns: whether the slave now has it
+bool copyfile(slavinfo *slave, const struct sockaddr_in *from, const char *filename, size_t *dlen) {
+	string order((const char *)&from->sin_addr.s_addr, sizeof from->sin_addr.s_addr);
+	order.append((const char *)&from->sin_port, sizeof from->sin_port);
+	order.append(filename, strlen(filename) + 1);
+
+	struct slavereq req;
+	bool succeeded = false;
+	if(beginreq(slave, &req)) {
+		pthread_mutex_lock(slave->send_lock);
+		bool sent = sendpkt(slave->ctlfd, OPC_CPY, order.data(), order.size(), req.tag);
+		pthread_mutex_unlock(slave->send_lock);
+
+		// The slave gives up on its own before this, but a copy that's wedged mustn't hold the file's write lock forever
+		uint16_t opcode;
+		uint64_t len;
+		bool answered = sent && nextframe(slave, &req, &opcode, &len, nowus() + 2000ULL * COPY_TIMEOUT);
+		if(sent && !answered) {
+			pthread_mutex_lock(slave->waiting_lock);
+			bool timedout = !req.severed;
+			pthread_mutex_unlock(slave->waiting_lock);
+			if(timedout)
+				writelog(PRI_SRS, "Gave up on a slave that took too long to copy '%s'\n", filename);
+		}
+		if(answered) {
+			// The slave lists what it managed to copy, which is either our one file or nothing
+			char *copied = (char *)malloc(len + 1);
+			bool sane = readall(slave->ctlfd, copied, len);
+			doneframe(slave, &req);
+			uint64_t vlen;
+			size_t keylen = strlen(filename) + 1;
+			if(sane && opcode == OPC_CPY && len == keylen + sizeof vlen && !memcmp(copied, filename, keylen)) {
+				memcpy(&vlen, copied + keylen, sizeof vlen);
+				*dlen = vlen;
+				succeeded = true;
+			}
+			free(copied);
+		}
+	}
+	if(succeeded) // Only ever used to copy onto slaves that lacked the file
+		__sync_fetch_and_add(&slave->howfull, *dlen);
+
+	endreq(slave, &req);
+
+	return succeeded;
+}
+
+// Has a slave that tags its requests forget a file that it no longer holds for us
+// Accepts: the slave, a filename string
+// Returns: whether it acknowledged doing so
+bool dropfile(slavinfo *slave, const char *filename) {
+	struct slavereq req;
+	bool succeeded = slave->mux && beginreq(slave, &req);
+	if(succeeded) {
+		pthread_mutex_lock(slave->send_lock);
+		succeeded = sendpkt(slave->ctlfd, OPC_NIX, filename, strlen(filename) + 1, req.tag);
+		pthread_mutex_unlock(slave->send_lock);
+		succeeded = succeeded && awaitack(slave, &req);
+	}
+	if(slave->mux)
+		endreq(slave, &req);
+
+	return succeeded;
+}
+
+// Claims one of a slave's request slots, waiting in line if they're all taken, then registers the request so that frames bearing its tag are handed to it.  A slave that tags requests has many slots, while one that doesn't has only one.  Every request must eventually be passed to endreq(), even if this fails.
+// Accepts: the slave, and the request to set up
+// Returns: whether the slave's control connection is still usable
+bool beginreq(slavinfo *slave, struct slavereq *req) {
+	pthread_condattr_t monotonic;
+	pthread_condattr_init(&monotonic);
+	pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC); // the clock nowus() reads, for nextframe()'s deadlines
+	pthread_cond_init(&req->notify, &monotonic);
+	pthread_condattr_destroy(&monotonic);
+	req->posted = false;
+	req->answered = false;
+	__sync_fetch_and_add(&slave->load, 1);
+
+	pthread_mutex_lock(slave->waiting_lock);
+	if(slave->inflight < (slave->mux ? MAX_SLAVE_INFLIGHT : 1) && !slave->waiting_clients->size()) {
+		++slave->inflight;
+	} else {
+		// Wait our turn; whoever frees a slot hands it straight to the head of the line
+		struct slotwaiter me;
+		pthread_cond_init(&me.notify, NULL);
+		me.granted = false;
+		slave->waiting_clients->push(&me);
+		while(!me.granted)
+			pthread_cond_wait(&me.notify, slave->waiting_lock);
+		pthread_cond_destroy(&me.notify);
+	}
+
+	req->tag = 0;
+	if(slave->mux) {
+		do
+			++slave->lasttag;
+		while(!slave->lasttag || slave->pending->count(slave->lasttag));
+		req->tag = slave->lasttag;
+	}
+	req->severed = slave->severed;
+	req->race = NULL;
+	req->began = nowus();
+	(*slave->pending)[req->tag] = req;
+	pthread_mutex_unlock(slave->waiting_lock);
+
+	return !req->severed;
+}
+
+// Waits for the slave to send the next frame of a request's response, which must then be read from ctlfd and passed to doneframe()
+// Accepts: the slave, the request, spots for the frame's opcode and payload length, and optionally a deadline in microseconds by nowus(), past which we stop waiting
+// Returns: whether a frame arrived, as opposed to the connection dying or the deadline passing
+bool nextframe(slavinfo *slave, struct slavereq *req, uint16_t *opcode, uint64_t *len, uint64_t deadline) {
+	struct timespec until;
+	until.tv_sec = deadline / 1000000;
+	until.tv_nsec = deadline % 1000000 * 1000;
+	pthread_mutex_lock(slave->waiting_lock);
+	bool timedout = false;
+	while(!req->posted && !req->severed && !timedout) {
+		if(deadline)
+			timedout = pthread_cond_timedwait(&req->notify, slave->waiting_lock, &until) == ETIMEDOUT;
+		else
+			pthread_cond_wait(&req->notify, slave->waiting_lock);
+	}
+	bool posted = req->posted;
+	bool first = posted && !req->answered;
+	req->answered = req->answered || posted;
+	*opcode = req->opcode;
+	*len = req->len;
+	pthread_mutex_unlock(slave->waiting_lock);
+
+	// Only the answers to reads say how quickly the slave serves them, as the rest wait on a whole value being sent first
+	if(first && *opcode & (OPC_HRZ|OPC_FKU))
+		observe(slave, nowus() - req->began);
+	return posted;
+}
+
+// Hands ctlfd back to the slave's demultiplexer once a frame from nextframe() has been read in its entirety
+// Accepts: the slave, the request
+void doneframe(slavinfo *slave, struct slavereq *req) {
+	pthread_mutex_lock(slave->waiting_lock);
+	req->posted = false;
+	slave->handedoff = false;
+	pthread_cond_signal(slave->handback_notify);
+	pthread_mutex_unlock(slave->waiting_lock);
+}
+
+// Waits for a slave that tags its requests to confirm that it has stored a value
+// Accepts: the slave, the write request
+// Returns: whether it did so
+bool awaitack(slavinfo *slave, struct slavereq *req) {
+	uint16_t opcode;
+	uint64_t len;
+	if(!nextframe(slave, req, &opcode, &len))
+		return false;
+	bool sane = skipall(slave->ctlfd, len);
+	doneframe(slave, req);
+	return sane && opcode == OPC_THX;
+}
+
+// Retires a request, handing its slot to the next one in line
+// Accepts: the slave, the request
+void endreq(slavinfo *slave, struct slavereq *req) {
+	pthread_mutex_lock(slave->waiting_lock);
+	while(req->posted) {
+		// We're walking out on a frame, so dispose of it so the demultiplexer can carry on
+		pthread_mutex_unlock(slave->waiting_lock);
+		skipall(slave->ctlfd, req->len);
+		pthread_mutex_lock(slave->waiting_lock);
+		req->posted = false;
+		slave->handedoff = false;
+		pthread_cond_signal(slave->handback_notify);
+	}
+	slave->pending->erase(req->tag);
+	if(slave->waiting_clients->size()) {
+		struct slotwaiter *next = slave->waiting_clients->front();
+		slave->waiting_clients->pop();
+		next->granted = true;
+		pthread_cond_signal(&next->notify);
+	} else {
+		--slave->inflight;
+	}
+	pthread_mutex_unlock(slave->waiting_lock);
+	__sync_fetch_and_sub(&slave->load, 1);
+
+	pthread_cond_destroy(&req->notify);
+}
+
+// Sends the same packet to several slaves at once on behalf of their respective requests, holding each one's send lock throughout
+// Accepts: the slaves (in index order, so that concurrent writers lock them consistently), their requests, how many there are, opcode, string data (in case packet needs it), its length, the per-slave health flags fanout() maintains, and whether a HRZ's value will follow packed
+// Returns: how many slaves are still healthy
+size_t fanslaves(slavinfo *const *slaves, const struct slavereq *reqs, size_t count, uint16_t opcode, const char *data, size_t dlen, bool *healthy, bool packed) {
+	vector<int> fds;
+	vector<uint32_t> tags;
+	for(size_t i = 0; i < count; ++i) {
+		fds.push_back(slaves[i]->ctlfd);
+		tags.push_back(reqs[i].tag);
+		pthread_mutex_lock(slaves[i]->send_lock);
+	}
+
+	size_t survivors = fanout(fds.data(), count, tags.data(), opcode, data, dlen, healthy, packed);
+
+	for(size_t i = count; i > 0; --i)
+		pthread_mutex_unlock(slaves[i-1]->send_lock);
+	return survivors;
+}
+
+// Reads the header of each frame a slave sends and hands the rest of it to the request it's for, waiting until that request has read it before moving on
+void *demultiplex(void *s) {
+	slavinfo *slave = (slavinfo *)s;
+	uint16_t opcode;
+	uint64_t len;
+	uint32_t tag;
+	while(recvhdr(slave->ctlfd, &opcode, &len, &tag)) {
+		pthread_mutex_lock(slave->waiting_lock);
+		struct slavereq *req = slave->pending->count(tag) ? (*slave->pending)[tag] : NULL;
+		pthread_cleanup_push(unlockmutex, slave->waiting_lock); // we're cancelled at shutdown while waiting, which reacquires the lock
+		if(req) {
+			req->opcode = opcode;
+			req->len = len;
+			req->posted = true;
+			slave->handedoff = true;
+			pthread_cond_signal(&req->notify);
+			if(req->race)
+				racenotify(req->race);
+			while(slave->handedoff) // req may well be gone once this is clear, so don't touch it again
+				pthread_cond_wait(slave->handback_notify, slave->waiting_lock);
+		}
+		pthread_cleanup_pop(false);
+		pthread_mutex_unlock(slave->waiting_lock);
+
+		if(!req && !skipall(slave->ctlfd, len)) // nobody's expecting this, so drop it on the floor
+			break;
+	}
+
+	// The connection died, so nobody will be getting a response
+	pthread_mutex_lock(slave->waiting_lock);
+	slave->severed = true;
+	for(pair<uint32_t, struct slavereq *> each : *slave->pending) {
+		each.second->severed = true;
+		pthread_cond_signal(&each.second->notify);
+		if(each.second->race)
+			racenotify(each.second->race);
+	}
+	pthread_mutex_unlock(slave->waiting_lock);
+
+	return NULL;
+}
+
+// Waits for repairs, and carries them out one file at a time, most endangered first
+void *repairer(void *ignored) {
+	while(true) {
+		pthread_mutex_lock(repair_lock);
+		pthread_cleanup_push(unlockmutex, repair_lock); // we're cancelled at shutdown while waiting, which reacquires the lock
+		while(!repair_queued)
+			pthread_cond_wait(repair_notify, repair_lock);
+		pthread_cleanup_pop(false);
+		auto queue = repairs->begin();
+		while(queue->empty())
+			++queue;
+		struct repairjob job = queue->front();
+		queue->pop();
+		--repair_queued;
+		++repair_active;
+		pthread_mutex_unlock(repair_lock);
+
+		// A repair holds the file's locks throughout, so shutdown has to wait for it
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		size_t copied = repairfile(&job);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		pthread_mutex_lock(repair_lock);
+		--repair_active;
+		++repair_done;
+		repair_bytes += copied;
+		pthread_mutex_unlock(repair_lock);
+	}
+
+	return NULL;
+}
+
+// Moves files from the fullest slave to the emptiest whenever their loads have grown uneven (or, under rendezvous placement, to wherever they now belong), so that slaves that joined after the data was written take their share of it.  Repairs go first, so it stands aside while there are any.
+void *rebalancer(void *ignored) {
+	unsigned long settled = 0; // candidates_gen as of when every file was last found where rendezvous placement puts it
+	while(true) {
+		sleep(1);
+		pthread_mutex_lock(repair_lock);
+		bool repairing = repair_queued || repair_active;
+		pthread_mutex_unlock(repair_lock);
+		if(repairing)
+			continue;
+
+		vector<struct movejob> batch;
+		if(rendezvous_placement) {
+			// Files only stray from where they belong when a slave joins or dies, so there's no need to look again until then
+			pthread_rwlock_rdlock(candidates_lock);
+			unsigned long gen = candidates_gen;
+			pthread_rwlock_unlock(candidates_lock);
+			if(gen == settled)
+				continue;
+			if(planhome(&batch))
+				settled = gen;
+		}
+		else
+			planeven(&batch);
+
+		size_t moved = 0;
+		uint64_t bytes = 0;
+		for(const struct movejob &job : batch) {
+			// A move holds the file's locks throughout, so shutdown has to wait for it
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			size_t len = movefile(job.key, job.from, job.to);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			if(!len)
+				continue;
+			++moved;
+			bytes += len;
+			if(rebalance_rate)
+				sleepus(len * 1000000 / rebalance_rate);
+		}
+		if(moved)
+			writelog(PRI_INF, "Moved %lu files (%lu bytes) %s\n", moved, bytes, rendezvous_placement ? "to where rendezvous placement puts them" : "to even out the slaves' loads");
+	}
+
+	return NULL;
+}
+
+void *registration(void *ignored) {
+	int single_source_of_slaves = tcpskt(PORT_MASTER_REGISTER, MAX_MASTER_BACKLOG);
+	while(true) {
+		struct sockaddr_in location;
+		socklen_t loclen = sizeof location;
+		int heartbeat = accept(single_source_of_slaves, (struct sockaddr *)&location, &loclen);
+		setproto(heartbeat, PROTO_V1); // heartbeats are so small that they're never upgraded
+		uint8_t version;
+		in_port_t readport;
+		uint64_t restored;
+		uint32_t weight;
+		if(!recvhey(heartbeat, &version, &readport, &restored, &weight)) {
+			sendpkt(heartbeat, OPC_FKU, NULL, 0);
+			continue;
+		}
+		skipall(heartbeat, buffered(heartbeat)); // the keepalive thread reads beats straight off the socket, so drop any we read ahead
+		int control = socket(AF_INET, SOCK_STREAM, 0);
+		usleep(10000); // TODO fix this crap
+		location.sin_port = htons(PORT_SLAVE_MAIN);
+		if(connect(control, (struct sockaddr *)&location, loclen)) {
+			sendpkt(heartbeat, OPC_FKU, NULL, 0);
+			continue;
+		}
+		setproto(control, PROTO_V1);
+		version = min(version, PROTO_LATEST);
+		if(version >= PROTO_V2) {
+			// Only newer slaves know to expect this, so older ones just keep waiting for their first request
+			sendhey(control, version);
+			setproto(control, version);
+		}
+		struct slavinfo *rec = (struct slavinfo *)malloc(sizeof(struct slavinfo));
+
+		rec->alive = true;
+		rec->mux = getproto(control) >= PROTO_V3;
+		rec->waiting_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
 		pthread_mutex_init(rec->waiting_lock, NULL);
-		rec->waiting_notify = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
-		pthread_cond_init(rec->waiting_notify, NULL);
-		rec->waiting_clients = new queue<int>();
+		rec->waiting_clients = new queue<struct slotwaiter *>();
+		rec->inflight = 0;
+		rec->severed = false;
+		rec->lasttag = 0;
+		rec->pending = new unordered_map<uint32_t, struct slavereq *>();
+		rec->send_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+		pthread_mutex_init(rec->send_lock, NULL);
+		rec->handedoff = false;
+		rec->handback_notify = (pthread_cond_t *)malloc(sizeof(pthread_cond_t));
+		pthread_cond_init(rec->handback_notify, NULL);
 		rec->supfd = heartbeat;
+		rec->beatgap = SLAVE_KEEPALIVE_TIME;
+		rec->beatvar = 0;
 		rec->ctlfd = control;
+		rec->reads = location;
+		rec->reads.sin_port = htons(readport);
 		rec->howfull = 0;
+		rec->diedat = 0;
+		rec->weight = weight ? weight : 1;
+		rec->latency = 0;
+		rec->load = 0;
+		pthread_create(&rec->demux, NULL, &demultiplex, rec);
 
 		usleep(SLAVE_KEEPALIVE_TIME); // Give the client's heart a moment to start beating.
 
@@ -580,20 +3261,27 @@ void *registration(void *ignored) {
 
 		pthread_mutex_lock(slaves_lock);
 
+		rec->lastbeat = nowus();
 		slaves_info->push_back(rec);
+		slave_idx newidx = slaves_info->size()-1;
+		struct epoll_event ev;
+		ev.events = EPOLLIN|EPOLLRDHUP;
+		ev.data.u64 = newidx;
+		epoll_ctl(heartbeats_epoll, EPOLL_CTL_ADD, heartbeat, &ev);
 		if(living_count && living_count < MIN_STOR_REDUN) // Slaves are up, but system is degraded
-			replicate = slaves_info->size()-1;
+			replicate = newidx;
 		++living_count;
+		candidatesync();
 
 		pthread_mutex_unlock(slaves_lock);
 
-		if(replicate) {
-			pthread_t distribute;
-			bool *flags = (bool *)malloc(sizeof(bool)+sizeof(slave_idx));
-			*flags = false; // No slave failed
-			*(slave_idx *)(flags+1) = replicate; // Replicate everything onto me
-			pthread_create(&distribute, NULL, &rereplicate, flags);
+		if(restored && rec->mux) {
+			writelog(PRI_INF, "Slave %lu restored %lu pairs from disk\n", newidx, restored);
+			reclaim(newidx); // before replicating, so that whatever it already has needn't be sent again
 		}
+
+		if(replicate)
+			schedulerepairs(false, replicate); // Replicate everything onto me
 		
 		writelog(PRI_INF, "Registered a slave: %s!\n", inet_ntoa(location.sin_addr));
 	}
@@ -601,69 +3289,248 @@ void *registration(void *ignored) {
 	return NULL;
 }
 
+// Watches every living slave's heartbeat, and declares dead any that hangs up or falls quiet for longer than the accrual failure detector will stand.  Only the slaves whose heartbeats arrive, and those whose deadlines pass, are looked at on each wakeup.
 void *keepalive(void *ignored) {
-	slave_idx threadsize = 0;
-	vector<int> slavefds;
-	// slaves_lock is a pthread_mutex_t* that exists by slaves_info
-	
+	int ticker = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK); // the clock nowus() reads
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (slave_idx)-1; // the timer is the only one without a slave
+	if(epoll_ctl(heartbeats_epoll, EPOLL_CTL_ADD, ticker, &ev))
+		handle_error("epoll_ctl()");
+
+	set<pair<uint64_t, slave_idx>> deadlines; // of the slaves being watched, soonest first
+	vector<uint64_t> deadline; // each slave's entry in deadlines, or 0 once it's dead
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	while(true) {
 		pthread_mutex_lock(slaves_lock);
-		threadsize = slaves_info->size();
+		for(slave_idx idx = deadline.size(); idx < slaves_info->size(); ++idx) {
+			deadline.push_back(deadlineof((*slaves_info)[idx]));
+			deadlines.insert(pair<uint64_t, slave_idx>(deadline[idx], idx));
+		}
 		pthread_mutex_unlock(slaves_lock);
-		
-		if(threadsize > slavefds.size()) {
+
+		// Sleep until the next deadline, but never for longer than a heartbeat, lest a newly registered slave go unwatched for long
+		uint64_t wake = nowus() + SLAVE_KEEPALIVE_TIME;
+		if(deadlines.size())
+			wake = min(wake, deadlines.begin()->first);
+		struct itimerspec when;
+		memset(&when, 0, sizeof when);
+		when.it_value.tv_sec = wake / 1000000;
+		when.it_value.tv_nsec = wake % 1000000 * 1000;
+		timerfd_settime(ticker, TFD_TIMER_ABSTIME, &when, NULL);
+
+		int numevents = epoll_wait(heartbeats_epoll, events, MAX_EPOLL_EVENTS, -1);
+		uint64_t now = nowus();
+		for(int i = 0; i < numevents; ++i) {
+			slave_idx idx = events[i].data.u64;
+			if(idx == (slave_idx)-1) {
+				uint64_t expirations;
+				while(read(ticker, &expirations, sizeof expirations) > 0);
+				continue;
+			}
+			if(idx >= deadline.size() || !deadline[idx])
+				continue; // registered since we last looked, so it'll be watched on the next go around
+
 			pthread_mutex_lock(slaves_lock);
-			for(auto i = slavefds.size(); i < threadsize; ++i) {
-				slavinfo *slave = (*slaves_info)[i];
-				slavefds.push_back(slave->supfd);
+			slavinfo *slave = (*slaves_info)[idx];
+			pthread_mutex_unlock(slaves_lock);
+
+			// Nothing but SUPs is ever sent over a heartbeat connection, so all that matters is that something arrived
+			char beats[64];
+			ssize_t got;
+			bool beat = false;
+			while((got = recv(slave->supfd, beats, sizeof beats, MSG_DONTWAIT)) > 0)
+				beat = true;
+			deadlines.erase(pair<uint64_t, slave_idx>(deadline[idx], idx));
+			if(!got || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+				writelog(PRI_INF, "Slave %lu hung up its heartbeat connection!\n", idx);
+				deadline[idx] = 0;
+				condemn(idx);
+				continue;
 			}
+			if(beat)
+				heard(slave, now);
+			deadline[idx] = deadlineof(slave);
+			deadlines.insert(pair<uint64_t, slave_idx>(deadline[idx], idx));
+		}
+
+		while(deadlines.size() && deadlines.begin()->first <= now) {
+			slave_idx idx = deadlines.begin()->second;
+			deadlines.erase(deadlines.begin());
+			deadline[idx] = 0;
+
+			pthread_mutex_lock(slaves_lock);
+			slavinfo *slave = (*slaves_info)[idx];
 			pthread_mutex_unlock(slaves_lock);
+			writelog(PRI_INF, "Slave %lu is dead! (no heartbeat for %.0f ms, suspicion phi %.1f)\n", idx, (now - slave->lastbeat) / 1000.0, suspicion(slave, now));
+			condemn(idx);
 		}
-		
-		for(slave_idx i = 0; i < slavefds.size(); ++i) {
-			if(slavefds[i]) { // Only ping the slave if it's alive.
-				bool failure = true;
-				while(recvpkt(slavefds[i], OPC_SUP, NULL, NULL, NULL, true)) {
-					failure = false;
-				}
-				if(failure) {
-					writelog(PRI_INF, "Slave %lu is dead!\n", i);
-					slavefds[i] = 0; // Let 0 be a sentinel that means, "He's dead, Jim."
-
-					pthread_mutex_lock(slaves_lock);
-					(*slaves_info)[i]->alive = false;
-					--living_count;
-					pthread_mutex_unlock(slaves_lock);
-
-					pthread_t cleaner;
-					bool *flags = (bool *)malloc(sizeof(bool)+sizeof(slave_idx));
-					*flags = true; // a slave failed
-					*(slave_idx *)(flags+1) = i; // which slave failed
-					pthread_create(&cleaner, NULL, &rereplicate, flags);
-				}
-				else {
-					// printf("beat\n");
-				}
-			}
+	}
+
+	return NULL;
+}
+
+// Folds the arrival of a slave's heartbeat into its moving averages
+// Accepts: the slave, and when the heartbeat arrived in microseconds
+static void heard(slavinfo *slave, uint64_t now) {
+	int64_t stray = (int64_t)(now - slave->lastbeat) - (int64_t)slave->beatgap;
+	__sync_lock_test_and_set(&slave->beatgap, slave->beatgap + stray / (int64_t)HEARTBEAT_EWMA_DIV);
+	__sync_lock_test_and_set(&slave->beatvar, slave->beatvar - slave->beatvar / HEARTBEAT_EWMA_DIV + (uint64_t)(stray * stray) / HEARTBEAT_EWMA_DIV);
+	__sync_lock_test_and_set(&slave->lastbeat, now);
+}
+
+// Works out how suspicious a slave's silence is, as the accrual failure detector's phi: were it alive, the odds of its heartbeat still being on its way now would be one in 10 to this power
+// Accepts: the slave, and the time in microseconds
+// Returns: the suspicion level
+static double suspicion(slavinfo *slave, uint64_t now) {
+	double late = (double)(now - __sync_fetch_and_add(&slave->lastbeat, 0)) - __sync_fetch_and_add(&slave->beatgap, 0);
+	double odds = erfc(late / (beatdev(slave) * M_SQRT2)) / 2;
+	return odds > 0 ? -log10(odds) : INFINITY;
+}
+
+// Estimates how much the gaps between a slave's heartbeats vary
+// Accepts: the slave
+// Returns: their standard deviation, in microseconds
+static inline uint64_t beatdev(slavinfo *slave) {
+	return max((uint64_t)sqrt(__sync_fetch_and_add(&slave->beatvar, 0)), HEARTBEAT_MIN_DEV);
+}
+
+// Works out when a slave's suspicion will reach suspicion_phi, unless it's heard from first
+// Accepts: the slave
+// Returns: the time, in microseconds
+static inline uint64_t deadlineof(slavinfo *slave) {
+	return __sync_fetch_and_add(&slave->lastbeat, 0) + __sync_fetch_and_add(&slave->beatgap, 0) + (uint64_t)(suspicion_devs * beatdev(slave));
+}
+
+// Finds how many standard deviations late a heartbeat must be to raise its slave's suspicion to a given level
+// Accepts: the level of suspicion, as phi
+// Returns: the number of standard deviations
+static double devsfor(double phi) {
+	double low = 0;
+	double high = 40; // well past where erfc() runs out of precision
+	for(int step = 0; step < 64; ++step) {
+		double mid = (low + high) / 2;
+		if(erfc(mid / M_SQRT2) / 2 > pow(10, -phi))
+			low = mid;
+		else
+			high = mid;
+	}
+	return high;
+}
+
+// Declares a slave dead, stops watching its heartbeat, and schedules the repair of its files
+// Accepts: the slave's index
+static void condemn(slave_idx idx) {
+	pthread_mutex_lock(slaves_lock);
+	slavinfo *slave = (*slaves_info)[idx];
+	epoll_ctl(heartbeats_epoll, EPOLL_CTL_DEL, slave->supfd, NULL);
+	slave->alive = false;
+	slave->diedat = __sync_fetch_and_add(&write_clock, 0);
+	--living_count;
+	candidatesync();
+	pthread_mutex_unlock(slaves_lock);
+
+	schedulerepairs(true, idx);
+}
+
+// Checkpoints the key directory whenever the journal has grown long, or has gone a while without a checkpoint
+void *checkpointer(void *ignored) {
+	time_t last = time(NULL);
+	while(true) {
+		sleep(1);
+		pthread_mutex_lock(journal_lock);
+		bool due = journal_len >= CHECKPOINT_JOURNAL_LEN || (journal_len && time(NULL) - last >= CHECKPOINT_SECS);
+		pthread_mutex_unlock(journal_lock);
+		if(due) {
+			// Don't let quitting catch us holding every shard
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			journalcheckpoint();
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			last = time(NULL);
 		}
-		
-		usleep(2 * SLAVE_KEEPALIVE_TIME);
 	}
-	
+
 	return NULL;
 }
 
-void *clientregistration(void *clientqueue) {
+// Accepts clients and watches all of their connections at once, handing each one to a worker whenever a request starts to arrive
+void *clientregistration(void *ignored) {
 	int single_source_of_clients = tcpskt(PORT_MASTER_CLIENTS, MAX_MASTER_BACKLOG);
-	queue<pthread_t *> connected_clients = *(queue<pthread_t *> *)clientqueue;
+	fcntl(single_source_of_clients, F_SETFL, O_NONBLOCK);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // the listener is the only one without a connection record
+	if(epoll_ctl(clients_epoll, EPOLL_CTL_ADD, single_source_of_clients, &ev))
+		handle_error("epoll_ctl()");
+	ev.data.ptr = &flush_wake;
+	if(epoll_ctl(clients_epoll, EPOLL_CTL_ADD, flush_wake, &ev))
+		handle_error("epoll_ctl()");
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	while(true) {
-		int *particular_client = (int *)malloc(sizeof(int));
-		*particular_client = accept(single_source_of_clients, NULL, NULL);
-		if(*particular_client >= 0) {
-			pthread_t *particular_thread = (pthread_t *)malloc(sizeof(pthread_t));
-			memset(particular_thread, 0, sizeof(pthread_t));
-			pthread_create(particular_thread, NULL, &each_client, particular_client);
-			connected_clients.push(particular_thread);
+		int numevents = epoll_wait(clients_epoll, events, MAX_EPOLL_EVENTS, -1);
+		bool flush = false;
+		for(int i = 0; i < numevents; ++i) {
+			if(events[i].data.ptr == &flush_wake) {
+				uint64_t count;
+				if(read(flush_wake, &count, sizeof count)) {}
+				flush = true; // but only once we're through this batch, after which no client that's still idle can have a wakeup we've yet to see
+				continue;
+			}
+
+			struct clientconn *conn = (struct clientconn *)events[i].data.ptr;
+			if(conn) {
+				pthread_mutex_lock(conn->send_lock);
+				conn->idle = false; // it's no longer watched, and flush_clients mustn't have it rearmed behind the worker's back
+				pthread_mutex_unlock(conn->send_lock);
+				pthread_mutex_lock(ready_lock);
+				ready_clients->push(conn);
+				pthread_mutex_unlock(ready_lock);
+				pthread_cond_signal(ready_notify);
+				continue;
+			}
+
+			int particular_client;
+			while((particular_client = accept(single_source_of_clients, NULL, NULL)) >= 0) {
+				setproto(particular_client, PROTO_V1); // until the client tells us otherwise
+				struct timeval stall = {CLIENT_STALL_SECS, 0};
+				setsockopt(particular_client, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof stall); // requests are read without waiting, but the values that follow HRZs aren't
+				conn = (struct clientconn *)malloc(sizeof(struct clientconn));
+				memset(conn, 0, sizeof(struct clientconn));
+				conn->fd = particular_client;
+				conn->send_lock = (pthread_mutex_t *)malloc(sizeof(pthread_mutex_t));
+				pthread_mutex_init(conn->send_lock, NULL);
+				conn->leased = new unordered_set<const char *>();
+				conn->revoked = new vector<char *>();
+				conn->unsent = new string();
+				conn->idle = true;
+
+				// One-shot, so that only one worker at a time ever touches a connection
+				ev.events = EPOLLIN|EPOLLRDHUP|EPOLLONESHOT;
+				ev.data.ptr = conn;
+				if(epoll_ctl(clients_epoll, EPOLL_CTL_ADD, particular_client, &ev)) {
+					close(particular_client);
+					pthread_mutex_destroy(conn->send_lock);
+					free(conn->send_lock);
+					delete conn->leased;
+					delete conn->revoked;
+					delete conn->unsent;
+					free(conn);
+				}
+			}
+		}
+
+		if(flush) {
+			pthread_mutex_lock(flush_lock);
+			for(struct clientconn *conn : *flush_clients) {
+				pthread_mutex_lock(conn->send_lock);
+				if(conn->idle && conn->unsent->size())
+					rearm(conn); // a worker will finish the job once there's room
+				pthread_mutex_unlock(conn->send_lock);
+			}
+			flush_clients->clear();
+			pthread_mutex_unlock(flush_lock);
 		}
 	}
 	
@@ -685,25 +3552,48 @@ void print_slaves() {
 			socklen_t peeraddrlen = sizeof(peeraddr);
 			getpeername(slaves[i]->ctlfd, (sockaddr *)&peeraddr, &peeraddrlen);
 			
+			pthread_mutex_lock(slaves[i]->waiting_lock);
+			unsigned int inflight = slaves[i]->inflight;
+			size_t queued = slaves[i]->waiting_clients->size();
+			pthread_mutex_unlock(slaves[i]->waiting_lock);
+			
 			printf("Slave #%lu: %s\n\tCurrently storing: %lld bytes\n", i, inet_ntoa(peeraddr.sin_addr), slaves[i]->howfull);
+			printf("\tRequests in flight: %u of %u (%lu more queued)\n", inflight, slaves[i]->mux ? MAX_SLAVE_INFLIGHT : 1, queued);
+			printf("\tHeart beats every %.0f ms (give or take %.0f ms); suspicion phi %.2f of %.1f\n", slaves[i]->beatgap / 1000.0, beatdev(slaves[i]) / 1000.0, suspicion(slaves[i], nowus()), suspicion_phi);
+			printf("\tStarts answering reads in: %.3f ms on average (%.3f ms expected for the next one)\n", slaves[i]->latency / 1000.0, readcost(slaves[i]) / 1000.0);
+			if(slaves[i]->reads.sin_port)
+				printf("\tTaking direct reads on port %u\n", ntohs(slaves[i]->reads.sin_port));
+			if(rendezvous_placement)
+				printf("\tPlacement weight: %u\n", slaves[i]->weight);
 		}
 	}
+
+	if(hedge_pct) {
+		uint64_t delay;
+		if(hedgedelay(&delay))
+			printf("Hedging reads unanswered after %.3f ms", delay / 1000.0);
+		else
+			printf("Hedging reads once more have been timed");
+		printf(" (%lu hedged so far, %lu answered first by the second holder)\n", hedges_sent, hedges_won);
+	}
 }
 
 void print_files() {
-	unordered_map<const char *, filinfo *> localfiles;
+	unordered_map<const char *, vector<slave_idx>> localfiles;
 	
-	pthread_mutex_lock(files_lock);
-	for(auto it = files->begin(); it != files->end(); ++it) {
-		localfiles[it->first] = it->second;
+	for(unsigned int shard = 0; shard < FILES_SHARDS; ++shard) {
+		pthread_rwlock_rdlock(files[shard].lock);
+		for(auto it = files[shard].files->begin(); it != files[shard].files->end(); ++it) {
+			localfiles[it->first] = holderslist(&it->second.holders);
+		}
+		pthread_rwlock_unlock(files[shard].lock);
 	}
-	pthread_mutex_unlock(files_lock);
 	
 	for(auto it = localfiles.begin(); it != localfiles.end(); ++it) {
 		writelog(PRI_INF, "Key '%s' is stored on the following slaves: ", it->first);
 		
 		const char *sep = "";
-		unordered_set<slave_idx> localholders = *(it->second->holders);
+		vector<slave_idx> &localholders = it->second;
 		for(slave_idx idx : localholders) {
 			printf("%s%lu", sep, idx);
 			sep = ", ";
@@ -713,14 +3603,69 @@ void print_files() {
 	}
 }
 
+void print_cache() {
+	if(!cache_budget) {
+		printf("The cache is disabled (see -c)\n");
+		return;
+	}
+
+	pthread_mutex_lock(cache_lock);
+	unsigned long hits = cache_hits;
+	unsigned long misses = cache_misses;
+	size_t entries = cache->size();
+	size_t probation = cache_probation_bytes;
+	size_t protect = cache_protected_bytes;
+	pthread_mutex_unlock(cache_lock);
+
+	printf("Cache: %lu of %lu bytes used by %lu values (%lu protected, %lu on probation)\n", probation + protect, cache_budget, entries, protect, probation);
+	printf("\tHits: %lu\n\tMisses: %lu\n", hits, misses);
+	if(hits + misses)
+		printf("\tHit rate: %.1f%%\n", 100.0 * hits / (hits + misses));
+}
+
+void print_repairs() {
+	pthread_mutex_lock(repair_lock);
+	vector<size_t> waiting;
+	for(const queue<struct repairjob> &each : *repairs)
+		waiting.push_back(each.size());
+	size_t queued = repair_queued;
+	size_t active = repair_active;
+	size_t done = repair_done;
+	size_t total = repair_total;
+	uint64_t bytes = repair_bytes;
+	uint64_t elapsed = nowms() - repair_started;
+	pthread_mutex_unlock(repair_lock);
+
+	if(!total) {
+		printf("No files have needed repair\n");
+		return;
+	}
+	printf("Repairs: %lu of %lu files done (%lu bytes copied), %lu in progress, %lu waiting\n", done, total, bytes, active, queued);
+	for(size_t live = 0; live < waiting.size(); ++live)
+		if(waiting[live])
+			printf("\t%lu waiting with %lu other living copies%s\n", waiting[live], live, live < MIN_STOR_REDUN ? "" : " or more");
+	if(done && queued + active)
+		printf("\tETA: %lu s at %.1f files/s\n", (unsigned long)(elapsed * (queued + active) / done / 1000), 1000.0 * done / (elapsed ? elapsed : 1));
+	if(repair_rate)
+		printf("\tCopying at most %lu bytes/s\n", repair_rate);
+}
+
 void print_help() {
 	printf("Commands may be abbreviated.  Commands are:\n\n");
 	printf("%s\t\tview slave info\n", CMD_SLV);
 	printf("%s\t\tview file info\n", CMD_FIL);
+	printf("%s\t\tview cache statistics\n", CMD_CCH);
+	printf("%s\t\tview re-replication progress\n", CMD_RPR);
 	printf("%s\t\tshut down #hashtable master server\n", CMD_GFO);
 	printf("%s\t\tprint help information\n", CMD_HLP);
 }
 
+// Releases a mutex on behalf of a thread that's been cancelled while holding it
+// Accepts: the mutex
+void unlockmutex(void *lock) {
+	pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
 void writelog(int pri, const char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
@@ -15,40 +15,123 @@
  */
 
 #include "common.h"
+#include "stor.h"
 #include <cstring>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 using namespace hashhash;
+using std::string;
 using std::unordered_map;
+using std::vector;
 
+// A value that's still being put together, or that's been copied out of the store
 struct cabbage {
 	size_t len;
 	char *junk;
+	bool packed; // whether junk is as packval() left it
 };
 
+struct upload {
+	char *key;
+	struct cabbage *head;
+	size_t cap; // bytes allocated for head->junk
+};
+
+// A CPY being pulled from another slave on its own thread, whose values are stored by the control connection's thread once it's through
+struct copyjob {
+	uint32_t tag; // of the master's CPY
+	char *order; // the CPY's payload
+	size_t len;
+	uint64_t deadline; // in ms, after which the master may have given up on us
+	int donefd; // where to post ourselves once we're through
+	vector<char *> *keys; // each one we got, alongside its value in vals
+	vector<struct cabbage> *vals;
+};
+
+static const int MAX_READER_BACKLOG = 64;
+static const time_t PEER_STALL_SECS = 10; // longest we'll wait on another slave to send or take anything during a CPY
+
 static int master_fd;
-static unordered_map<const char *, struct cabbage *> *stor = NULL;
+static pthread_rwlock_t *stor_lock = NULL;
+static struct stortable *stor = NULL; // acquire stor_lock for writing before changing; the control connection's thread is the only writer, so it may read without it
+static struct storlog *journal = NULL; // NULL unless we're keeping our pairs on disk; only the control connection's thread may touch it
 
 static void *heartbeat(void *);
+static void *readers(void *);
+static void *each_reader(void *);
+static void serve_tagged(int);
+static void *each_copy(void *);
+static void finishcopies(int, int);
+static int peerconn(const char *);
 
 int main(int argc, char **argv) {
-	if(argc < 2) {
-		printf("USAGE: %s <hostname> [port]\n", argv[0]);
+	int opt;
+	bool huge = false;
+	const char *journaldir = NULL;
+	uint32_t weight = 1;
+	while((opt = getopt(argc, argv, "Hf:p:W:")) != -1) {
+		switch(opt) {
+			case 'H':
+				huge = true;
+				break;
+			case 'p':
+				journaldir = optarg;
+				break;
+			case 'f':
+				setframelen(atol(optarg));
+				break;
+			case 'W':
+				if(atoi(optarg) > 0)
+					weight = atoi(optarg);
+				break;
+			default:
+				optind = argc; // print usage
+		}
+	}
+
+	if(argc - optind < 1) {
+		printf("USAGE: %s [-H] [-f frame bytes] [-p log directory] [-W placement weight] <hostname> [port]\n", argv[0]);
 		return RETVAL_INVALID_ARG;
 	}
 	
 	printf("here0\n");
 	
-	if(!rslvconn(&master_fd, argv[1], PORT_MASTER_REGISTER)) {
-		printf("FATAL: Couldn't resolve or connect to host: %s\n", argv[1]);
+	signal(SIGPIPE, SIG_IGN); // a client hanging up on a direct read shows up as a failed write instead
+	stor_lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+	pthread_rwlock_init(stor_lock, NULL);
+	stor = storinit(huge);
+	if(journaldir) {
+		if(!(journal = storlogopen(journaldir, stor))) {
+			printf("FATAL: Couldn't use log directory: %s\n", journaldir);
+			return RETVAL_INVALID_ARG;
+		}
+		printf("Restored %lu pairs from %s\n", stor->count, journaldir);
+	}
+
+	// Start taking direct reads before the master can tell anyone about us
+	in_port_t ctlport = argc-optind-1 ? atoi(argv[optind+1]) : PORT_SLAVE_MAIN;
+	in_port_t readport = ctlport + (PORT_SLAVE_READS - PORT_SLAVE_MAIN);
+	int *readsrc = (int *)malloc(sizeof(int));
+	*readsrc = tcpskt(readport, MAX_READER_BACKLOG);
+	pthread_t readthr;
+	memset(&readthr, 0, sizeof readthr);
+	pthread_create(&readthr, NULL, readers, readsrc);
+	
+	if(!rslvconn(&master_fd, argv[optind], PORT_MASTER_REGISTER)) {
+		printf("FATAL: Couldn't resolve or connect to host: %s\n", argv[optind]);
 		return RETVAL_CONN_FAILED;
 	}
 	
 	printf("here1\n");
 	
-	if(!sendpkt(master_fd, OPC_HEY, NULL, 0)) {
+	if(!sendhey(master_fd, PROTO_LATEST, readport, stor->count, weight)) {
 		handle_error("registration sendpkt()");
 	}
 	
@@ -59,31 +142,40 @@ int main(int argc, char **argv) {
 	
 	pthread_create(&thread, NULL, heartbeat, NULL);
 	
-	int incoming = tcpskt(argc-2 ? atoi(argv[2]) : PORT_SLAVE_MAIN, 1);
+	int incoming = tcpskt(ctlport, 1);
 	usleep(10000); // TODO fix this crap
 	if((incoming = accept(incoming, NULL, 0)) == -1) {
 		handle_error("incoming from master accept()");
 	}
 
-	stor = new unordered_map<const char *, struct cabbage *>();
-
 	while(true) {
 		char *payld = NULL;
-		bool inbound = false; // whether it's a HRZ
-		if(recvpkt(incoming, OPC_PLZ|OPC_HRZ, &payld, &inbound, 0, false)) {
-			if(inbound) { // HRZ
-				struct cabbage *head = (struct cabbage *)malloc(sizeof(struct cabbage));
-				head->junk = NULL;
-				recvfile(incoming, &head->junk, &head->len);
-				(*stor)[payld] = head;
+		uint16_t opcode = 0;
+		if(recvpkt(incoming, OPC_PLZ|OPC_HRZ|OPC_HEY, &payld, &opcode, 0, false)) {
+			if(opcode == OPC_HEY) { // master has upgraded our control connection
+				setproto(incoming, *payld ? (uint8_t)*payld : PROTO_V1);
+				free(payld);
+				if(getproto(incoming) >= PROTO_V3)
+					serve_tagged(incoming); // never returns
+			}
+			else if(opcode == OPC_HRZ) {
+				struct cabbage head = {0, NULL, false};
+				if(recvfile(incoming, &head.junk, &head.len)) { // the master calls the value off with anything but an STF
+					pthread_rwlock_wrlock(stor_lock);
+					storput(stor, payld, head.junk, head.len);
+					pthread_rwlock_unlock(stor_lock);
+					if(journal)
+						storlogput(journal, stor, payld, head.junk, head.len);
+				}
+				free(head.junk);
+				free(payld);
 			}
 			else { // PLZ
-				if(!stor->count(payld)) // Couldn't find it!
+				const struct storrec *illbeback = storget(stor, payld);
+				if(!illbeback) // Couldn't find it!
 					handle_error("find()");
 
-				struct cabbage *illbeback = stor->at(payld);
-
-				if(!sendfile(incoming, payld, illbeback->junk, illbeback->len))
+				if(!sendfile(incoming, payld, storval(illbeback), illbeback->len, 0, illbeback->packed))
 					handle_error("sendfile()");
 
 				free(payld);
@@ -91,14 +183,349 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	for(auto it = stor->begin(); it != stor->end(); ++it) {
-		free((char *)it->first);
-		free(it->second->junk);
-		it->second->junk = NULL;
-		free(it->second);
-		it->second = NULL;
+	if(journal)
+		storlogclose(journal);
+	storfree(stor);
+	pthread_rwlock_destroy(stor_lock);
+	free(stor_lock);
+}
+
+// Serves requests from a master that tags each frame, so it can have several outstanding at once.  Writes are reassembled by tag, acknowledged with a THX once stored (or discarded without a word if an FKU calls them off), and reads for missing keys get an FKU instead of killing us.  CPYs are pulled on threads of their own, and answered once they're through.
+// Accepts: the control connection, which must speak version 3
+void serve_tagged(int incoming) {
+	unordered_map<uint32_t, struct upload *> uploads; // writes that are still arriving
+	int copies[2]; // copy threads post their jobs to the one end as they finish, for us to read from the other
+	if(pipe(copies))
+		handle_error("pipe()");
+	
+	while(true) {
+		// Finish off any copies that come through while we wait on the master
+		while(!buffered(incoming)) {
+			struct pollfd watch[2] = {{incoming, POLLIN, 0}, {copies[0], POLLIN, 0}};
+			if(poll(watch, 2, -1) < 0)
+				continue;
+			if(watch[1].revents & POLLIN)
+				finishcopies(incoming, copies[0]);
+			if(watch[0].revents)
+				break;
+		}
+
+		uint16_t opcode;
+		uint64_t len;
+		uint32_t tag;
+		if(!recvhdr(incoming, &opcode, &len, &tag))
+			handle_error("recvhdr()");
+
+		if(opcode == OPC_PLZ || opcode == OPC_HRZ) {
+			const char *payld;
+			if(!viewall(incoming, len, &payld))
+				handle_error("viewall()");
+
+			if(opcode == OPC_HRZ) {
+				struct upload *up = (struct upload *)malloc(sizeof(struct upload));
+				up->key = strdup(payld);
+				up->head = (struct cabbage *)malloc(sizeof(struct cabbage));
+				up->cap = MAX_PACKET_LEN;
+				up->head->junk = (char *)malloc(up->cap);
+				up->head->len = 0;
+				up->head->packed = ispacked(incoming);
+				uploads[tag] = up;
+			}
+			else if(const struct storrec *illbeback = storget(stor, payld)) {
+				if(!sendfile(incoming, payld, storval(illbeback), illbeback->len, tag, illbeback->packed))
+					handle_error("sendfile()");
+			}
+			else { // Couldn't find it!
+				sendpkt(incoming, OPC_FKU, NULL, 0, tag);
+			}
+		}
+		else if(opcode == OPC_MGT) {
+			const char *keys;
+			if(!viewall(incoming, len, &keys))
+				handle_error("viewall()");
+
+			// Answer for every key in the order asked, then say we're through
+			for(const char *key = keys; key < keys + len; key += strlen(key) + 1) {
+				const struct storrec *found = storget(stor, key);
+				if(!found)
+					sendpkt(incoming, OPC_FKU, key, 0, tag);
+				else if(!sendfile(incoming, key, storval(found), found->len, tag, found->packed))
+					handle_error("sendfile()");
+			}
+			sendpkt(incoming, OPC_THX, NULL, 0, tag);
+		}
+		else if(opcode == OPC_WUT) {
+			if(!skipall(incoming, len))
+				handle_error("skipall()");
+
+			// Tell the master everything we have, and how big each value is
+			string inventory;
+			storeach(stor, [&inventory](const struct storrec *rec) {
+				inventory.append(storkey(rec), rec->keylen + 1);
+				inventory.append((const char *)&rec->len, sizeof rec->len);
+			});
+			sendpkt(incoming, OPC_WUT, inventory.data(), inventory.size(), tag);
+		}
+		else if(opcode == OPC_CPY) {
+			const char *order;
+			if(!viewall(incoming, len, &order))
+				handle_error("viewall()");
+
+			// Pull the values on a thread of their own, so that a slow peer can't hold up everything else the master asks of us
+			struct copyjob *job = (struct copyjob *)malloc(sizeof(struct copyjob));
+			job->tag = tag;
+			job->order = (char *)malloc(len + 1);
+			memcpy(job->order, order, len + 1);
+			job->len = len;
+			job->deadline = nowms() + COPY_TIMEOUT;
+			job->donefd = copies[1];
+			job->keys = new vector<char *>();
+			job->vals = new vector<struct cabbage>();
+			pthread_t thread;
+			if(pthread_create(&thread, NULL, each_copy, job)) {
+				if(write(copies[1], &job, sizeof job) != sizeof job) // it'll be answered with nothing copied
+					handle_error("write()");
+			}
+			else
+				pthread_detach(thread);
+		}
+		else if(opcode == OPC_NIX) {
+			const char *keys;
+			if(!viewall(incoming, len, &keys))
+				handle_error("viewall()");
+
+			// The master has handed these off to other slaves, so make room for something else
+			for(const char *key = keys; key < keys + len; key += strlen(key) + 1) {
+				pthread_rwlock_wrlock(stor_lock);
+				bool had = stordel(stor, key);
+				pthread_rwlock_unlock(stor_lock);
+				if(had && journal)
+					storlogdel(journal, stor, key);
+			}
+			sendpkt(incoming, OPC_THX, NULL, 0, tag);
+		}
+		else if(opcode == OPC_MPT) {
+			char *pairs = (char *)malloc(len);
+			if(!readall(incoming, pairs, len))
+				handle_error("readall()");
+
+			// Make room for the whole batch up front, then store it all before acknowledging
+			size_t off = 0;
+			size_t count = 0;
+			const char *key;
+			const char *val;
+			uint64_t vlen;
+			bool packed;
+			while(nextpair(pairs, len, &off, &key, &val, &vlen, &packed))
+				++count;
+			pthread_rwlock_wrlock(stor_lock);
+			storreserve(stor, stor->count + count);
+
+			off = 0;
+			while(nextpair(pairs, len, &off, &key, &val, &vlen, &packed))
+				storput(stor, key, val, vlen, packed);
+			pthread_rwlock_unlock(stor_lock);
+			if(journal) {
+				off = 0;
+				while(nextpair(pairs, len, &off, &key, &val, &vlen, &packed))
+					storlogput(journal, stor, key, val, vlen, packed);
+			}
+			free(pairs);
+			sendpkt(incoming, OPC_THX, NULL, 0, tag);
+		}
+		else if(opcode == OPC_STF && uploads.count(tag)) {
+			struct upload *up = uploads[tag];
+			struct cabbage *head = up->head;
+			if(len) {
+				if(up->cap - head->len <= len) {
+					while(up->cap - head->len <= len)
+						up->cap *= 2;
+					head->junk = (char *)realloc(head->junk, up->cap);
+				}
+				if(!readall(incoming, head->junk + head->len, len))
+					handle_error("readall()");
+				head->len += len;
+				continue;
+			}
+
+			// That's the whole value, so swap it in for any older one
+			pthread_rwlock_wrlock(stor_lock);
+			storput(stor, up->key, head->junk, head->len, head->packed);
+			pthread_rwlock_unlock(stor_lock);
+			if(journal)
+				storlogput(journal, stor, up->key, head->junk, head->len, head->packed);
+			uploads.erase(tag);
+			free(head->junk);
+			free(head);
+			free(up->key);
+			free(up);
+			sendpkt(incoming, OPC_THX, NULL, 0, tag);
+		}
+		else if(opcode == OPC_FKU && uploads.count(tag)) {
+			if(!skipall(incoming, len))
+				handle_error("skipall()");
+
+			// The writer gave up partway, so keep whatever value we had before
+			struct upload *up = uploads[tag];
+			uploads.erase(tag);
+			free(up->head->junk);
+			free(up->head);
+			free(up->key);
+			free(up);
+		}
+		else if(!skipall(incoming, len))
+			handle_error("skipall()");
+	}
+}
+
+// Pulls the values a CPY names straight from the slave it names, then hands them back to the control connection's thread to be stored
+// Accepts: the copy job, which is posted to its donefd once we're through
+void *each_copy(void *jobp) {
+	struct copyjob *job = (struct copyjob *)jobp;
+	const size_t loclen = sizeof(in_addr_t) + sizeof(in_port_t);
+	int peer = job->len >= loclen ? peerconn(job->order) : -1;
+	for(const char *key = job->order + loclen; peer >= 0 && key < job->order + job->len && nowms() < job->deadline; key += strlen(key) + 1) {
+		uint16_t answer = 0;
+		if(!sendpkt(peer, OPC_PLZ, key, 0) || !recvpkt(peer, OPC_HRZ|OPC_FKU, NULL, &answer, NULL, false))
+			break;
+		if(answer == OPC_FKU)
+			continue;
+		struct cabbage copy = {0, NULL, ispacked(peer)};
+		if(!recvfile(peer, &copy.junk, &copy.len)) {
+			free(copy.junk);
+			break;
+		}
+		job->keys->push_back(strdup(key));
+		job->vals->push_back(copy);
+	}
+	if(peer >= 0) {
+		rdforget(peer);
+		close(peer);
+	}
+
+	if(write(job->donefd, &job, sizeof job) != sizeof job)
+		handle_error("write()");
+	return NULL;
+}
+
+// Stores the values pulled by whichever copy threads have finished, and tells the master which ones we got.  Copies that took too long are thrown away instead, as the master may already have given up on them and moved on.
+// Accepts: the control connection, and the end of the pipe that the copy threads post themselves to
+void finishcopies(int incoming, int donefd) {
+	struct copyjob *job;
+	struct pollfd more = {donefd, POLLIN, 0};
+	while(poll(&more, 1, 0) > 0 && read(donefd, &job, sizeof job) == sizeof job) {
+		bool late = nowms() >= job->deadline;
+		string copied;
+		for(size_t each = 0; each < job->keys->size(); ++each) {
+			const char *key = (*job->keys)[each];
+			struct cabbage &copy = (*job->vals)[each];
+			if(!late) {
+				pthread_rwlock_wrlock(stor_lock);
+				storput(stor, key, copy.junk, copy.len, copy.packed);
+				pthread_rwlock_unlock(stor_lock);
+				if(journal)
+					storlogput(journal, stor, key, copy.junk, copy.len, copy.packed);
+				uint64_t vlen = copy.len;
+				copied.append(key, strlen(key) + 1);
+				copied.append((const char *)&vlen, sizeof vlen);
+			}
+			free((*job->keys)[each]);
+			free(copy.junk);
+		}
+		sendpkt(incoming, OPC_CPY, copied.data(), copied.size(), job->tag);
+
+		delete job->keys;
+		delete job->vals;
+		free(job->order);
+		free(job);
 	}
-	delete stor;
+}
+
+// Connects to another slave's direct read port, just as a client would
+// Accepts: where it takes direct reads (address, then port, both in network byte order)
+// Returns: file descriptor speaking version 2 or later, or -1 if it couldn't be reached
+int peerconn(const char *loc) {
+	struct sockaddr_in dest;
+	memset(&dest, 0, sizeof dest);
+	dest.sin_family = AF_INET;
+	memcpy(&dest.sin_addr.s_addr, loc, sizeof dest.sin_addr.s_addr);
+	memcpy(&dest.sin_port, loc + sizeof dest.sin_addr.s_addr, sizeof dest.sin_port);
+
+	int peer = socket(AF_INET, SOCK_STREAM, 0);
+	if(peer < 0)
+		return -1;
+	struct timeval stall = {PEER_STALL_SECS, 0};
+	setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof stall);
+	setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof stall); // which bounds connecting, too
+	setproto(peer, PROTO_V1);
+	struct pollfd answer = {peer, POLLIN, 0};
+	uint8_t version = PROTO_V1;
+	if(connect(peer, (const struct sockaddr *)&dest, sizeof dest) || !sendhey(peer, PROTO_CLIENT_LATEST) || poll(&answer, 1, HANDSHAKE_TIMEOUT) <= 0 || !recvhey(peer, &version) || version < PROTO_V2) {
+		rdforget(peer);
+		close(peer);
+		return -1;
+	}
+	setproto(peer, version);
+	return peer;
+}
+
+// Accepts clients that the master has pointed our way, giving each its own thread
+// Accepts: the listening socket, which we take ownership of
+void *readers(void *srcp) {
+	int src = *(int *)srcp;
+	free(srcp);
+	while(true) {
+		int client = accept(src, NULL, NULL);
+		if(client < 0)
+			continue;
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, each_reader, (void *)(intptr_t)client))
+			close(client);
+		else
+			pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+// Answers PLZs from a single client until it hangs up.  Clients must upgrade to version 2 before asking for anything.
+// Accepts: the client's file descriptor, which we take ownership of
+void *each_reader(void *fdp) {
+	int client = (int)(intptr_t)fdp;
+	setproto(client, PROTO_V1);
+
+	uint16_t opcode;
+	uint64_t len;
+	char offer[MAX_PACKET_LEN];
+	if(recvhdr(client, &opcode, &len, NULL) && opcode == OPC_HEY && len && len <= sizeof offer && readall(client, offer, len) && (uint8_t)*offer >= PROTO_V2) {
+		uint8_t version = min((uint8_t)*offer, PROTO_CLIENT_LATEST);
+		sendhey(client, version);
+		setproto(client, version);
+
+		const char *key;
+		while(recvview(client, &opcode, &key, &len, NULL) && opcode == OPC_PLZ) {
+			// Copy the value out, so that a slow client can't hold up the master's writes
+			struct cabbage copy = {0, NULL, false};
+			pthread_rwlock_rdlock(stor_lock);
+			if(const struct storrec *found = storget(stor, key)) {
+				copy.len = found->len;
+				copy.junk = (char *)malloc(copy.len + 1);
+				memcpy(copy.junk, storval(found), copy.len);
+				copy.packed = found->packed;
+			}
+			pthread_rwlock_unlock(stor_lock);
+
+			bool sent = copy.junk ? sendfile(client, key, copy.junk, copy.len, 0, copy.packed) : sendpkt(client, OPC_FKU, key, 0);
+			free(copy.junk);
+			if(!sent)
+				break;
+		}
+	}
+
+	rdforget(client);
+	close(client);
+	return NULL;
 }
 
 void *heartbeat(void *ptr) {
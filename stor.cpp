@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2013 Sol Boucher and Lane Lawley
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stor.h"
+#include "common.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using namespace hashhash;
+using std::function;
+using std::sort;
+using std::vector;
+
+// Heads each chunk, so that they can all be found again when it's time to give them back
+struct hashhash::storchunk {
+	struct storchunk *next;
+	size_t len;
+};
+
+// Precedes each record in a log segment, which is followed by the null-terminated key and then the value
+struct logrec {
+	uint32_t keylen; // with LOG_PACKED set if the value is packed
+	uint32_t check; // from the hashes of the key and value, so that a torn or garbled tail is never mistaken for a record; inverted for a tombstone, which has no value
+	uint64_t len; // of the value
+};
+
+static const size_t REC_ALIGN = sizeof(uint64_t);
+static const uint32_t LOG_PACKED = 1U << 31;
+static const char *const SEGMENT_FMT = "%s/%020lu.seg";
+
+static size_t findslot(const struct stortable *, const char *, size_t, uint64_t);
+static void storgrow(struct stortable *, size_t);
+static struct storrec *recalloc(struct stortable *, size_t);
+static void recfree(struct stortable *, struct storrec *);
+static void newchunk(struct stortable *);
+static uint32_t logcheck(const char *, size_t, const char *, uint64_t);
+static void logappend(struct storlog *, const char *, size_t, const char *, uint64_t, bool, bool);
+static void logroll(struct storlog *);
+static void logcompact(struct storlog *, const struct stortable *);
+static uint64_t logreplay(const char *, struct stortable *);
+
+// Sets up an empty store
+// Accepts: whether to back its records with huge pages where the system allows
+// Returns: the store, which should eventually be passed to storfree()
+struct stortable *hashhash::storinit(bool huge) {
+	struct stortable *st = (struct stortable *)calloc(1, sizeof(struct stortable));
+	st->huge = huge;
+
+	// Size classes grow geometrically, so that no record wastes more than about a fifth of its slab space
+	size_t numclasses = 0;
+	for(size_t size = STOR_MIN_CLASS; size <= STOR_MAX_CLASS; size = (size * STOR_CLASS_GROWTH_PCT / 100 + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN)
+		++numclasses;
+	st->classes = (size_t *)malloc(numclasses * sizeof *st->classes);
+	st->numclasses = numclasses;
+	size_t size = STOR_MIN_CLASS;
+	for(uint8_t cls = 0; cls < st->numclasses; ++cls) {
+		st->classes[cls] = size;
+		size = (size * STOR_CLASS_GROWTH_PCT / 100 + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN;
+	}
+	st->freed = (struct storrec **)calloc(st->numclasses, sizeof *st->freed);
+
+	st->cap = STOR_MIN_SLOTS;
+	st->slots = (struct storslot *)calloc(st->cap, sizeof *st->slots);
+	return st;
+}
+
+// Gives back everything a store ever took from the system
+// Accepts: the store, which mustn't be used again
+void hashhash::storfree(struct stortable *st) {
+	for(size_t idx = 0; idx < st->cap; ++idx)
+		if(st->slots[idx].rec && st->slots[idx].rec->cls == st->numclasses)
+			free(st->slots[idx].rec);
+	while(st->chunks) {
+		struct storchunk *next = st->chunks->next;
+		munmap(st->chunks, st->chunks->len);
+		st->chunks = next;
+	}
+	free(st->slots);
+	free(st->classes);
+	free(st->freed);
+	free(st);
+}
+
+// Looks up a key
+// Accepts: the store and the key
+// Returns: the record, which is only good until the store is next changed, or NULL if there's no such key
+const struct storrec *hashhash::storget(const struct stortable *st, const char *key) {
+	size_t keylen = strlen(key);
+	return st->slots[findslot(st, key, keylen, keyhash(key, keylen))].rec;
+}
+
+// Stores a copy of a value under a key, replacing any older value
+// Accepts: the store, the key, the value, its length, and whether it's packed
+void hashhash::storput(struct stortable *st, const char *key, const char *val, uint64_t len, bool packed) {
+	if((st->count + 1) * 100 > st->cap * STOR_MAX_LOAD_PCT)
+		storgrow(st, st->cap * 2);
+
+	size_t keylen = strlen(key);
+	struct storrec *rec = recalloc(st, sizeof(struct storrec) + keylen + 1 + len + 1);
+	rec->len = len;
+	rec->keylen = keylen;
+	rec->packed = packed;
+	char *dest = (char *)(rec + 1);
+	memcpy(dest, key, keylen + 1);
+	dest += keylen + 1;
+	memcpy(dest, val, len);
+	dest[len] = '\0';
+
+	uint64_t hash = keyhash(key, keylen);
+	struct storslot *slot = st->slots + findslot(st, key, keylen, hash);
+	if(slot->rec) {
+		st->bytes -= slot->rec->keylen + slot->rec->len;
+		recfree(st, slot->rec);
+	} else {
+		++st->count;
+	}
+	st->bytes += keylen + len;
+	slot->hash = hash;
+	slot->rec = rec;
+}
+
+// Forgets a key and its value
+// Accepts: the store and the key
+// Returns: whether there was such a key
+bool hashhash::stordel(struct stortable *st, const char *key) {
+	size_t keylen = strlen(key);
+	size_t mask = st->cap - 1;
+	size_t hole = findslot(st, key, keylen, keyhash(key, keylen));
+	if(!st->slots[hole].rec)
+		return false;
+	st->bytes -= keylen + st->slots[hole].rec->len;
+	recfree(st, st->slots[hole].rec);
+	--st->count;
+
+	// Shift back any later records in the same run that would otherwise become unreachable
+	for(size_t next = (hole + 1) & mask; st->slots[next].rec; next = (next + 1) & mask) {
+		size_t home = st->slots[next].hash & mask;
+		if(((next - home) & mask) >= ((next - hole) & mask)) {
+			st->slots[hole] = st->slots[next];
+			hole = next;
+		}
+	}
+	st->slots[hole].rec = NULL;
+	return true;
+}
+
+// Makes room for a number of keys up front, so that a big batch doesn't regrow the table along the way
+// Accepts: the store and how many keys it'll soon hold in total
+void hashhash::storreserve(struct stortable *st, size_t count) {
+	size_t cap = st->cap;
+	while(count * 100 > cap * STOR_MAX_LOAD_PCT)
+		cap *= 2;
+	if(cap != st->cap)
+		storgrow(st, cap);
+}
+
+// Finds the key within a record
+// Accepts: the record
+// Returns: the null-terminated key
+const char *hashhash::storkey(const struct storrec *rec) {
+	return (const char *)(rec + 1);
+}
+
+// Finds the value within a record
+// Accepts: the record
+// Returns: the value, which is followed by a null terminator that isn't counted in its length
+const char *hashhash::storval(const struct storrec *rec) {
+	return storkey(rec) + rec->keylen + 1;
+}
+
+// Visits every record in a table, in no particular order
+// Accepts: the table, and what to do with each record (which mustn't change the table)
+void hashhash::storeach(const struct stortable *st, const function<void(const struct storrec *)> &visit) {
+	for(size_t idx = 0; idx < st->cap; ++idx)
+		if(st->slots[idx].rec)
+			visit(st->slots[idx].rec);
+}
+
+// Loads every record from a log directory's segments into a table, then starts a fresh segment for whatever comes next.  Later segments win over earlier ones, and a segment that ends partway through a record is read only up to there.
+// Accepts: the directory, which is created if it doesn't exist, and an empty table
+// Returns: the log, which should eventually be passed to storlogclose(), or NULL if the directory couldn't be used
+struct storlog *hashhash::storlogopen(const char *dir, struct stortable *st) {
+	mkdir(dir, 0755);
+	DIR *listing = opendir(dir);
+	if(!listing)
+		return NULL;
+	vector<uint64_t> seqs;
+	while(struct dirent *entry = readdir(listing)) {
+		unsigned long seq;
+		int namelen = 0;
+		if(sscanf(entry->d_name, "%lu.seg%n", &seq, &namelen) == 1 && !entry->d_name[namelen])
+			seqs.push_back(seq);
+	}
+	closedir(listing);
+	sort(seqs.begin(), seqs.end());
+
+	struct storlog *log = (struct storlog *)calloc(1, sizeof(struct storlog));
+	log->dir = strdup(dir);
+	log->fd = -1;
+	log->oldest = seqs.size() ? seqs.front() : 1;
+	log->seq = seqs.size() ? seqs.back() : 0;
+	char path[strlen(dir) + 32];
+	for(uint64_t seq : seqs) {
+		sprintf(path, SEGMENT_FMT, dir, (unsigned long)seq);
+		log->bytes += logreplay(path, st);
+	}
+	logroll(log);
+	return log;
+}
+
+// Appends a record to the log, starting a new segment or compacting the whole log if it's grown long enough.  Call after putting the record into the table.
+// Accepts: the log, the table it's keeping, the key, the value, its length, and whether it's packed
+void hashhash::storlogput(struct storlog *log, const struct stortable *st, const char *key, const char *val, uint64_t len, bool packed) {
+	logappend(log, key, strlen(key), val, len, packed, false);
+	if(log->seglen >= STOR_SEGMENT_LEN)
+		logroll(log);
+
+	uint64_t live = st->bytes + st->count * (sizeof(struct logrec) + 1);
+	if(log->bytes > STOR_SEGMENT_LEN && log->bytes > live * STOR_COMPACT_RATIO)
+		logcompact(log, st);
+}
+
+// Appends a tombstone to the log, so that a key that's been deleted from the table stays deleted on replay.  Call after deleting it from the table.
+// Accepts: the log, the table it's keeping, and the key
+void hashhash::storlogdel(struct storlog *log, const struct stortable *st, const char *key) {
+	logappend(log, key, strlen(key), "", 0, false, true);
+	if(log->seglen >= STOR_SEGMENT_LEN)
+		logroll(log);
+
+	uint64_t live = st->bytes + st->count * (sizeof(struct logrec) + 1);
+	if(log->bytes > STOR_SEGMENT_LEN && log->bytes > live * STOR_COMPACT_RATIO)
+		logcompact(log, st);
+}
+
+// Flushes and closes a log
+// Accepts: the log, which mustn't be used again
+void hashhash::storlogclose(struct storlog *log) {
+	fdatasync(log->fd);
+	close(log->fd);
+	free(log->dir);
+	free(log);
+}
+
+// Probes for a key's slot.  The table is never full, so this always ends.
+// Accepts: the store, the key, its length, and its hash
+// Returns: the index of the slot holding the key, or of the empty slot where it would go
+size_t findslot(const struct stortable *st, const char *key, size_t keylen, uint64_t hash) {
+	size_t mask = st->cap - 1;
+	for(size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+		const struct storslot *slot = st->slots + idx;
+		if(!slot->rec || (slot->hash == hash && slot->rec->keylen == keylen && !memcmp(storkey(slot->rec), key, keylen)))
+			return idx;
+	}
+}
+
+// Moves every record into a bigger table
+// Accepts: the store and the new number of slots, which must be a power of two
+void storgrow(struct stortable *st, size_t cap) {
+	struct storslot *old = st->slots;
+	size_t oldcap = st->cap;
+	st->slots = (struct storslot *)calloc(cap, sizeof *st->slots);
+	st->cap = cap;
+
+	size_t mask = cap - 1;
+	for(size_t each = 0; each < oldcap; ++each) {
+		if(!old[each].rec)
+			continue;
+		size_t idx = old[each].hash & mask;
+		while(st->slots[idx].rec)
+			idx = (idx + 1) & mask;
+		st->slots[idx] = old[each];
+	}
+	free(old);
+}
+
+// Finds space for a record, reusing a freed one of the same size class if there is one
+// Accepts: the store and the bytes needed
+// Returns: the record, with only its cls filled in
+struct storrec *recalloc(struct stortable *st, size_t need) {
+	uint8_t cls = 0;
+	while(cls < st->numclasses && st->classes[cls] < need)
+		++cls;
+
+	struct storrec *rec;
+	if(cls == st->numclasses) {
+		rec = (struct storrec *)malloc(need);
+	} else if(st->freed[cls]) {
+		rec = st->freed[cls];
+		st->freed[cls] = *(struct storrec **)rec;
+	} else {
+		if(st->chunkleft < st->classes[cls])
+			newchunk(st);
+		rec = (struct storrec *)st->chunk;
+		st->chunk += st->classes[cls];
+		st->chunkleft -= st->classes[cls];
+	}
+	rec->cls = cls;
+	return rec;
+}
+
+// Returns a record's space to its size class, or to the system if it had its own allocation
+// Accepts: the store and the record
+void recfree(struct stortable *st, struct storrec *rec) {
+	if(rec->cls == st->numclasses) {
+		free(rec);
+		return;
+	}
+	*(struct storrec **)rec = st->freed[rec->cls];
+	st->freed[rec->cls] = rec;
+}
+
+// Maps a fresh chunk to carve records from, abandoning whatever's left of the last one
+// Accepts: the store
+void newchunk(struct stortable *st) {
+	void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if(st->huge)
+		mem = mmap(NULL, STOR_CHUNK_LEN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+	if(mem == MAP_FAILED) {
+		// No huge pages reserved, so settle for transparent ones if we can get them
+		mem = mmap(NULL, STOR_CHUNK_LEN, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED)
+			handle_error("mmap()");
+#ifdef MADV_HUGEPAGE
+		if(st->huge)
+			madvise(mem, STOR_CHUNK_LEN, MADV_HUGEPAGE);
+#endif
+	}
+
+	struct storchunk *chunk = (struct storchunk *)mem;
+	chunk->next = st->chunks;
+	chunk->len = STOR_CHUNK_LEN;
+	st->chunks = chunk;
+	size_t hdrlen = (sizeof *chunk + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN;
+	st->chunk = (char *)mem + hdrlen;
+	st->chunkleft = STOR_CHUNK_LEN - hdrlen;
+}
+
+// Checksums a record as it's laid out in the log
+// Accepts: the key, its length, the value, and its length
+// Returns: the checksum
+uint32_t logcheck(const char *key, size_t keylen, const char *val, uint64_t len) {
+	return (uint32_t)(keyhash(key, keylen) ^ (keyhash(val, len) >> 1) ^ len);
+}
+
+// Writes one record to the end of the current segment
+// Accepts: the log, the key, its length, the value, its length, whether it's packed, and whether the record is a tombstone instead
+void logappend(struct storlog *log, const char *key, size_t keylen, const char *val, uint64_t len, bool packed, bool tombstone) {
+	uint32_t check = logcheck(key, keylen, val, len);
+	struct logrec hdr = {(uint32_t)keylen | (packed ? LOG_PACKED : 0), tombstone ? ~check : check, len};
+	struct iovec iov[3] = {{&hdr, sizeof hdr}, {(void *)key, keylen + 1}, {(void *)val, len}};
+	size_t total = sizeof hdr + keylen + 1 + len;
+	size_t sent = 0;
+	int first = 0;
+	while(sent < total) {
+		ssize_t wrote = writev(log->fd, iov + first, 3 - first);
+		if(wrote < 0 && errno == EINTR)
+			continue;
+		if(wrote <= 0)
+			handle_error("log writev()");
+		sent += wrote;
+		for(size_t skip = wrote; skip; ) {
+			if(skip >= iov[first].iov_len) {
+				skip -= iov[first].iov_len;
+				++first;
+			} else {
+				iov[first].iov_base = (char *)iov[first].iov_base + skip;
+				iov[first].iov_len -= skip;
+				skip = 0;
+			}
+		}
+	}
+	log->seglen += total;
+	log->bytes += total;
+}
+
+// Makes sure the current segment has reached the disk, then starts the next one
+// Accepts: the log
+void logroll(struct storlog *log) {
+	if(log->fd >= 0) {
+		fdatasync(log->fd);
+		close(log->fd);
+	}
+
+	char path[strlen(log->dir) + 32];
+	sprintf(path, SEGMENT_FMT, log->dir, (unsigned long)++log->seq);
+	if((log->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644)) < 0)
+		handle_error("log open()");
+	log->seglen = 0;
+}
+
+// Rewrites the live records into new segments, then deletes every older one.  A crash partway through is harmless, since the older segments are only deleted once the new ones are on disk, and replay lets the new ones win.
+// Accepts: the log and the table it's keeping
+void logcompact(struct storlog *log, const struct stortable *st) {
+	logroll(log);
+	uint64_t first = log->seq;
+	uint64_t stale = log->bytes;
+	storeach(st, [log](const struct storrec *rec) {
+		logappend(log, storkey(rec), rec->keylen, storval(rec), rec->len, rec->packed, false);
+		if(log->seglen >= STOR_SEGMENT_LEN)
+			logroll(log);
+	});
+	logroll(log);
+
+	char path[strlen(log->dir) + 32];
+	for(uint64_t seq = log->oldest; seq < first; ++seq) {
+		sprintf(path, SEGMENT_FMT, log->dir, (unsigned long)seq);
+		unlink(path);
+	}
+	log->oldest = first;
+	log->bytes -= stale;
+}
+
+// Puts every intact record from one segment into a table, and deletes the key of every tombstone
+// Accepts: the segment's path and the table
+// Returns: how many bytes of the segment were intact
+uint64_t logreplay(const char *path, struct stortable *st) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	struct stat info;
+	if(fstat(fd, &info) || !info.st_size) {
+		close(fd);
+		return 0;
+	}
+	char *seg = (char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(seg == MAP_FAILED)
+		return 0;
+	madvise(seg, info.st_size, MADV_SEQUENTIAL);
+
+	uint64_t size = info.st_size;
+	uint64_t off = 0;
+	while(size - off >= sizeof(struct logrec)) {
+		struct logrec hdr;
+		memcpy(&hdr, seg + off, sizeof hdr);
+		bool packed = hdr.keylen & LOG_PACKED;
+		hdr.keylen &= ~LOG_PACKED;
+		const char *key = seg + off + sizeof hdr;
+		uint64_t left = size - off - sizeof hdr;
+		if(left <= hdr.keylen || left - hdr.keylen - 1 < hdr.len || key[hdr.keylen])
+			break;
+		const char *val = key + hdr.keylen + 1;
+		uint32_t check = logcheck(key, hdr.keylen, val, hdr.len);
+		if(hdr.check == check)
+			storput(st, key, val, hdr.len, packed);
+		else if(hdr.check == ~check && !hdr.len)
+			stordel(st, key);
+		else
+			break;
+		off += sizeof hdr + hdr.keylen + 1 + hdr.len;
+	}
+
+	munmap(seg, size);
+	return off;
+}
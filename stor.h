@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Sol Boucher and Lane Lawley
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with it.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STOR_H
+#define STOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace hashhash {
+	const size_t STOR_CHUNK_LEN = 2 << 20; // one huge page
+	const size_t STOR_MIN_CLASS = 32; // smallest record carved out of a chunk
+	const size_t STOR_MAX_CLASS = 256 << 10; // records bigger than this get their own allocation
+	const unsigned int STOR_CLASS_GROWTH_PCT = 125; // each size class is this much bigger than the last
+	const unsigned int STOR_MAX_LOAD_PCT = 75; // grow the table before it's fuller than this
+	const size_t STOR_MIN_SLOTS = 64;
+	const uint64_t STOR_SEGMENT_LEN = 64 << 20; // start a new log segment once the current one is this long
+	const unsigned int STOR_COMPACT_RATIO = 2; // compact the log once it's this many times longer than the live records in it would be
+
+	// A key and its value, laid out back to back (each null terminated) right after this header
+	struct storrec {
+		uint64_t len; // of the value
+		uint32_t keylen;
+		uint8_t cls; // size class this was carved from, or the number of classes if it was allocated on its own
+		bool packed; // whether the value is as packval() left it
+	};
+
+	struct storslot {
+		uint64_t hash; // of the key, so that most mismatches never touch the record
+		struct storrec *rec; // NULL if the slot is empty
+	};
+
+	// An open-addressing table of records packed into large chunks
+	struct stortable {
+		struct storslot *slots;
+		size_t cap; // slots, always a power of two
+		size_t count; // slots in use
+		size_t *classes; // each size class's record size, smallest first
+		uint8_t numclasses;
+		struct storrec **freed; // per size class, records that may be reused, each pointing to the next
+		char *chunk; // where the next record will be carved from
+		size_t chunkleft;
+		struct storchunk *chunks; // every chunk we've mapped, so we can give them back
+		bool huge; // whether to ask for chunks backed by huge pages
+		size_t bytes; // of keys and values held
+	};
+
+	// An append-only log of every record put into a table, split into numbered segment files
+	struct storlog {
+		char *dir;
+		int fd; // the segment being appended to
+		uint64_t seq; // its number; older segments have smaller ones
+		uint64_t seglen; // bytes written to it so far
+		uint64_t oldest; // number of the oldest segment that may still be on disk
+		uint64_t bytes; // in every segment on disk
+	};
+
+	struct stortable *storinit(bool);
+	void storfree(struct stortable *);
+	const struct storrec *storget(const struct stortable *, const char *);
+	void storput(struct stortable *, const char *, const char *, uint64_t, bool = false);
+	bool stordel(struct stortable *, const char *);
+	void storreserve(struct stortable *, size_t);
+	const char *storkey(const struct storrec *);
+	const char *storval(const struct storrec *);
+	void storeach(const struct stortable *, const std::function<void(const struct storrec *)> &);
+
+	struct storlog *storlogopen(const char *, struct stortable *);
+	void storlogput(struct storlog *, const struct stortable *, const char *, const char *, uint64_t, bool = false);
+	void storlogdel(struct storlog *, const struct stortable *, const char *);
+	void storlogclose(struct storlog *);
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include "common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace hashhash;
+using std::string;
+
+static int failures = 0;
+
+// Notes a failed expectation, without stopping the rest of the tests
+// Accepts: whether it held, what was expected
+static void expect(bool held, const char *what) {
+	if(!held) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		++failures;
+	}
+}
+
+// Makes a connected pair of sockets that have agreed on a protocol version
+// Accepts: spot for the pair, the version
+static void mkpair(int *pair, uint8_t version) {
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+		handle_error("socketpair()");
+	setproto(pair[0], version);
+	setproto(pair[1], version);
+}
+
+// Closes both ends of a pair of sockets, as the real programs do
+// Accepts: the pair
+static void rmpair(int *pair) {
+	for(int end = 0; end < 2; ++end) {
+		rdforget(pair[end]);
+		close(pair[end]);
+	}
+}
+
+// Captures the bytes sendpkt() puts on the wire for a packet, so they can be fed in however we please
+// Accepts: protocol version, opcode, payload, request tag
+// Returns: the bytes
+static string wire(uint8_t version, uint16_t opcode, const char *data, uint32_t tag) {
+	int pair[2];
+	mkpair(pair, version);
+	sendpkt(pair[0], opcode, data, 0, tag);
+	shutdown(pair[0], SHUT_WR);
+	string bytes;
+	char chunk[512];
+	ssize_t got;
+	while((got = read(pair[1], chunk, sizeof chunk)) > 0)
+		bytes.append(chunk, got);
+	rmpair(pair);
+	return bytes;
+}
+
+// Packs a value and checks that it unpacks to the same bytes, and that a truncated copy is turned away
+// Accepts: the value, its length, whether it ought to be worth packing
+static void roundtrip(const char *val, size_t len, bool worthit) {
+	char *packed = NULL;
+	size_t plen = 0;
+	bool didpack = packval(val, len, &packed, &plen);
+	expect(didpack == worthit, "packval() decides what's worth packing");
+	if(!didpack)
+		return;
+	expect(plen < len, "packed value is smaller");
+
+	char *unpacked = NULL;
+	size_t ulen = 0;
+	expect(unpackval(packed, plen, &unpacked, &ulen), "unpackval() accepts what packval() made");
+	expect(ulen == len && unpacked && !memcmp(unpacked, val, len), "value survives the round trip");
+	free(unpacked);
+
+	unpacked = NULL;
+	bool truncok = unpackval(packed, plen - 1, &unpacked, &ulen);
+	expect(!truncok, "unpackval() turns away a truncated value");
+	if(truncok)
+		free(unpacked);
+	free(packed);
+}
+
+// Round trips values that pack well, badly, and not at all
+static void test_pack() {
+	size_t len = 1 << 20;
+	char *val = (char *)malloc(len);
+
+	memset(val, 0, len);
+	roundtrip(val, len, true);
+
+	for(size_t idx = 0; idx < len; ++idx)
+		val[idx] = "the quick brown fox "[idx % 20];
+	roundtrip(val, len, true);
+
+	srand(1);
+	for(size_t idx = 0; idx < len; ++idx)
+		val[idx] = rand();
+	roundtrip(val, len, false);
+
+	// Random stretches between repeats, so that both literal and repeat counts spill past a nibble
+	for(size_t idx = 0; idx < len; idx += 4096)
+		memset(val + idx, 'x', 1024);
+	roundtrip(val, len, true);
+
+	roundtrip("short", 5, false);
+	free(val);
+}
+
+// Reads back several packets that arrived together, the latter ones out of the buffer alone
+static void test_pipelined() {
+	int pair[2];
+	mkpair(pair, PROTO_V3);
+	sendpkt(pair[0], OPC_PLZ, "one", 0, 1);
+	sendpkt(pair[0], OPC_HRZ, "two", 0, 2);
+	sendpkt(pair[0], OPC_PLZ, "three", 0, 3);
+	const char *names[] = {"one", "two", "three"};
+	const uint16_t opcodes[] = {OPC_PLZ, OPC_HRZ, OPC_PLZ};
+	for(uint32_t which = 0; which < 3; ++which) {
+		uint16_t opcode;
+		const char *payld;
+		uint64_t len;
+		uint32_t tag;
+		expect(recvview(pair[1], &opcode, &payld, &len, &tag), "pipelined packet arrives");
+		expect(opcode == opcodes[which] && tag == which + 1, "pipelined packet keeps its opcode and tag");
+		expect(len == strlen(names[which]) && !strcmp(payld, names[which]), "pipelined packet keeps its payload");
+		expect(buffered(pair[1]) == (which < 2), "later packets are already buffered");
+	}
+	rmpair(pair);
+}
+
+// Feeds packets in a byte at a time, splitting headers and payloads, then two at once
+static void test_partial() {
+	string bytes = wire(PROTO_V2, OPC_PLZ, "trickle", 0);
+	int pair[2];
+	mkpair(pair, PROTO_V2);
+	struct partpkt pkt;
+	memset(&pkt, 0, sizeof pkt);
+	for(size_t idx = 0; idx < bytes.size(); ++idx) {
+		if(write(pair[0], bytes.data() + idx, 1) != 1)
+			handle_error("write()");
+		int state = recvpart(pair[1], &pkt);
+		expect(state == (idx + 1 == bytes.size() ? 1 : 0), "partial packet completes only with its last byte");
+	}
+	expect(pkt.opcode == OPC_PLZ && pkt.len == 7 && !strcmp(pkt.payld, "trickle"), "trickled packet is intact");
+	free(pkt.payld);
+
+	string twice = bytes + wire(PROTO_V2, OPC_PLZ, "again", 0);
+	if(write(pair[0], twice.data(), twice.size()) != (ssize_t)twice.size())
+		handle_error("write()");
+	memset(&pkt, 0, sizeof pkt);
+	expect(recvpart(pair[1], &pkt) == 1 && !strcmp(pkt.payld, "trickle"), "first of two packets read at once");
+	free(pkt.payld);
+	memset(&pkt, 0, sizeof pkt);
+	expect(recvpart(pair[1], &pkt) == 1 && !strcmp(pkt.payld, "again"), "second of two packets read at once");
+	free(pkt.payld);
+	memset(&pkt, 0, sizeof pkt);
+	expect(recvpart(pair[1], &pkt) == 0, "nothing more to read");
+	rmpair(pair);
+}
+
+// Claims frames too long to be requests, which must be turned away before anything is allocated for them
+static void test_oversized() {
+	const uint64_t lens[] = {UINT64_MAX, DEFAULT_FRAME_LEN + 1};
+	for(uint64_t len : lens) {
+		int pair[2];
+		mkpair(pair, PROTO_V2);
+		uint8_t hdr[11];
+		uint16_t opcode = OPC_MGT;
+		memcpy(hdr, &opcode, sizeof opcode);
+		hdr[2] = FLG_WIDE;
+		memcpy(hdr + 3, &len, sizeof len);
+		if(write(pair[0], hdr, sizeof hdr) != sizeof hdr)
+			handle_error("write()");
+		struct partpkt pkt;
+		memset(&pkt, 0, sizeof pkt);
+		expect(recvpart(pair[1], &pkt) == -1 && !pkt.payld, "overlong request is refused");
+		rmpair(pair);
+	}
+}
+
+// Closes a connection with bytes still buffered, then checks that whatever gets its descriptor next doesn't see them
+static void test_reuse() {
+	int pair[2];
+	mkpair(pair, PROTO_V4);
+	sendpkt(pair[0], OPC_HRZ, "packed", 0, 0, true);
+	sendpkt(pair[0], OPC_PLZ, "stale", 0);
+	uint16_t opcode;
+	const char *payld;
+	uint64_t len;
+	expect(recvview(pair[1], &opcode, &payld, &len, NULL) && ispacked(pair[1]), "packed flag is read");
+	expect(buffered(pair[1]), "stale packet is buffered");
+	int old = pair[1];
+	rmpair(pair);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+		handle_error("socketpair()");
+	int reused = pair[0] == old ? pair[0] : pair[1];
+	expect(reused == old, "descriptor gets reused");
+	expect(getproto(reused) == PROTO_V1, "reused descriptor starts at version 1");
+	expect(!buffered(reused) && !ispacked(reused), "reused descriptor starts with an empty buffer");
+
+	setproto(pair[0], PROTO_V2);
+	setproto(pair[1], PROTO_V2);
+	int other = reused == pair[0] ? pair[1] : pair[0];
+	sendpkt(other, OPC_PLZ, "fresh", 0);
+	expect(recvview(reused, &opcode, &payld, &len, NULL) && !strcmp(payld, "fresh"), "reused descriptor reads the new connection");
+	rmpair(pair);
+}
+
+int main() {
+	test_pack();
+	test_pipelined();
+	test_partial();
+	test_oversized();
+	test_reuse();
+	if(failures) {
+		fprintf(stderr, "%d failed\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}